@@ -0,0 +1,211 @@
+import multiprocessing
+import json
+import os
+import sys
+import tempfile
+import time
+import edge_server
+from telemetry_store import TelemetryStore
+
+# Ingest benchmark: messages/s handled by the edge server with 1, 2, 4... worker processes, against the local broker
+# (mqtt_broker/mosquitto.conf). Usage: python benchmark_ingest.py [max_workers] [messages] [ordered] [offline]
+# The /average messages are published with QoS 1 by PUBLISHERS processes, each one impersonating NODES_PER_PUBLISHER
+# nodes. With the ordered option, /average is partitioned by node instead of shared (see edge_server.run_worker).
+# The workers persist the messages to a temporary telemetry store, as the edge server does.
+# With the offline option, no broker is used: each worker calls edge_server.on_message directly on its share of the
+# messages (every message with the ordered option, the other nodes being dropped by the partition filter). This
+# measures the handling cost of the edge server alone, the ceiling the broker-based ingest can reach.
+PUBLISHERS = 4
+NODES_PER_PUBLISHER = 8
+SUBSCRIBE_WAIT_S = 3
+DRAIN_TIMEOUT_S = 120
+
+
+class OfflineMessage:
+    """
+    Message handed to edge_server.on_message by the offline benchmark, with the fields of an MQTT message it reads.
+    """
+
+    def __init__(self, topic, payload):
+        self.topic = topic
+        self.payload = payload
+
+
+def average_payloads(publisher_index):
+    """
+    Returns the /average batches of the nodes impersonated by a publisher.
+    """
+    return [
+        json.dumps(
+            {"node_id": f"bench{publisher_index:02d}{node:03d}", "aggregation_results": ["0.123", "0.456", "0.789", "1.012"]},
+            separators=(",", ":"),
+        ).encode()
+        for node in range(NODES_PER_PUBLISHER)
+    ]
+
+
+def handle_offline(worker_index, worker_count, messages, ordered_average, handled, store_dir, start):
+    """
+    Handles the share of the messages of one worker without a broker, as the shared or partitioned subscription would.
+
+    Args:
+        worker_index (int): The index of this worker.
+        worker_count (int): The number of workers.
+        messages (int): The number of messages published by all the nodes.
+        ordered_average (bool): Whether /average is partitioned by node instead of shared.
+        handled (multiprocessing.Value): Counter of the messages handled by all the workers.
+        store_dir (str): The directory of the telemetry store.
+        start (multiprocessing.Event): Set when all the workers should start.
+
+    Returns:
+        None
+    """
+    sys.stdout = open(os.devnull, "w")
+    edge_server.store = TelemetryStore(store_dir, f"w{worker_index}")
+    userdata = {
+        "worker_index": worker_index,
+        "worker_count": worker_count,
+        "node_state_topics": edge_server.NODE_STATE_TOPICS + (("/average",) if ordered_average else ()),
+        "control_message": None,
+        "handled": handled,
+    }
+    payloads = [payload for publisher in range(PUBLISHERS) for payload in average_payloads(publisher)]
+    # The shared subscription hands each message to one worker, the partitioned one hands every message to all
+    indices = range(messages) if ordered_average else range(worker_index, messages, worker_count)
+
+    start.wait()
+    for i in indices:
+        edge_server.on_message(None, userdata, OfflineMessage("/average", payloads[i % len(payloads)]))
+    edge_server.store.flush()
+
+
+def run_offline(worker_count, messages, ordered_average):
+    """
+    Measures the handling throughput of worker_count workers without a broker.
+
+    Args:
+        worker_count (int): The number of edge server workers.
+        messages (int): The number of messages to handle.
+        ordered_average (bool): Whether /average is partitioned by node instead of shared.
+
+    Returns:
+        float: The messages/s handled by the workers.
+    """
+    handled = multiprocessing.Value("i", 0)
+    store_dir = tempfile.mkdtemp(prefix="telemetry-")
+    start = multiprocessing.Event()
+    workers = [
+        multiprocessing.Process(
+            target=handle_offline, args=(i, worker_count, messages, ordered_average, handled, store_dir, start)
+        )
+        for i in range(worker_count)
+    ]
+    for worker in workers:
+        worker.start()
+    time.sleep(1)
+
+    start_time = time.perf_counter()
+    start.set()
+    for worker in workers:
+        worker.join()
+    return handled.value / (time.perf_counter() - start_time)
+
+
+def publish_messages(publisher_index, count, start):
+    """
+    Publishes count batches of averages to /average, round-robin over the nodes of this publisher.
+
+    Args:
+        publisher_index (int): The index of this publisher, used for its client id and node ids.
+        count (int): The number of messages to publish.
+        start (multiprocessing.Event): Set when all the publishers should start.
+
+    Returns:
+        None
+    """
+    client = edge_server.create_client(f"benchmark-publisher-{publisher_index}")
+    client.max_inflight_messages_set(1000)
+    client.loop_start()
+    payloads = average_payloads(publisher_index)
+
+    start.wait()
+    info = None
+    for i in range(count):
+        info = client.publish("/average", payloads[i % NODES_PER_PUBLISHER], qos=1)
+    if info is not None:
+        info.wait_for_publish()
+    client.loop_stop()
+    client.disconnect()
+
+
+def run(worker_count, messages, ordered_average):
+    """
+    Measures the ingest throughput of worker_count workers.
+
+    Args:
+        worker_count (int): The number of edge server workers.
+        messages (int): The number of messages to publish.
+        ordered_average (bool): Whether /average is partitioned by node instead of shared.
+
+    Returns:
+        tuple: The messages/s handled by the workers and the messages/s published.
+    """
+    handled = multiprocessing.Value("i", 0)
+    store_dir = tempfile.mkdtemp(prefix="telemetry-")
+    workers = [
+        multiprocessing.Process(
+            target=edge_server.run_worker, args=(i, worker_count, ordered_average, None, handled, True, store_dir, None)
+        )
+        for i in range(worker_count)
+    ]
+    for worker in workers:
+        worker.start()
+    time.sleep(SUBSCRIBE_WAIT_S)
+
+    start = multiprocessing.Event()
+    per_publisher = messages // PUBLISHERS
+    publishers = [multiprocessing.Process(target=publish_messages, args=(i, per_publisher, start)) for i in range(PUBLISHERS)]
+    for publisher in publishers:
+        publisher.start()
+    time.sleep(1)
+
+    start_time = time.perf_counter()
+    start.set()
+    for publisher in publishers:
+        publisher.join()
+    published_time = time.perf_counter() - start_time
+
+    total = per_publisher * PUBLISHERS
+    while handled.value < total and time.perf_counter() - start_time < DRAIN_TIMEOUT_S:
+        time.sleep(0.01)
+    handled_time = time.perf_counter() - start_time
+
+    for worker in workers:
+        worker.terminate()
+        worker.join()
+    if handled.value < total:
+        print(f"  {worker_count} workers: only {handled.value} of {total} messages handled in {DRAIN_TIMEOUT_S} s")
+    return handled.value / handled_time, total / published_time
+
+
+if __name__ == "__main__":
+    max_workers = int(sys.argv[1]) if len(sys.argv) > 1 else multiprocessing.cpu_count()
+    messages = int(sys.argv[2]) if len(sys.argv) > 2 else 40000
+    ordered_average = "ordered" in sys.argv[3:]
+    offline = "offline" in sys.argv[3:]
+
+    print(f"Ingest of {messages} /average messages from {PUBLISHERS * NODES_PER_PUBLISHER} nodes, "
+          f"/average {'partitioned by node' if ordered_average else 'shared'}{', offline' if offline else ''} "
+          f"({multiprocessing.cpu_count()} CPUs)")
+    print(f"{'workers':>8} {'handled msg/s':>14} {'speedup':>8} {'published msg/s':>16}")
+    baseline = None
+    worker_count = 1
+    while worker_count <= max_workers:
+        if offline:
+            rate, publish_rate = run_offline(worker_count, messages, ordered_average), None
+        else:
+            rate, publish_rate = run(worker_count, messages, ordered_average)
+        baseline = baseline or rate
+        published = f"{publish_rate:>16.0f}" if publish_rate is not None else f"{'-':>16}"
+        print(f"{worker_count:>8} {rate:>14.0f} {rate / baseline:>8.2f} {published}")
+        worker_count *= 2
@@ -1,10 +1,107 @@
 import paho.mqtt.client as mqtt
 from datetime import datetime
 import json
+import math
+import multiprocessing
+import os
+import struct
+import sys
+import time
+import zlib
+from collections import deque
+from typing import List, Optional, Tuple
 from pydantic import BaseModel
+from telemetry_store import FLUSH_INTERVAL_S, TelemetryStore, serve_http
+
+# Raw window uploads: chunks waiting to be reassembled, keyed by (node_id, window_id)
+RAW_CHUNK_HEADER = struct.Struct("<10sIHH")
+RAW_CODEC_BLOCK_SIZE = 64
+raw_chunks = {}
+
+# Reporting state of each node: message counts and the last two values received, used to fill in the windows the
+# node didn't send because of its dead-band or predictive reporting policy
+node_reports = {}
+
+# End-to-end latency of each node, per stage, over the last LATENCY_HISTORY windows. The percentiles are printed every
+# LATENCY_REPORT_EVERY traced messages of a node.
+LATENCY_STAGES = ("dsp", "batch", "network", "edge", "total")
+LATENCY_HISTORY = 1000
+LATENCY_REPORT_EVERY = 10
+node_latencies = {}
+
+# Spectral analysis offloaded by the nodes: the sketches (strongest peaks and band envelope of a small FFT) of each node
+# over the last SPECTRUM_HISTORY re-tunings. The history is restarted when the envelope moves by more than
+# SPECTRUM_CHANGE_DB in any band, so the recommended rate can drop after a real change. Neighbours are the other nodes
+# that sent a sketch in the last SPECTRUM_NEIGHBOUR_MAX_AGE_S seconds; a component they see is kept for a node whose
+# envelope still shows it within SPECTRUM_NEIGHBOUR_MARGIN_DB of the threshold.
+SPECTRUM_HISTORY = 8
+SPECTRUM_CHANGE_DB = 10.0
+SPECTRUM_NEIGHBOUR_MAX_AGE_S = 300
+SPECTRUM_NEIGHBOUR_MARGIN_DB = 10.0
+node_spectra = {}
+
+# Compressive windows (randomly timed samples on a grid, see compressive.c on the node): the edge server recovers up to
+# COMPRESSIVE_MAX_TONES tones, more than the node, until the residual energy falls below COMPRESSIVE_TOLERANCE
+COMPRESSIVE_MAX_TONES = 12
+COMPRESSIVE_TOLERANCE = 1e-4
+
+# Resource statistics of the nodes (/stats): a task is flagged when less than STATS_LOW_STACK_BYTES of its stack were
+# never used, and the heap when its largest free block is below STATS_FRAGMENTATION_RATIO of the free heap
+STATS_LOW_STACK_BYTES = 512
+STATS_FRAGMENTATION_RATIO = 0.5
+
+# Ingest workers (python edge_server.py workers <N>): the broker delivers each message of a stateless topic to only one
+# of the workers through an MQTT v5 shared subscription of the SHARE_GROUP group. The topics whose handling keeps state
+# per node (NODE_STATE_TOPICS, and /average with the ordered option) are received by every worker instead, each one
+# handling the nodes of its partition, so all the messages of a node are handled in order by the same process.
+# /spectrum is also recorded by the other workers, since the sketches of all the nodes are the neighbours compared by
+# recommend_sampling_rate, but only the worker of the node answers it.
+SHARE_GROUP = "edge"
+NODE_STATE_TOPICS = ("/raw", "/report", "/spectrum", "/config")
+
+# Telemetry store (telemetry_store.py): /average, /energy, /experiment and the /report energy are persisted under
+# STORE_DIR, and the first worker serves queries on http://localhost:QUERY_PORT/query. The /report energy is tagged with
+# the last configuration the node applied.
+STORE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "telemetry")
+QUERY_PORT = 8080
+store = None
+node_configs = {}
+
+# TLS certificates of the edge server, see mqtt_broker/certs/generate_certs.sh
+CERTS_DIR = "/home/bernardoribeiro/Documents/GitHub/IoT-individual-assignment_/edge-server/mqtt_broker/certs"
+
+def topic_filter(userdata, topic):
+    """
+    Returns the filter this process subscribes to for a topic: the topic itself for a single process or for a topic
+    partitioned by node, or the shared subscription of the worker group.
+    """
+    if userdata["worker_count"] == 1 or topic in userdata["node_state_topics"]:
+        return topic
+    return f"$share/{SHARE_GROUP}/{topic}"
+
+
+def node_partition(node_id, worker_count):
+    """
+    Returns the worker handling the partitioned topics of a node, stable across processes (unlike hash()).
+    """
+    return zlib.crc32(node_id.encode()) % worker_count
+
+
+def message_node_id(msg):
+    """
+    Extracts the node id of a message without decoding it: from the header of the /raw chunks, or from the node_id
+    field of the JSON messages, which the node always writes without whitespace.
+    """
+    if msg.topic == "/raw":
+        return msg.payload[:10].rstrip(b"\0").decode(errors="replace")
+    start = msg.payload.find(b'"node_id":"')
+    if start < 0:
+        return ""
+    start += len(b'"node_id":"')
+    return msg.payload[start:msg.payload.find(b'"', start)].decode(errors="replace")
 
 # MQTT Callbacks
-def on_connect(client, userdata, flags, rc):
+def on_connect(client, userdata, flags, rc, properties=None):
     """
     Callback function that is called when the client successfully connects to the broker.
 
@@ -12,10 +109,24 @@ def on_connect(client, userdata, flags, rc):
         client (mqtt.Client): The client instance for this callback.
         userdata: The private user data as set in the `mqtt.Client` constructor.
         flags: Response flags sent by the broker.
-        rc (int): The connection result code.
+        rc (ReasonCode): The connection result code.
+        properties: The MQTT v5 properties of the CONNACK.
 
     Subscribes to the topic where the average data is published (/average).
     Subscribes to the topic where the energy data is published (/energy).
+    Subscribes to the topic where the compressed raw windows are published (/raw).
+    Subscribes to the topic where the experiment results are published (/experiment).
+    Subscribes to the topic where the applied configurations are published (/config).
+    Subscribes to the topic where the reporting policy statistics are published (/report).
+    Subscribes to the topic where the clock synchronization requests are published (/timesync).
+    Subscribes to the topic where the spectral sketches are published (/spectrum).
+    Subscribes to the topic where the rollup windows and queries are published (/rollup).
+    Subscribes to the topic where the compressive windows are published (/compressive).
+    Subscribes to the topic where the spectral change events are published (/spectral_change).
+    Subscribes to the topic where the FFT kernels selected at boot are published (/fft_backend).
+    Subscribes to the topic where the resource statistics are published (/stats).
+    Sends the experiment matrix or configuration passed on the command line to the node control topic.
+    With several workers, the subscriptions are shared or partitioned by node (see topic_filter).
 
     Returns:
         None
@@ -25,10 +136,49 @@ def on_connect(client, userdata, flags, rc):
         print("Connected successfully to broker")
 
         # Subscribe to the topic where the average data is published (/average)
-        client.subscribe("/average")
+        client.subscribe(topic_filter(userdata, "/average"))
 
         # Subscribe to the topic where the energy data is published (/energy)
-        client.subscribe("/energy")
+        client.subscribe(topic_filter(userdata, "/energy"))
+
+        # Subscribe to the topic where the compressed raw windows are published (/raw)
+        client.subscribe(topic_filter(userdata, "/raw"), qos=1)
+
+        # Subscribe to the topic where the experiment runner results are published (/experiment)
+        client.subscribe(topic_filter(userdata, "/experiment"), qos=1)
+
+        # Subscribe to the topic where the nodes confirm the configuration applied (/config)
+        client.subscribe(topic_filter(userdata, "/config"), qos=1)
+
+        # Subscribe to the topic where the nodes publish the statistics of their reporting policy (/report)
+        client.subscribe(topic_filter(userdata, "/report"))
+
+        # Subscribe to the topic where the nodes request the clock of the edge server (/timesync)
+        client.subscribe(topic_filter(userdata, "/timesync"))
+
+        # Subscribe to the topic where the nodes offloading their spectral analysis publish their sketches (/spectrum)
+        client.subscribe(topic_filter(userdata, "/spectrum"), qos=1)
+
+        # Subscribe to the topic where the nodes publish their rollup windows and the answers to queries (/rollup)
+        client.subscribe(topic_filter(userdata, "/rollup"))
+
+        # Subscribe to the topic where the nodes publish the samples of their compressive windows (/compressive)
+        client.subscribe(topic_filter(userdata, "/compressive"))
+
+        # Subscribe to the topic where the nodes notify a change of their spectrum (/spectral_change)
+        client.subscribe(topic_filter(userdata, "/spectral_change"), qos=1)
+
+        # Subscribe to the topic where the nodes publish the FFT kernel selected for each size at boot (/fft_backend)
+        client.subscribe(topic_filter(userdata, "/fft_backend"), qos=1)
+
+        # Subscribe to the topic where the nodes publish the load of their CPU, stacks, heap and outbox (/stats)
+        client.subscribe(topic_filter(userdata, "/stats"))
+
+        # Send the control message given on the command line, if any
+        if userdata.get("control_message"):
+            topic, payload = userdata.pop("control_message")
+            client.publish(topic, json.dumps(payload), qos=1)
+            print(f"Control message sent to {topic}: {payload}")
     else:
         print("Connect failed with code", rc)
 
@@ -42,7 +192,18 @@ def on_message(client, userdata, msg):
         userdata: Any user-defined data that was passed to the MQTT client.
         msg: The received message object.
 
-    On this function, the received AverageData over the topic /average is validated and printed.
+    On this function, the received AverageData over the topic /average is validated and printed, and the latency of
+    each stage is recorded if the message is traced.
+    Binary chunks received over the topic /raw are handed over to handle_raw_chunk.
+    Clock synchronization requests received over the topic /timesync are answered by handle_timesync.
+    Spectral sketches received over the topic /spectrum are answered with a sampling rate by recommend_sampling_rate.
+    Rollup windows received over the topic /rollup are stored as the series rollup_<window>s.
+    Compressive windows received over the topic /compressive are recovered again by recover_tones.
+    Spectral change events received over the topic /spectral_change are printed and their distance is stored.
+    FFT kernel selections received over the topic /fft_backend are printed with their speedup over the default kernel.
+    Resource statistics received over the topic /stats are summarized by print_resource_stats and stored.
+    Messages of a topic partitioned by node are ignored if the node belongs to another worker, except that the
+    sketches of /spectrum are still recorded as neighbours.
 
     Returns:
         None
@@ -50,6 +211,25 @@ def on_message(client, userdata, msg):
     Raises:
         None
     """
+    # Time of reception on the edge clock, before any processing
+    received_us = time.time_ns() // 1000
+
+    if userdata["worker_count"] > 1 and msg.topic in userdata["node_state_topics"]:
+        if node_partition(message_node_id(msg), userdata["worker_count"]) != userdata["worker_index"]:
+            if msg.topic == "/spectrum":
+                record_neighbour_sketch(msg.payload)
+            return
+    if userdata["handled"] is not None:
+        with userdata["handled"].get_lock():
+            userdata["handled"].value += 1
+
+    if msg.topic == "/timesync":
+        handle_timesync(client, msg.payload, received_us)
+        return
+    if msg.topic == "/raw":
+        handle_raw_chunk(msg.payload)
+        return
+
     print(f"Message received {msg.payload}")
     try:
         data = json.loads(msg.payload)
@@ -64,47 +244,759 @@ def on_message(client, userdata, msg):
                 details=data['details'],
             )
             print(f"Energy data received: {data}")
+            details = {"details": data.details}
+            store.append("energy_optimal", data.node_id, received_us, float(data.energy_optimal), details)
+            store.append("energy_original", data.node_id, received_us, float(data.energy_original), details)
             return
-        elif msg.topic == "/average":
+        elif msg.topic == "/experiment":
             # Validate incoming data
-            data = AverageData(
-                node_id=data['node_id'],
-                aggregation_result=data['aggregation_result'],
+            data = ExperimentData(**data)
+            print(f"Experiment result received: {data}")
+            run = data.model_dump(include={"signal", "base_rate", "time_window", "repetitions", "qos", "fft_size"})
+            store.append("energy_optimal", data.node_id, received_us, data.energy_optimal, run)
+            store.append("energy_original", data.node_id, received_us, data.energy_original, run)
+            return
+        elif msg.topic == "/report":
+            data = ReportData(**data)
+            state = node_reports.setdefault(data.node_id, new_report_state())
+            # The edge counts are only complete if this worker receives every /average message of the node
+            if userdata["worker_count"] == 1 or "/average" in userdata["node_state_topics"]:
+                edge = (
+                    f"{state['messages'] - state['messages_at_report']} messages since the last report, "
+                    f"{state['messages']} total, {state['reconstructed']} windows reconstructed"
+                )
+            else:
+                edge = "counts unavailable, /average is shared between the workers (use the ordered option)"
+            print(
+                f"Reporting statistics of {data.node_id} ({data.report}): {data.sent} windows sent, {data.suppressed} suppressed, "
+                f"energy {data.energy:.7f} Wh | edge: {edge}"
+            )
+            if data.outbox is not None:
+                print(
+                    f"Outbox of {data.node_id}: {data.outbox.enqueued} enqueued, {data.outbox.dropped} dropped, "
+                    f"{data.outbox.bytes} bytes (peak {data.outbox.peak_bytes}){', congested' if data.outbox.congested else ''}"
+                )
+            state["messages_at_report"] = state["messages"]
+            store.append("energy", data.node_id, received_us, data.energy, node_configs.get(data.node_id))
+            return
+        elif msg.topic == "/spectrum":
+            data = SpectrumData(**data)
+            recommend_sampling_rate(client, data)
+            return
+        elif msg.topic == "/spectral_change":
+            data = SpectralChangeData(**data)
+            if data.distance < 0:
+                print(f"Spectral baseline of {data.node_id} (fs {data.fs} Hz, n {data.n}): peaks {data.peaks}")
+            else:
+                print(
+                    f"Spectral change of {data.node_id} by {data.distance:.2f} dB (fs {data.fs} Hz, n {data.n}): "
+                    f"peaks {data.previous} -> {data.peaks}"
+                )
+                store.append("spectral_change", data.node_id, received_us, data.distance)
+            return
+        elif msg.topic == "/fft_backend":
+            data = FftBackendData(**data)
+            print(f"FFT kernels of {data.node_id} ({'cached' if data.cached else 'benchmarked'}):")
+            for size in data.sizes:
+                speedup = size.default_cycles / size.cycles if size.cycles > 0 else 0
+                print(f"  {size.n} points: {size.backend}, {size.cycles} cycles ({speedup:.2f}x the default kernel)")
+            return
+        elif msg.topic == "/stats":
+            data = StatsData(**data)
+            print_resource_stats(data)
+            # The loads are -1 if the node was built without the FreeRTOS run-time stats
+            if data.cpu >= 0:
+                store.append("cpu_load", data.node_id, received_us, data.cpu)
+            store.append("heap_free", data.node_id, received_us, data.heap.free)
+            store.append("heap_largest_block", data.node_id, received_us, data.heap.largest)
+            store.append("outbox_bytes", data.node_id, received_us, data.outbox.bytes)
+            for name, cpu, stack_free in data.tasks:
+                if cpu >= 0:
+                    store.append("task_cpu", data.node_id, received_us, cpu, {"task": name})
+                store.append("stack_free", data.node_id, received_us, stack_free, {"task": name})
+            return
+        elif msg.topic == "/compressive":
+            data = CompressiveData(**data)
+            mean, tones, residual = recover_tones(data.indices, data.values, data.n, data.grid_rate)
+            print(
+                f"Compressive window of {data.node_id} ({len(data.values)} samples): node mean {data.mean:.4f}, "
+                f"tones {data.tones}, residual {data.residual:.2e} | edge mean {mean:.4f}, "
+                f"tones {[[round(f, 3), round(a, 4)] for f, a in tones]}, residual {residual:.2e}"
+            )
+            return
+        elif msg.topic == "/rollup":
+            data = RollupData(**data)
+            print(
+                f"{'Query' if data.query else 'Rollup'} of {data.node_id} over {data.window} s: mean {data.mean:.4f}, "
+                f"min {data.min:.4f}, max {data.max:.4f}, std {data.std:.4f} ({data.count} samples)"
             )
+            # Answers to queries are only printed, the rollup windows are stored like the averages of their length
+            if not data.query and data.count > 0:
+                store.append(f"rollup_{data.window}s", data.node_id, received_us, data.mean)
+            return
+        elif msg.topic == "/config":
+            print(f"Configuration applied by {data['node_id']}: {data['config']}")
+            node_configs[data["node_id"]] = data["config"]
+            return
+        elif msg.topic == "/average":
+            # Validate incoming data, either a single result or a batch of results
+            if 'aggregation_results' in data:
+                data = AverageBatchData(**data)
+                # Stored at the time of the last sample of each window if traced, else at the reception
+                timestamps = data.trace.sample_end if data.trace is not None else [received_us] * len(data.aggregation_results)
+                # A worker only sees every window of the node if /average is not shared between the workers
+                if data.windows is not None and (userdata["worker_count"] == 1 or "/average" in userdata["node_state_topics"]):
+                    reconstruct_windows(data, timestamps)
+                if data.trace is not None:
+                    record_latencies(data, received_us, time.time_ns() // 1000)
+                for timestamp, result in zip(timestamps, data.aggregation_results):
+                    store.append("average", data.node_id, timestamp, float(result))
+            else:
+                data = AverageData(
+                    node_id=data['node_id'],
+                    aggregation_result=data['aggregation_result'],
+                )
+                store.append("average", data.node_id, received_us, float(data.aggregation_result))
             print(f"Valid data received: {data}")
     except Exception as e:
         print(f"Invalid data: {e}")
 
+def decode_raw_window(frame):
+    """
+    Decodes a raw window frame produced by publish_raw_window on the node.
+
+    The frame is the sampling frequency (float32) followed by the codec stream of codec.c: the number of samples
+    (uint32), the quantization step (float32) and the bit-packed zigzag delta-of-delta residuals, in blocks of
+    RAW_CODEC_BLOCK_SIZE with one width byte per block.
+
+    Args:
+        frame (bytes): The reassembled frame.
+
+    Returns:
+        tuple: The sampling frequency and the list of reconstructed samples.
+    """
+    sampling_frequency, n_samples, step = struct.unpack_from("<fIf", frame, 0)
+    pos = 12
+    samples = []
+    prev1 = prev2 = 0
+    for start in range(0, n_samples, RAW_CODEC_BLOCK_SIZE):
+        count = min(RAW_CODEC_BLOCK_SIZE, n_samples - start)
+        width = frame[pos]
+        pos += 1
+        n_bytes = (count * width + 7) // 8
+        bits = int.from_bytes(frame[pos:pos + n_bytes], "little")
+        pos += n_bytes
+        mask = (1 << width) - 1
+        for i in range(count):
+            value = (bits >> (i * width)) & mask
+            residual = (value >> 1) ^ -(value & 1)
+            q = residual + 2 * prev1 - prev2
+            samples.append(q * step)
+            prev2, prev1 = prev1, q
+    return sampling_frequency, samples
+
+
+def handle_raw_chunk(payload):
+    """
+    Stores a chunk of a raw window upload, decoding the window once all of its chunks have been received.
+
+    Each chunk starts with the node_id (10 bytes), the window_id (uint32), the chunk index (uint16) and the chunk
+    count (uint16). Incomplete windows of a node are dropped when a newer window of the same node starts arriving.
+
+    Args:
+        payload (bytes): The received chunk.
+
+    Returns:
+        None
+    """
+    try:
+        node_id, window_id, index, count = RAW_CHUNK_HEADER.unpack_from(payload, 0)
+        node_id = node_id.decode()
+        key = (node_id, window_id)
+
+        # Drop stale partial windows of the same node
+        for stale in [k for k in raw_chunks if k[0] == node_id and k[1] != window_id]:
+            print(f"Dropping incomplete raw window {stale[1]} from {node_id}")
+            del raw_chunks[stale]
+
+        chunks = raw_chunks.setdefault(key, {})
+        chunks[index] = payload[RAW_CHUNK_HEADER.size:]
+        if len(chunks) < count:
+            return
+
+        frame = b"".join(chunks[i] for i in range(count))
+        del raw_chunks[key]
+        sampling_frequency, samples = decode_raw_window(frame)
+        print(
+            f"Raw window {window_id} received from {node_id}: {len(samples)} samples at {sampling_frequency} Hz "
+            f"in {len(frame)} bytes ({len(samples) * 4 / len(frame):.2f}x), "
+            f"min {min(samples):.3f}, max {max(samples):.3f}, mean {sum(samples) / len(samples):.3f}"
+        )
+    except Exception as e:
+        print(f"Invalid raw chunk: {e}")
+
+def new_report_state():
+    """
+    Returns the initial reporting state of a node.
+    """
+    return {"messages": 0, "messages_at_report": 0, "received": 0, "reconstructed": 0, "history": []}
+
+
+def reconstruct_windows(data, timestamps):
+    """
+    Fills in the windows a node didn't send because of its reporting policy, storing them with the received ones.
+
+    The node only publishes a window when it deviates from what the edge server would predict, so the missing windows
+    are reconstructed with the same prediction: the last value received for the dead-band policy, or the linear
+    extrapolation of the last two values received for the predictive policy (see report_policy.c on the node).
+    They are stored in the average series, tagged {"reconstructed": <policy>}, at times interpolated between the
+    received windows around them, so the history has no gaps.
+
+    Args:
+        data (AverageBatchData): The received results with their window indexes.
+        timestamps (list): The time each received window is stored at, in microseconds since the epoch.
+
+    Returns:
+        None
+    """
+    state = node_reports.setdefault(data.node_id, new_report_state())
+    state["messages"] += 1
+    history = state["history"]
+
+    tag = {"reconstructed": data.report}
+    for window, result, timestamp in zip(data.windows, data.aggregation_results, timestamps):
+        value = float(result)
+
+        # The window index restarts when the node applies a new configuration
+        if history and window <= history[-1][0]:
+            history.clear()
+
+        if history:
+            w0, v0, t0 = history[-1]
+            for missing in range(w0 + 1, window):
+                if data.report == "predictive" and len(history) == 2:
+                    w1, v1, _ = history[0]
+                    predicted = v0 + (v0 - v1) / (w0 - w1) * (missing - w0)
+                else:
+                    predicted = v0
+                store.append("average", data.node_id, t0 + (timestamp - t0) * (missing - w0) // (window - w0), predicted, tag)
+                state["reconstructed"] += 1
+                print(f"Window {missing} of {data.node_id} reconstructed ({data.report}): {predicted:.3f}")
+
+        history.append((window, value, timestamp))
+        del history[:-2]
+        state["received"] += 1
+
+def handle_timesync(client, payload, received_us):
+    """
+    Answers a clock synchronization request of a node.
+
+    The response echoes the node clock when the request was sent (t1) and adds the edge clock when the request was
+    received (t2) and when the response is sent (t3), in microseconds since the epoch, from which the node estimates
+    the offset between both clocks (see timesync.c on the node).
+
+    Args:
+        client (mqtt.Client): The client used to respond.
+        payload (bytes): The request: {"node_id": "node000000", "seq": 3, "t1": 123456789}
+        received_us (int): The edge clock when the request was received.
+
+    Returns:
+        None
+    """
+    try:
+        request = json.loads(payload)
+        response = {"seq": request["seq"], "t1": request["t1"], "t2": received_us}
+        response["t3"] = time.time_ns() // 1000
+        client.publish(f"/control/{request['node_id']}/timesync", json.dumps(response), qos=0)
+    except Exception as e:
+        print(f"Invalid synchronization request: {e}")
+
+
+def percentile(values, fraction):
+    """
+    Returns the value below which the given fraction of the values fall (nearest rank).
+    """
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def sketch_highest_frequency(sketch):
+    """
+    Returns the highest frequency among the peaks of a sketch above its dB level, or 0 if there is none.
+    """
+    return max((frequency for frequency, db in sketch.peaks if db > sketch.db_level), default=0.0)
+
+
+def sketch_band_db(sketch, frequency):
+    """
+    Returns the level of the band of the envelope of a sketch containing a frequency, or None if it is above Nyquist.
+    """
+    band = int(frequency / (sketch.fs / 2) * len(sketch.bands))
+    return sketch.bands[band] if 0 <= band < len(sketch.bands) else None
+
+
+def record_sketch(sketch, now):
+    """
+    Adds a sketch to the history of its node, restarting the history if the envelope changed.
+
+    Args:
+        sketch (SpectrumData): The validated sketch.
+        now (float): The time of reception in seconds.
+
+    Returns:
+        deque: The history of the node, as (time, sketch) pairs.
+    """
+    history = node_spectra.setdefault(sketch.node_id, deque(maxlen=SPECTRUM_HISTORY))
+    if history:
+        previous = history[-1][1]
+        if previous.fs != sketch.fs or len(previous.bands) != len(sketch.bands) or max(
+            abs(a - b) for a, b in zip(previous.bands, sketch.bands)
+        ) > SPECTRUM_CHANGE_DB:
+            print(f"Spectrum of {sketch.node_id} changed, restarting its history")
+            history.clear()
+    history.append((now, sketch))
+    return history
+
+
+def record_neighbour_sketch(payload):
+    """
+    Records the sketch of a node handled by another worker, which is a neighbour of the nodes of this worker.
+
+    Args:
+        payload (bytes): The received /spectrum message.
+
+    Returns:
+        None
+    """
+    try:
+        record_sketch(SpectrumData(**json.loads(payload)), time.time())
+    except Exception as e:
+        print(f"Invalid neighbour sketch: {e}")
+
+
+def recommend_sampling_rate(client, sketch):
+    """
+    Analyzes the spectral sketch of a node and sends it the sampling rate to use.
+
+    The highest frequency is the maximum over the history of the node, so that a component missing from a single
+    sketch doesn't lower the rate. Components seen by the neighbours above that frequency are added if the envelope of
+    the node shows energy in their band, close to the threshold, as the node's own peak detection may have missed them.
+    If the node sees no peak at all, the median of its neighbours is used. The node clamps the rate to its bounds.
+
+    Args:
+        client (mqtt.Client): The client used to respond.
+        sketch (SpectrumData): The validated sketch.
+
+    Returns:
+        None
+    """
+    now = time.time()
+    history = record_sketch(sketch, now)
+
+    own = max(sketch_highest_frequency(s) for _, s in history)
+    neighbours = [
+        sketch_highest_frequency(spectra[-1][1])
+        for node_id, spectra in node_spectra.items()
+        if node_id != sketch.node_id and spectra and now - spectra[-1][0] < SPECTRUM_NEIGHBOUR_MAX_AGE_S
+    ]
+    neighbours = [frequency for frequency in neighbours if frequency > 0]
+
+    highest_frequency = own
+    if own <= 0 and neighbours:
+        highest_frequency = percentile(neighbours, 0.5)
+    for frequency in neighbours:
+        band_db = sketch_band_db(sketch, frequency)
+        if frequency > highest_frequency and band_db is not None and band_db > sketch.db_level - SPECTRUM_NEIGHBOUR_MARGIN_DB:
+            highest_frequency = frequency
+
+    if highest_frequency <= 0:
+        print(f"No peak in the spectrum of {sketch.node_id} or of its neighbours, no recommendation sent")
+        return
+    response = {"sampling_rate": round(2 * highest_frequency, 4), "highest_frequency": round(highest_frequency, 4)}
+    client.publish(f"/control/{sketch.node_id}/rate", json.dumps(response), qos=1)
+    print(
+        f"Recommended {response['sampling_rate']} Hz to {sketch.node_id} (own peak {own:.4f} Hz over {len(history)} sketches, "
+        f"{len(neighbours)} neighbours)"
+    )
+
+
+def solve_least_squares(columns, values):
+    """
+    Fits the values with the columns by least squares, through the normal equations and Gaussian elimination.
+
+    Args:
+        columns (list): The atoms evaluated at the sample times, one list per atom.
+        values (list): The samples.
+
+    Returns:
+        list: The coefficients, or None if the atoms are linearly dependent at the sample times.
+    """
+    p = len(columns)
+    rows = [
+        [sum(a * b for a, b in zip(columns[i], columns[j])) for j in range(p)] + [sum(a * v for a, v in zip(columns[i], values))]
+        for i in range(p)
+    ]
+    for i in range(p):
+        pivot = max(range(i, p), key=lambda r: abs(rows[r][i]))
+        if abs(rows[pivot][i]) < 1e-9 * len(values):
+            return None
+        rows[i], rows[pivot] = rows[pivot], rows[i]
+        for r in range(p):
+            if r != i:
+                factor = rows[r][i] / rows[i][i]
+                rows[r] = [a - factor * b for a, b in zip(rows[r], rows[i])]
+    return [rows[i][p] / rows[i][i] for i in range(p)]
+
+
+def recover_tones(indices, values, n, grid_rate, max_tones=COMPRESSIVE_MAX_TONES, tolerance=COMPRESSIVE_TOLERANCE):
+    """
+    Recovers the mean and the strongest tones of a compressive window by orthogonal matching pursuit, as the node does
+    with fewer tones (compressive_recover() in compressive.c).
+
+    The samples were taken at indices[i] / grid_rate seconds on a grid of n points, so the dictionary holds the cosines
+    and sines of the multiples of grid_rate / n below grid_rate / 2. At each iteration the frequency best correlated
+    with the residual is added and all the coefficients are fitted again.
+
+    Args:
+        indices (list): The grid indices of the samples.
+        values (list): The samples.
+        n (int): The number of points of the grid.
+        grid_rate (float): The rate of the grid in Hz.
+        max_tones (int): The maximum number of tones.
+        tolerance (float): Relative energy of the residual below which no more tones are searched.
+
+    Returns:
+        tuple: The mean of the window, the tones as [frequency, amplitude] pairs and the relative residual energy.
+    """
+    energy = sum(v * v for v in values)
+    columns = [[1.0] * len(values)]
+    bins = []
+    coefficients = solve_least_squares(columns, values)
+    residual = [v - coefficients[0] for v in values]
+    while len(bins) < max_tones and sum(r * r for r in residual) > tolerance * energy:
+        best, best_power = 0, 0.0
+        for k in range(1, n // 2):
+            if k in bins:
+                continue
+            c = s = 0.0
+            for index, r in zip(indices, residual):
+                angle = 2 * math.pi * (k * index % n) / n
+                c += r * math.cos(angle)
+                s += r * math.sin(angle)
+            if c * c + s * s > best_power:
+                best, best_power = k, c * c + s * s
+        if best == 0:
+            break
+        angles = [2 * math.pi * (best * index % n) / n for index in indices]
+        candidate = columns + [[math.cos(a) for a in angles], [math.sin(a) for a in angles]]
+        fitted = solve_least_squares(candidate, values)
+        if fitted is None:
+            break
+        columns, coefficients = candidate, fitted
+        bins.append(best)
+        residual = [v - sum(c * column[i] for c, column in zip(coefficients, columns)) for i, v in enumerate(values)]
+
+    tones = [[k * grid_rate / n, math.hypot(coefficients[1 + 2 * j], coefficients[2 + 2 * j])] for j, k in enumerate(bins)]
+    return coefficients[0], tones, (sum(r * r for r in residual) / energy if energy > 0 else 0.0)
+
+
+def print_resource_stats(data):
+    """
+    Prints the resource statistics of a node, flagging the resources close to running out.
+
+    The headroom of a node is the idle share of its CPU, the unused stack of its tightest task and its largest free
+    heap block (a larger allocation fails even with more free heap in total).
+
+    Args:
+        data (StatsData): The validated statistics.
+
+    Returns:
+        None
+    """
+    fragmentation = 1 - data.heap.largest / data.heap.free if data.heap.free > 0 else 0.0
+    cpu = f"{data.cpu:.1f} %" if data.cpu >= 0 else "unknown (no run-time stats)"
+    print(
+        f"Resources of {data.node_id} after {data.uptime:.0f} s: CPU {cpu}, heap {data.heap.free} bytes free "
+        f"(largest block {data.heap.largest}, {fragmentation * 100:.0f} % fragmented, lowest {data.heap.min_free}), "
+        f"outbox {data.outbox.bytes} bytes (peak {data.outbox.peak_bytes}, {data.outbox.dropped} dropped)"
+    )
+    for name, cpu, stack_free in sorted(data.tasks, key=lambda task: -task[1]):
+        flag = " <- low stack" if stack_free < STATS_LOW_STACK_BYTES else ""
+        print(f"  {name:16s} {cpu:6.1f} % CPU {stack_free:6d} bytes of stack free{flag}")
+    if data.heap.largest < STATS_FRAGMENTATION_RATIO * data.heap.free:
+        print(f"  Heap of {data.node_id} fragmented: largest block {data.heap.largest} of {data.heap.free} bytes free")
+
+
+def record_latencies(data, received_us, validated_us):
+    """
+    Records the latency of each stage of the traced windows of a message, printing the percentiles periodically.
+
+    All timestamps are on the edge clock, the node converting its own with the offset of the clock synchronization:
+    dsp from the last sample of the window to the aggregate being ready, batch from then to the publish, network from
+    the publish to the reception by the edge server (including the outbox of the node and the broker), edge from the
+    reception to the validation, and total from the last sample to the validation.
+
+    Args:
+        data (AverageBatchData): The validated message, with its trace.
+        received_us (int): The edge clock when the message was received.
+        validated_us (int): The edge clock when the message was validated.
+
+    Returns:
+        None
+    """
+    latencies = node_latencies.setdefault(
+        data.node_id, {"messages": 0, **{stage: deque(maxlen=LATENCY_HISTORY) for stage in LATENCY_STAGES}}
+    )
+    trace = data.trace
+    for sample_end, aggregate_ready in zip(trace.sample_end, trace.aggregate_ready):
+        latencies["dsp"].append(aggregate_ready - sample_end)
+        latencies["batch"].append(trace.enqueue - aggregate_ready)
+        latencies["network"].append(received_us - trace.enqueue)
+        latencies["edge"].append(validated_us - received_us)
+        latencies["total"].append(validated_us - sample_end)
+
+    latencies["messages"] += 1
+    if latencies["messages"] % LATENCY_REPORT_EVERY == 0:
+        print(f"Latency of {data.node_id} over the last {len(latencies['total'])} windows (p50 / p90 / p99 in ms):")
+        for stage in LATENCY_STAGES:
+            values = latencies[stage]
+            print(
+                f"  {stage:8s} {percentile(values, 0.5) / 1000:10.3f} {percentile(values, 0.9) / 1000:10.3f} "
+                f"{percentile(values, 0.99) / 1000:10.3f}"
+            )
+
+# Pydantic model for the timestamps of the windows of a traced message, on the edge clock in microseconds
+class TraceData(BaseModel):
+    sample_end: List[int]
+    aggregate_ready: List[int]
+    enqueue: int
+
 # Pydantic model for the average data, containing the node_id and the aggregation_result
 class AverageData(BaseModel):
     node_id: str
     aggregation_result: str
 
+# Pydantic model for a batch of average data, published when the node is configured with publish_batch > 1 or with
+# a dead-band / predictive reporting policy, in which case the window index of each result is included, and whenever
+# the clock of the node is synchronized, in which case the timestamps of each window are included
+class AverageBatchData(BaseModel):
+    node_id: str
+    aggregation_results: List[str]
+    windows: Optional[List[int]] = None
+    report: Optional[str] = None
+    trace: Optional[TraceData] = None
+
+# Pydantic model for the metrics of the MQTT outbox of a node
+class OutboxData(BaseModel):
+    enqueued: int
+    dropped: int
+    bytes: int
+    peak_bytes: int
+    congested: bool
+
+# Pydantic model for the statistics of the reporting policy of a node
+class ReportData(BaseModel):
+    node_id: str
+    report: str
+    sent: int
+    suppressed: int
+    energy: float
+    outbox: Optional[OutboxData] = None
+
+# Pydantic model for the spectral sketch of a node: its strongest peaks as [frequency, dB] pairs, strongest first, and
+# the maximum dB of equal bands up to Nyquist, from an n-point FFT at fs
+class SpectrumData(BaseModel):
+    node_id: str
+    fs: float
+    n: int
+    db_level: float
+    peaks: List[List[float]]
+    bands: List[float]
+
+# Pydantic model for a spectral change event of a node: the strongest peaks of the new spectrum and of the baseline it
+# differs from as [frequency, dB] pairs, and their distance in dB (-1 for a first baseline, without previous peaks)
+class SpectralChangeData(BaseModel):
+    node_id: str
+    fs: float
+    n: int
+    distance: float
+    peaks: List[List[float]]
+    previous: List[List[float]]
+
+# Pydantic model for the FFT kernel selected by a node for one size, with its cycles and those of the default kernel
+class FftBackendSize(BaseModel):
+    n: int
+    backend: str
+    cycles: int
+    default_cycles: int
+
+# Pydantic model for the FFT kernels selected by a node at boot, benchmarked or cached in NVS
+class FftBackendData(BaseModel):
+    node_id: str
+    cached: bool
+    sizes: List[FftBackendSize]
+
+# Pydantic model for the heap of a node: free bytes, largest block that can be allocated and lowest free bytes since boot
+class HeapStats(BaseModel):
+    free: int
+    largest: int
+    min_free: int
+
+# Pydantic model for the outbox of a node in the resource statistics
+class OutboxStats(BaseModel):
+    bytes: int
+    peak_bytes: int
+    dropped: int
+
+# Pydantic model for the resource statistics of a node: CPU load of all the cores in % (-1 without the FreeRTOS run-time
+# stats), heap, outbox, and each task as [name, CPU %, free stack bytes]
+class StatsData(BaseModel):
+    node_id: str
+    uptime: float
+    cpu: float
+    heap: HeapStats
+    outbox: OutboxStats
+    tasks: List[Tuple[str, float, int]]
+
+# Pydantic model for a compressive window of a node: its samples, taken at indices / grid_rate seconds on a grid of n
+# points, and the mean and tones recovered by the node as [frequency, amplitude] pairs
+class CompressiveData(BaseModel):
+    node_id: str
+    grid_rate: float
+    n: int
+    indices: List[int]
+    values: List[float]
+    mean: float
+    residual: float
+    tones: List[List[float]]
+
+# Pydantic model for the statistics of a rollup window of a node, or of a period of its history it was queried for
+class RollupData(BaseModel):
+    node_id: str
+    window: int
+    query: bool
+    count: int
+    mean: float
+    min: float
+    max: float
+    std: float
+
 class EnergyData(BaseModel):
     node_id: str
     energy_optimal: str
     energy_original: str
     details: str
 
-# Initialize MQTT Client
-client = mqtt.Client()
+# Pydantic model for the result of one experiment run, containing the run configuration and the measurements
+class ExperimentData(BaseModel):
+    node_id: str
+    run: int
+    signal: int
+    base_rate: int
+    time_window: int
+    repetitions: int
+    qos: int
+    fft_size: int
+    highest_frequency: float
+    optimal_rate: float
+    energy_optimal: float
+    energy_original: float
+    latency_count: int
+    latency_avg_us: int
+    latency_max_us: int
+
+def create_client(client_id, userdata=None):
+    """
+    Creates an MQTT v5 client connected to the local broker over TLS, with the network loop not started yet.
+
+    Args:
+        client_id (str): The client id, unique per process.
+        userdata: The user data passed to the callbacks.
+
+    Returns:
+        mqtt.Client: The connected client.
+    """
+    client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=client_id, userdata=userdata, protocol=mqtt.MQTTv5)
+
+    # Set TLS/SSL parameters
+    client.tls_set(
+        ca_certs=f"{CERTS_DIR}/ca_cert.pem",
+        certfile=f"{CERTS_DIR}/client_cert.pem",
+        keyfile=f"{CERTS_DIR}/client_key.pem",
+        tls_version=mqtt.ssl.PROTOCOL_TLS,
+    )
+
+    # Connect to the broker using secure port
+    client.connect("localhost", 8883, 60)
+    return client
+
+
+def run_worker(worker_index, worker_count, ordered_average=False, control_message=None, handled=None, quiet=False,
+               store_dir=STORE_DIR, query_port=QUERY_PORT):
+    """
+    Runs one ingest process of the edge server until it is killed.
+
+    Args:
+        worker_index (int): The index of this worker, from 0 to worker_count - 1.
+        worker_count (int): The number of workers sharing the ingest.
+        ordered_average (bool): Whether /average is partitioned by node instead of shared, which keeps the windows of a
+            node in order, as needed to reconstruct the windows suppressed by the dead-band and predictive reporting.
+        control_message (tuple): The (topic, payload) of a control message to send once connected, or None.
+        handled (multiprocessing.Value): Counter of the messages handled by all the workers, or None.
+        quiet (bool): Whether to discard the output of the worker.
+        store_dir (str): The directory of the telemetry store.
+        query_port (int): The port the first worker serves the queries of the store on, or None for none.
 
-# Set TLS/SSL parameters
-client.tls_set(
-    ca_certs="/home/bernardoribeiro/Documents/GitHub/IoT-individual-assignment_/edge-server/mqtt_broker/certs/ca_cert.pem",
-    certfile="/home/bernardoribeiro/Documents/GitHub/IoT-individual-assignment_/edge-server/mqtt_broker/certs/client_cert.pem",
-    keyfile="/home/bernardoribeiro/Documents/GitHub/IoT-individual-assignment_/edge-server/mqtt_broker/certs/client_key.pem",
-    tls_version=mqtt.ssl.PROTOCOL_TLS,
-)
+    Returns:
+        None
+    """
+    global store
+    if quiet:
+        sys.stdout = open(os.devnull, "w")
+    store = TelemetryStore(store_dir, f"w{worker_index}")
+    if worker_index == 0 and query_port is not None:
+        serve_http(store, query_port)
+    userdata = {
+        "worker_index": worker_index,
+        "worker_count": worker_count,
+        "node_state_topics": NODE_STATE_TOPICS + (("/average",) if ordered_average else ()),
+        "control_message": control_message,
+        "handled": handled,
+    }
+    client = create_client(f"edge-server-{worker_index}" if worker_count > 1 else "edge-server", userdata)
 
-# Set the callbacks
-client.on_connect = on_connect
-client.on_message = on_message
+    # Set the callbacks
+    client.on_connect = on_connect
+    client.on_message = on_message
 
-# Connect to the broker using secure port
-client.connect("localhost", 8883, 60)
-client.loop_start()
+    # Keep the process running, flushing the store so queries see the latest values even while the ingest is idle
+    client.loop_start()
+    while True:
+        time.sleep(FLUSH_INTERVAL_S)
+        store.flush()
 
-# Keep the script running
-while True:
-    pass
+
+if __name__ == "__main__":
+    # Optionally send an experiment matrix to a node: python edge_server.py experiments <node_id> <matrix.json>
+    # where matrix.json is {"runs": [{"signal": 1, "base_rate": 500, "time_window": 5, "repetitions": 5, "qos": 1, "fft_size": 4096}, ...]}
+    # or a configuration change: python edge_server.py config <node_id> '{"db_threshold": -3.0, "publish_batch": 4}'
+    # with any of min_sampling_rate, max_sampling_rate, time_window, fft_size, db_threshold, publish_batch, publish_qos
+    # or a rollup request: python edge_server.py rollup <node_id> '{"windows": [60, 300], "query": [120]}'
+    # or run the ingest as N worker processes: python edge_server.py workers <N> [ordered]
+    control_message = None
+    if len(sys.argv) == 4 and sys.argv[1] == "experiments":
+        with open(sys.argv[3]) as f:
+            control_message = (f"/control/{sys.argv[2]}/experiments", json.load(f))
+    elif len(sys.argv) == 4 and sys.argv[1] == "config":
+        control_message = (f"/control/{sys.argv[2]}/config", json.loads(sys.argv[3]))
+    elif len(sys.argv) == 4 and sys.argv[1] == "rollup":
+        control_message = (f"/control/{sys.argv[2]}/rollup", json.loads(sys.argv[3]))
+
+    if len(sys.argv) >= 3 and sys.argv[1] == "workers":
+        worker_count = int(sys.argv[2])
+        ordered_average = "ordered" in sys.argv[3:]
+        for worker_index in range(1, worker_count):
+            multiprocessing.Process(target=run_worker, args=(worker_index, worker_count, ordered_average), daemon=True).start()
+        run_worker(0, worker_count, ordered_average)
+    else:
+        run_worker(0, 1, control_message=control_message)
@@ -0,0 +1,412 @@
+import bisect
+import heapq
+import json
+import os
+import re
+import struct
+import sys
+import threading
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+# Embedded telemetry store of the edge server. Each series of each node is stored in segment files partitioned by hour,
+# one per writer process so that the ingest workers never share a file:
+#   <root>/<series>/<node_id>/<YYYYmmddHH>-<writer>.seg    records of RECORD.size bytes, in append order
+#   <root>/<series>/<node_id>/<YYYYmmddHH>-<writer>.idx    sparse index, one INDEX_ENTRY every INDEX_EVERY records
+#   <root>/configs-<writer>.jsonl                          configurations the records are tagged with
+# A record is the timestamp (microseconds since the epoch, non-decreasing within a segment), the value and the id of
+# the configuration it was measured with (0 for none). A range query only opens the segments of the hours it covers and
+# seeks to the start with the sparse index, reading at most INDEX_EVERY records before the range.
+RECORD = struct.Struct("<qdI")
+INDEX_ENTRY = struct.Struct("<qQ")
+INDEX_EVERY = 256
+SEGMENT_SECONDS = 3600
+FLUSH_BYTES = 64 * 1024
+FLUSH_INTERVAL_S = 1.0
+MAX_OPEN_SEGMENTS = 256
+
+# Series and node names become directory names, so they are restricted to NAME_PATTERN, which rules out path traversal
+# from a node id received over MQTT or a node given in an HTTP query
+NAME_PATTERN = re.compile(r"[A-Za-z0-9_-]{1,64}")
+
+
+def config_id(config):
+    """
+    Returns the id of a configuration (any JSON value), the same in every process: the CRC32 of its canonical JSON.
+    """
+    return zlib.crc32(json.dumps(config, sort_keys=True, separators=(",", ":")).encode()) or 1
+
+
+def check_name(kind, name):
+    """
+    Raises ValueError if a series or node name doesn't match NAME_PATTERN.
+    """
+    if not isinstance(name, str) or NAME_PATTERN.fullmatch(name) is None:
+        raise ValueError(f"Invalid {kind} name: {name!r}")
+
+
+def segment_hour(timestamp_us):
+    """
+    Returns the hour partition of a timestamp, as used in the segment file names.
+    """
+    return time.strftime("%Y%m%d%H", time.gmtime(timestamp_us // 1_000_000))
+
+
+class SegmentWriter:
+    """
+    Appends records to one segment file and its sparse index, buffering them in memory until the next flush.
+    """
+
+    def __init__(self, path):
+        self.path = path
+        self.data = open(path + ".seg", "ab")
+        self.index = open(path + ".idx", "ab")
+        # Drop a record or an index entry torn by a crash, so the next ones are appended at a record boundary
+        self.records = self.data.tell() // RECORD.size
+        if self.data.tell() % RECORD.size:
+            self.data.truncate(self.records * RECORD.size)
+        if self.index.tell() % INDEX_ENTRY.size:
+            self.index.truncate(self.index.tell() // INDEX_ENTRY.size * INDEX_ENTRY.size)
+        self.last_timestamp = -1
+        if self.records:
+            with open(path + ".seg", "rb") as f:
+                f.seek((self.records - 1) * RECORD.size)
+                self.last_timestamp = RECORD.unpack(f.read(RECORD.size))[0]
+        self.buffer = bytearray()
+        self.index_buffer = bytearray()
+
+    def append(self, timestamp_us, value, tag):
+        # Clamp so the segment stays sorted even if the edge clock steps back
+        timestamp_us = max(timestamp_us, self.last_timestamp)
+        if self.records % INDEX_EVERY == 0:
+            self.index_buffer += INDEX_ENTRY.pack(timestamp_us, self.records)
+        self.buffer += RECORD.pack(timestamp_us, value, tag)
+        self.records += 1
+        self.last_timestamp = timestamp_us
+
+    def flush(self):
+        # The data is written before the index, so an index entry never points past the end of the data
+        if self.buffer:
+            self.data.write(self.buffer)
+            self.data.flush()
+            self.buffer.clear()
+        if self.index_buffer:
+            self.index.write(self.index_buffer)
+            self.index.flush()
+            self.index_buffer.clear()
+
+    def close(self):
+        self.flush()
+        self.data.close()
+        self.index.close()
+
+
+class TelemetryStore:
+    """
+    Append and query interface of the telemetry store.
+
+    Args:
+        root (str): The directory of the store.
+        writer (str): The name of the writing process, unique among the processes writing to the store.
+    """
+
+    def __init__(self, root, writer="w0"):
+        self.root = root
+        self.writer = writer
+        self.segments = {}
+        self.configs = {}
+        self.lock = threading.Lock()
+        self.last_flush = time.monotonic()
+        os.makedirs(root, exist_ok=True)
+
+    def append(self, series, node_id, timestamp_us, value, config=None):
+        """
+        Appends one value of a series of a node, tagged with the configuration it was measured with.
+
+        Args:
+            series (str): The series, e.g. "average".
+            node_id (str): The node.
+            timestamp_us (int): The time of the value in microseconds since the epoch.
+            value (float): The value.
+            config: The configuration (any JSON value) or None.
+
+        Returns:
+            None
+
+        Raises:
+            ValueError: If the series or the node name is invalid (see NAME_PATTERN).
+        """
+        check_name("series", series)
+        check_name("node", node_id)
+        tag = 0
+        with self.lock:
+            if config is not None:
+                tag = config_id(config)
+                if tag not in self.configs:
+                    self.configs[tag] = config
+                    with open(os.path.join(self.root, f"configs-{self.writer}.jsonl"), "a") as f:
+                        f.write(json.dumps({"id": tag, "config": config}) + "\n")
+
+            key = (series, node_id, segment_hour(timestamp_us))
+            segment = self.segments.get(key)
+            if segment is None:
+                if len(self.segments) >= MAX_OPEN_SEGMENTS:
+                    self._close_oldest()
+                directory = os.path.join(self.root, series, node_id)
+                os.makedirs(directory, exist_ok=True)
+                segment = self.segments[key] = SegmentWriter(os.path.join(directory, f"{key[2]}-{self.writer}"))
+            segment.append(timestamp_us, value, tag)
+
+            if len(segment.buffer) >= FLUSH_BYTES or time.monotonic() - self.last_flush >= FLUSH_INTERVAL_S:
+                self._flush()
+
+    def flush(self):
+        """
+        Writes the buffered records of every open segment to disk.
+        """
+        with self.lock:
+            self._flush()
+
+    def _flush(self):
+        for segment in self.segments.values():
+            segment.flush()
+        self.last_flush = time.monotonic()
+
+    def _close_oldest(self):
+        # Segments are opened in time order, the oldest hours are the least likely to be written again
+        for key in sorted(self.segments, key=lambda k: k[2])[: MAX_OPEN_SEGMENTS // 4]:
+            self.segments.pop(key).close()
+
+    def close(self):
+        with self.lock:
+            for segment in self.segments.values():
+                segment.close()
+            self.segments.clear()
+
+    def nodes(self, series):
+        """
+        Returns the nodes with stored values of a series.
+        """
+        check_name("series", series)
+        directory = os.path.join(self.root, series)
+        return sorted(os.listdir(directory)) if os.path.isdir(directory) else []
+
+    def load_configs(self):
+        """
+        Returns the configurations written by every process, by id.
+        """
+        configs = {}
+        for name in os.listdir(self.root):
+            if name.startswith("configs-") and name.endswith(".jsonl"):
+                with open(os.path.join(self.root, name)) as f:
+                    for line in f:
+                        if line.strip():
+                            entry = json.loads(line)
+                            configs[entry["id"]] = entry["config"]
+        return configs
+
+    def _segment_records(self, path, start_us, end_us):
+        """
+        Yields the records of one segment file within [start_us, end_us), seeking with its sparse index.
+        """
+        offset = 0
+        try:
+            with open(path[:-4] + ".idx", "rb") as f:
+                index = f.read()
+            entries = [INDEX_ENTRY.unpack_from(index, i) for i in range(0, len(index) - INDEX_ENTRY.size + 1, INDEX_ENTRY.size)]
+            # Last entry strictly before start_us: the records of the entries stamped start_us may be preceded by
+            # records with the same timestamp (clamped by SegmentWriter.append), which are in range too
+            position = bisect.bisect_left([timestamp for timestamp, _ in entries], start_us) - 1
+            if position >= 0:
+                offset = entries[position][1] * RECORD.size
+        except FileNotFoundError:
+            pass
+
+        with open(path, "rb") as f:
+            f.seek(offset)
+            while True:
+                chunk = f.read(RECORD.size * 4096)
+                # Ignore a record being written by another process
+                chunk = chunk[: len(chunk) - len(chunk) % RECORD.size]
+                if not chunk:
+                    return
+                for record in RECORD.iter_unpack(chunk):
+                    if record[0] >= end_us:
+                        return
+                    if record[0] >= start_us:
+                        yield record
+
+    def query(self, series, node_id, start_us, end_us):
+        """
+        Yields the (timestamp_us, value, config_id) records of a series of a node within [start_us, end_us), in time
+        order, merging the segments of every writer.
+
+        Args:
+            series (str): The series.
+            node_id (str): The node.
+            start_us (int): The start of the range in microseconds since the epoch, included.
+            end_us (int): The end of the range in microseconds since the epoch, excluded.
+
+        Raises:
+            ValueError: If the series or the node name is invalid (see NAME_PATTERN).
+        """
+        check_name("series", series)
+        check_name("node", node_id)
+        self.flush()
+        directory = os.path.join(self.root, series, node_id)
+        if not os.path.isdir(directory):
+            return
+        first, last = segment_hour(start_us), segment_hour(max(start_us, end_us - 1))
+        paths = [
+            os.path.join(directory, name)
+            for name in os.listdir(directory)
+            if name.endswith(".seg") and first <= name.split("-")[0] <= last
+        ]
+        yield from heapq.merge(*(self._segment_records(path, start_us, end_us) for path in paths))
+
+    def downsample(self, series, node_id, start_us, end_us, step_s):
+        """
+        Returns the values of a series of a node within a range in buckets of step_s seconds.
+
+        Returns:
+            list: One {"t", "count", "min", "max", "mean"} dictionary per non-empty bucket, t being its start in
+            microseconds since the epoch.
+        """
+        step_us = int(step_s * 1_000_000)
+        buckets = []
+        for timestamp, value, _ in self.query(series, node_id, start_us, end_us):
+            t = start_us + (timestamp - start_us) // step_us * step_us
+            if not buckets or buckets[-1]["t"] != t:
+                buckets.append({"t": t, "count": 0, "min": value, "max": value, "sum": 0.0})
+            bucket = buckets[-1]
+            bucket["count"] += 1
+            bucket["min"] = min(bucket["min"], value)
+            bucket["max"] = max(bucket["max"], value)
+            bucket["sum"] += value
+        for bucket in buckets:
+            bucket["mean"] = bucket.pop("sum") / bucket["count"]
+        return buckets
+
+    def totals_by_config(self, series, start_us, end_us):
+        """
+        Returns the total of a series over the fleet within a range, per configuration.
+
+        Returns:
+            list: One {"config", "nodes", "count", "total"} dictionary per configuration, the largest total first.
+        """
+        configs = self.load_configs()
+        totals = {}
+        for node_id in self.nodes(series):
+            for _, value, tag in self.query(series, node_id, start_us, end_us):
+                entry = totals.setdefault(tag, {"config": configs.get(tag), "nodes": set(), "count": 0, "total": 0.0})
+                entry["nodes"].add(node_id)
+                entry["count"] += 1
+                entry["total"] += value
+        result = sorted(totals.values(), key=lambda entry: -entry["total"])
+        for entry in result:
+            entry["nodes"] = sorted(entry["nodes"])
+        return result
+
+
+def parse_range(params, now_us=None):
+    """
+    Returns the (start_us, end_us) range of a query: "start" and "end" in seconds since the epoch, or "last" seconds
+    before now (one hour by default).
+    """
+    now_us = now_us or time.time_ns() // 1000
+    end_us = int(float(params["end"]) * 1_000_000) if "end" in params else now_us
+    if "start" in params:
+        start_us = int(float(params["start"]) * 1_000_000)
+    else:
+        start_us = end_us - int(float(params.get("last", 3600)) * 1_000_000)
+    return start_us, end_us
+
+
+def run_query(store, params):
+    """
+    Runs a query given as a dictionary of parameters, shared by the HTTP and the command line interfaces:
+        view=range       series, node, range: the raw records
+        view=downsample  series, node, range, step (seconds, 60 by default): buckets with count, min, max and mean
+        view=configs     series (energy by default), range: the fleet total per configuration
+        view=nodes       series: the nodes with stored values
+
+    Returns:
+        The JSON-serializable result.
+    """
+    view = params.get("view", "downsample")
+    series = params.get("series", "energy" if view == "configs" else "average")
+    if view == "nodes":
+        return store.nodes(series)
+    start_us, end_us = parse_range(params)
+    if view == "configs":
+        return store.totals_by_config(series, start_us, end_us)
+    if view == "range":
+        return [{"t": t, "value": value, "config": tag} for t, value, tag in store.query(series, params["node"], start_us, end_us)]
+    return store.downsample(series, params["node"], start_us, end_us, float(params.get("step", 60)))
+
+
+def serve_http(store, port):
+    """
+    Serves the queries of run_query on http://localhost:<port>/query?view=...&series=...&node=...&last=..., in a
+    daemon thread.
+    """
+
+    class QueryHandler(BaseHTTPRequestHandler):
+        def do_GET(self):
+            url = urlparse(self.path)
+            if url.path != "/query":
+                self.send_error(404)
+                return
+            try:
+                params = {key: values[-1] for key, values in parse_qs(url.query).items()}
+                body = json.dumps(run_query(store, params)).encode()
+            except (KeyError, ValueError) as e:
+                self.send_error(400, str(e))
+                return
+            self.send_response(200)
+            self.send_header("Content-Type", "application/json")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, format, *args):
+            pass
+
+    server = ThreadingHTTPServer(("localhost", port), QueryHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+def benchmark(root, records=200000, nodes=32):
+    """
+    Measures the append rate of the store and the time of a one-hour range query of one node.
+    """
+    store = TelemetryStore(root, "bench")
+    now_us = time.time_ns() // 1000
+    step_us = 3600 * 1_000_000 * 24 // records
+    start = time.perf_counter()
+    for i in range(records):
+        store.append("average", f"bench{i % nodes:06d}", now_us - 24 * 3600 * 1_000_000 + i * step_us, i * 0.001)
+    store.flush()
+    append_time = time.perf_counter() - start
+
+    start = time.perf_counter()
+    count = sum(1 for _ in store.query("average", "bench000000", now_us - 3600 * 1_000_000, now_us))
+    query_time = time.perf_counter() - start
+    store.close()
+    print(f"Appended {records} records in {append_time:.2f} s ({records / append_time:.0f} records/s)")
+    print(f"Range query of the last hour of one node: {count} records in {query_time * 1000:.1f} ms")
+
+
+if __name__ == "__main__":
+    # Query the store from the command line: python telemetry_store.py <root> view=downsample node=node000000 last=3600
+    # (see run_query for the parameters), or measure it: python telemetry_store.py <root> benchmark
+    if len(sys.argv) >= 3 and sys.argv[2] == "benchmark":
+        benchmark(sys.argv[1])
+    elif len(sys.argv) >= 2:
+        params = dict(argument.split("=", 1) for argument in sys.argv[2:])
+        print(json.dumps(run_query(TelemetryStore(sys.argv[1], "cli"), params), indent=2))
+    else:
+        print("Usage: python telemetry_store.py <root> [benchmark | key=value ...]")
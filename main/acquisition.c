@@ -0,0 +1,302 @@
+#include "acquisition.h"
+#include <math.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "soc/soc_caps.h"
+
+static const char *ACQTAG = "ACQ";
+
+// Maximum time to wait for the ADC driver to deliver conversion results
+#define ACQUISITION_ADC_TIMEOUT_MS 1000
+
+// Number of conversion result buffers the ADC driver can hold while the processing code is busy
+#define ACQUISITION_ADC_POOL_FRAMES 4
+
+// Layout of the conversion results depends on the target, as in the ESP-IDF continuous read example
+#if CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
+#define ACQUISITION_ADC_OUTPUT_TYPE ADC_DIGI_OUTPUT_FORMAT_TYPE1
+#define ACQUISITION_ADC_GET_CHANNEL(p_data) ((p_data)->type1.channel)
+#define ACQUISITION_ADC_GET_DATA(p_data) ((p_data)->type1.data)
+#else
+#define ACQUISITION_ADC_OUTPUT_TYPE ADC_DIGI_OUTPUT_FORMAT_TYPE2
+#define ACQUISITION_ADC_GET_CHANNEL(p_data) ((p_data)->type2.channel)
+#define ACQUISITION_ADC_GET_DATA(p_data) ((p_data)->type2.data)
+#endif
+
+/**
+ * @brief Initializes an acquisition that samples a function of time, waiting one sampling period after each sample
+ * like the original simulation.
+ *
+ * @param acquisition The acquisition to be initialized.
+ * @param function The signal function.
+ */
+void acquisition_init_function(acquisition_t *acquisition, acquisition_function_t function)
+{
+    memset(acquisition, 0, sizeof(acquisition_t));
+    acquisition->backend = ACQUISITION_FUNCTION;
+    acquisition->function = function;
+    acquisition->realtime = true;
+}
+
+/**
+ * @brief Initializes an acquisition that generates a synthetic signal one frame at a time.
+ *
+ * @param acquisition The acquisition to be initialized.
+ * @param signal The synthetic signal description.
+ * @param realtime Whether to wait the duration of each frame, or to deliver frames as fast as possible.
+ */
+void acquisition_init_synth(acquisition_t *acquisition, const synth_signal_t *signal, bool realtime)
+{
+    memset(acquisition, 0, sizeof(acquisition_t));
+    acquisition->backend = ACQUISITION_SYNTH;
+    acquisition->synth_signal = signal;
+    acquisition->realtime = realtime;
+}
+
+/**
+ * @brief ADC driver callback, called from the ISR when the driver pool is full and conversion results are dropped.
+ */
+static bool IRAM_ATTR acquisition_adc_pool_overflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
+{
+    acquisition_t *acquisition = user_data;
+    acquisition->adc_overruns++;
+    return false;
+}
+
+/**
+ * @brief Initializes an acquisition from one ADC channel in continuous mode.
+ *
+ * The DMA fills the driver pool in the background while the previous frame is processed, so conversions are only
+ * lost (and counted in adc_overruns) if processing a frame takes longer on average than acquiring it.
+ *
+ * @param acquisition The acquisition to be initialized.
+ * @param unit The ADC unit.
+ * @param channel The ADC channel.
+ * @return ESP_OK on success, or the error of the ADC driver.
+ */
+esp_err_t acquisition_init_adc(acquisition_t *acquisition, adc_unit_t unit, adc_channel_t channel)
+{
+    memset(acquisition, 0, sizeof(acquisition_t));
+    acquisition->backend = ACQUISITION_ADC;
+    acquisition->adc_unit = unit;
+    acquisition->adc_channel = channel;
+    acquisition->realtime = true;
+
+    adc_continuous_handle_cfg_t handle_config = {
+        .max_store_buf_size = ACQUISITION_ADC_POOL_FRAMES * sizeof(acquisition->adc_raw),
+        .conv_frame_size = sizeof(acquisition->adc_raw),
+    };
+    esp_err_t err = adc_continuous_new_handle(&handle_config, &acquisition->adc_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(ACQTAG, "Failed to create the ADC continuous handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    adc_continuous_evt_cbs_t callbacks = {
+        .on_pool_ovf = acquisition_adc_pool_overflow,
+    };
+    return adc_continuous_register_event_callbacks(acquisition->adc_handle, &callbacks, acquisition);
+}
+
+/**
+ * @brief Configures and starts the ADC at a multiple of the sampling frequency it supports.
+ */
+static esp_err_t acquisition_adc_start(acquisition_t *acquisition, float sampling_frequency)
+{
+    if (acquisition->adc_running) {
+        adc_continuous_stop(acquisition->adc_handle);
+        acquisition->adc_running = false;
+    }
+
+    // The ADC can't sample slower than SOC_ADC_SAMPLE_FREQ_THRES_LOW: sample faster and average
+    int decimation = (int)ceilf(SOC_ADC_SAMPLE_FREQ_THRES_LOW / sampling_frequency);
+    if (decimation < 1) {
+        decimation = 1;
+    }
+    uint32_t hardware_frequency = (uint32_t)lroundf(sampling_frequency * decimation);
+    if (hardware_frequency > SOC_ADC_SAMPLE_FREQ_THRES_HIGH) {
+        ESP_LOGE(ACQTAG, "Sampling frequency %f Hz is above the maximum of the ADC", sampling_frequency);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    adc_digi_pattern_config_t pattern = {
+        .atten = ADC_ATTEN_DB_12,
+        .channel = acquisition->adc_channel,
+        .unit = acquisition->adc_unit,
+        .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+    };
+    adc_continuous_config_t config = {
+        .pattern_num = 1,
+        .adc_pattern = &pattern,
+        .sample_freq_hz = hardware_frequency,
+        .conv_mode = acquisition->adc_unit == ADC_UNIT_1 ? ADC_CONV_SINGLE_UNIT_1 : ADC_CONV_SINGLE_UNIT_2,
+        .format = ACQUISITION_ADC_OUTPUT_TYPE,
+    };
+    esp_err_t err = adc_continuous_config(acquisition->adc_handle, &config);
+    if (err != ESP_OK) {
+        ESP_LOGE(ACQTAG, "Failed to configure the ADC: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    acquisition->adc_decimation = decimation;
+    acquisition->adc_accumulator = 0;
+    acquisition->adc_accumulated = 0;
+    acquisition->adc_raw_length = 0;
+    acquisition->adc_raw_position = 0;
+    err = adc_continuous_start(acquisition->adc_handle);
+    acquisition->adc_running = err == ESP_OK;
+    ESP_LOGI(ACQTAG, "ADC sampling at %" PRIu32 " Hz, averaging %d conversions per sample", hardware_frequency, decimation);
+    return err;
+}
+
+/**
+ * @brief (Re)starts the acquisition at the given sampling frequency, restarting the time of the signal at 0.
+ *
+ * @param acquisition The acquisition.
+ * @param sampling_frequency The sampling frequency in Hz.
+ * @return ESP_OK on success, or an error if the backend can't sample at this frequency.
+ */
+esp_err_t acquisition_start(acquisition_t *acquisition, float sampling_frequency)
+{
+    if (sampling_frequency <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    acquisition->sampling_frequency = sampling_frequency;
+    acquisition->sample_index = 0;
+
+    switch (acquisition->backend) {
+    case ACQUISITION_SYNTH:
+        synth_source_init(&acquisition->synth, acquisition->synth_signal, sampling_frequency);
+        return ESP_OK;
+    case ACQUISITION_ADC:
+        return acquisition_adc_start(acquisition, sampling_frequency);
+    default:
+        return ESP_OK;
+    }
+}
+
+/**
+ * @brief Stops the acquisition. Only the ADC backend holds resources while running.
+ *
+ * @param acquisition The acquisition.
+ */
+void acquisition_stop(acquisition_t *acquisition)
+{
+    if (acquisition->backend == ACQUISITION_ADC && acquisition->adc_running) {
+        adc_continuous_stop(acquisition->adc_handle);
+        acquisition->adc_running = false;
+    }
+}
+
+/**
+ * @brief Fills the output with ADC samples, reading conversion results from the driver as needed.
+ */
+static int acquisition_adc_read(acquisition_t *acquisition, float *output, int len)
+{
+    float scale = ACQUISITION_ADC_FULL_SCALE_V / ((1 << SOC_ADC_DIGI_MAX_BITWIDTH) - 1) / acquisition->adc_decimation;
+    int count = 0;
+    while (count < len) {
+        if (acquisition->adc_raw_position >= acquisition->adc_raw_length) {
+            esp_err_t err = adc_continuous_read(acquisition->adc_handle, acquisition->adc_raw, sizeof(acquisition->adc_raw),
+                                                &acquisition->adc_raw_length, ACQUISITION_ADC_TIMEOUT_MS);
+            acquisition->adc_raw_position = 0;
+            if (err != ESP_OK) {
+                acquisition->adc_raw_length = 0;
+                ESP_LOGE(ACQTAG, "ADC read failed: %s", esp_err_to_name(err));
+                return count;
+            }
+        }
+
+        adc_digi_output_data_t *result = (adc_digi_output_data_t *)&acquisition->adc_raw[acquisition->adc_raw_position];
+        acquisition->adc_raw_position += SOC_ADC_DIGI_RESULT_BYTES;
+        if (ACQUISITION_ADC_GET_CHANNEL(result) != acquisition->adc_channel) {
+            continue;
+        }
+        acquisition->adc_accumulator += ACQUISITION_ADC_GET_DATA(result);
+        if (++acquisition->adc_accumulated == acquisition->adc_decimation) {
+            output[count++] = acquisition->adc_accumulator * scale;
+            acquisition->adc_accumulator = 0;
+            acquisition->adc_accumulated = 0;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Reads the next samples of the acquisition directly into the output array.
+ *
+ * Used when the samples must be contiguous, e.g. to fill the FFT input, so they are written once to their final
+ * location. Blocks until the samples are available (simulated or paced backends wait in real time).
+ *
+ * @param acquisition The started acquisition.
+ * @param output The output array.
+ * @param len The number of samples to read.
+ * @return The number of samples read, less than len only if the backend failed.
+ */
+int acquisition_read(acquisition_t *acquisition, float *output, int len)
+{
+    int count = 0;
+    float fs = acquisition->sampling_frequency;
+
+    switch (acquisition->backend) {
+    case ACQUISITION_FUNCTION:
+        for (count = 0; count < len; count++) {
+            output[count] = acquisition->function((acquisition->sample_index + count) / fs);
+            vTaskDelay(pdMS_TO_TICKS(1000.0 / fs));
+        }
+        break;
+    case ACQUISITION_SYNTH:
+        synth_source_generate(&acquisition->synth, output, len);
+        count = len;
+        break;
+    case ACQUISITION_ADC:
+        count = acquisition_adc_read(acquisition, output, len);
+        break;
+    }
+
+    if (acquisition->realtime && acquisition->backend == ACQUISITION_SYNTH) {
+        vTaskDelay(pdMS_TO_TICKS(count * 1000.0 / fs));
+    }
+    acquisition->sample_index += count;
+    return count;
+}
+
+/**
+ * @brief Reads the next frame of samples into the frame buffer of the acquisition.
+ *
+ * The frame is processed in place by the caller, so no window-sized buffer is needed. It is only valid until the next
+ * call, which overwrites it.
+ *
+ * @param acquisition The started acquisition.
+ * @param frame Output pointer to the samples of the frame.
+ * @param max_len The maximum number of samples wanted, so that the end of a window is not over-sampled.
+ * @return The number of samples in the frame (up to ACQUISITION_FRAME_SAMPLES, 0 if the backend failed).
+ */
+int acquisition_read_frame(acquisition_t *acquisition, const float **frame, int max_len)
+{
+    *frame = acquisition->frame;
+    if (max_len > ACQUISITION_FRAME_SAMPLES) {
+        max_len = ACQUISITION_FRAME_SAMPLES;
+    }
+    return acquisition_read(acquisition, acquisition->frame, max_len);
+}
+
+/**
+ * @brief Returns the name of an acquisition backend, as logged and published.
+ *
+ * @param backend The backend.
+ * @return The name of the backend.
+ */
+const char *acquisition_backend_name(acquisition_backend_t backend)
+{
+    switch (backend) {
+    case ACQUISITION_SYNTH:
+        return "synth";
+    case ACQUISITION_ADC:
+        return "adc";
+    default:
+        return "function";
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_adc/adc_continuous.h"
+#include "synth.h"
+
+// Number of samples in one frame delivered to the processing code
+#define ACQUISITION_FRAME_SAMPLES 256
+
+// Size of the buffer the ADC conversion results are read into, in conversion results
+#define ACQUISITION_ADC_READ_RESULTS 256
+
+// Input voltage corresponding to the full scale of the ADC (12 dB attenuation)
+#define ACQUISITION_ADC_FULL_SCALE_V 3.1f
+
+// Signal given as a function of time, same as signal_function_t in main.c
+typedef float (*acquisition_function_t)(float t);
+
+typedef enum {
+    ACQUISITION_FUNCTION = 0,   // Function of time sampled in (simulated) real time, one call per sample
+    ACQUISITION_SYNTH,          // Synthetic signal generated one frame at a time (synth.c)
+    ACQUISITION_ADC,            // ADC continuous mode with DMA
+} acquisition_backend_t;
+
+// Acquisition state. The processing code only sees frames, whatever the backend.
+typedef struct {
+    acquisition_backend_t backend;
+    float sampling_frequency;       // Sampling frequency of the delivered samples in Hz
+    bool realtime;                  // Whether the synthetic backend is paced at the sampling frequency
+    uint32_t sample_index;          // Samples delivered since the last start
+
+    // Function and synthetic backends
+    acquisition_function_t function;
+    const synth_signal_t *synth_signal;
+    synth_source_t synth;
+
+    // ADC backend. The hardware samples at a multiple of the requested rate (at least the lowest rate it supports)
+    // and each delivered sample is the average of adc_decimation conversions.
+    adc_continuous_handle_t adc_handle;
+    adc_unit_t adc_unit;
+    adc_channel_t adc_channel;
+    bool adc_running;
+    int adc_decimation;
+    uint32_t adc_accumulator;
+    int adc_accumulated;
+    uint8_t adc_raw[ACQUISITION_ADC_READ_RESULTS * SOC_ADC_DIGI_RESULT_BYTES];
+    uint32_t adc_raw_length;        // Bytes in adc_raw
+    uint32_t adc_raw_position;      // Bytes of adc_raw already consumed
+    volatile uint32_t adc_overruns; // Number of times the driver pool was full and conversions were dropped
+
+    // Frame returned by acquisition_read_frame(), valid until the next call. It is filled synchronously by the caller;
+    // only the ADC backend keeps acquiring in the background, into the pool of the driver.
+    float frame[ACQUISITION_FRAME_SAMPLES];
+} acquisition_t;
+
+void acquisition_init_function(acquisition_t *acquisition, acquisition_function_t function);
+void acquisition_init_synth(acquisition_t *acquisition, const synth_signal_t *signal, bool realtime);
+esp_err_t acquisition_init_adc(acquisition_t *acquisition, adc_unit_t unit, adc_channel_t channel);
+esp_err_t acquisition_start(acquisition_t *acquisition, float sampling_frequency);
+void acquisition_stop(acquisition_t *acquisition);
+int acquisition_read(acquisition_t *acquisition, float *output, int len);
+int acquisition_read_frame(acquisition_t *acquisition, const float **frame, int max_len);
+const char *acquisition_backend_name(acquisition_backend_t backend);
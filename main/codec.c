@@ -0,0 +1,165 @@
+#include "codec.h"
+#include <math.h>
+#include <string.h>
+
+// Quantized values are clamped so that the second order difference always fits in 32 bits
+#define RAW_CODEC_MAX_QUANT ((1 << 29) - 1)
+
+/**
+ * @brief Returns the worst-case size of an encoded window, used to size the output buffer.
+ *
+ * Each residual takes at most 32 bits, plus one width byte per block and the stream header.
+ *
+ * @param n_samples The number of samples in the window.
+ * @return The maximum number of bytes raw_codec_encode() can write.
+ */
+size_t raw_codec_max_encoded_size(int n_samples)
+{
+    int n_blocks = (n_samples + RAW_CODEC_BLOCK_SIZE - 1) / RAW_CODEC_BLOCK_SIZE;
+    return RAW_CODEC_HEADER_SIZE + n_blocks + (size_t)n_samples * 4;
+}
+
+// Maps signed residuals to unsigned so that small magnitudes of either sign use few bits
+static inline uint32_t zigzag_encode(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t zigzag_decode(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// Number of bits needed to represent v (0 for v == 0)
+static inline int bit_width(uint32_t v)
+{
+    return v == 0 ? 0 : 32 - __builtin_clz(v);
+}
+
+// Quantizes a sample to an integer multiple of the step
+static inline int32_t quantize(float sample, float step)
+{
+    float q = roundf(sample / step);
+    if (q > RAW_CODEC_MAX_QUANT) {
+        q = RAW_CODEC_MAX_QUANT;
+    } else if (q < -RAW_CODEC_MAX_QUANT) {
+        q = -RAW_CODEC_MAX_QUANT;
+    }
+    return (int32_t)q;
+}
+
+/**
+ * @brief Compresses a window of samples.
+ *
+ * The samples are quantized to multiples of `step`, then the second order difference (delta-of-delta) is taken, which
+ * is close to zero for smooth signals such as sums of sinusoids sampled above Nyquist. The residuals are zigzag
+ * encoded and bit-packed in blocks of RAW_CODEC_BLOCK_SIZE, each block prefixed by a byte with its bit width.
+ * The reconstruction error is bounded by step / 2, and decoding is bit-exact across platforms since it only uses
+ * integer arithmetic before the final multiplication by the step.
+ *
+ * @param samples The samples to be encoded.
+ * @param n_samples The number of samples.
+ * @param step The quantization step (e.g. 0.001 keeps the same 3 decimals used in /average).
+ * @param out Output buffer, with at least raw_codec_max_encoded_size(n_samples) bytes.
+ * @return The number of bytes written.
+ */
+size_t raw_codec_encode(const float *samples, int n_samples, float step, uint8_t *out)
+{
+    uint32_t n = (uint32_t)n_samples;
+    memcpy(out, &n, sizeof(n));
+    memcpy(out + 4, &step, sizeof(step));
+    size_t pos = RAW_CODEC_HEADER_SIZE;
+
+    uint32_t residuals[RAW_CODEC_BLOCK_SIZE];
+    int32_t prev1 = 0, prev2 = 0;
+
+    for (int start = 0; start < n_samples; start += RAW_CODEC_BLOCK_SIZE) {
+        int count = n_samples - start < RAW_CODEC_BLOCK_SIZE ? n_samples - start : RAW_CODEC_BLOCK_SIZE;
+
+        // Compute the residuals of the block and the widest one
+        uint32_t all_bits = 0;
+        for (int i = 0; i < count; i++) {
+            int32_t q = quantize(samples[start + i], step);
+            residuals[i] = zigzag_encode(q - 2 * prev1 + prev2);
+            all_bits |= residuals[i];
+            prev2 = prev1;
+            prev1 = q;
+        }
+        int width = bit_width(all_bits);
+        out[pos++] = (uint8_t)width;
+
+        // Pack the residuals LSB first
+        uint64_t acc = 0;
+        int acc_bits = 0;
+        for (int i = 0; i < count; i++) {
+            acc |= (uint64_t)residuals[i] << acc_bits;
+            acc_bits += width;
+            while (acc_bits >= 8) {
+                out[pos++] = (uint8_t)acc;
+                acc >>= 8;
+                acc_bits -= 8;
+            }
+        }
+        if (acc_bits > 0) {
+            out[pos++] = (uint8_t)acc;
+        }
+    }
+
+    return pos;
+}
+
+/**
+ * @brief Decompresses a window encoded by raw_codec_encode().
+ *
+ * @param in The encoded stream.
+ * @param len The length of the encoded stream in bytes.
+ * @param out Output array for the reconstructed samples.
+ * @param max_samples The capacity of the output array.
+ * @return The number of samples decoded, or -1 if the stream is truncated or doesn't fit in the output array.
+ */
+int raw_codec_decode(const uint8_t *in, size_t len, float *out, int max_samples)
+{
+    if (len < RAW_CODEC_HEADER_SIZE) {
+        return -1;
+    }
+    uint32_t n;
+    float step;
+    memcpy(&n, in, sizeof(n));
+    memcpy(&step, in + 4, sizeof(step));
+    if (n > (uint32_t)max_samples) {
+        return -1;
+    }
+    size_t pos = RAW_CODEC_HEADER_SIZE;
+
+    int32_t prev1 = 0, prev2 = 0;
+    for (uint32_t start = 0; start < n; start += RAW_CODEC_BLOCK_SIZE) {
+        uint32_t count = n - start < RAW_CODEC_BLOCK_SIZE ? n - start : RAW_CODEC_BLOCK_SIZE;
+        if (pos >= len) {
+            return -1;
+        }
+        int width = in[pos++];
+        if (width > 32 || pos + (count * width + 7) / 8 > len) {
+            return -1;
+        }
+
+        uint64_t acc = 0;
+        int acc_bits = 0;
+        uint64_t mask = width == 32 ? 0xFFFFFFFFull : ((1ull << width) - 1);
+        for (uint32_t i = 0; i < count; i++) {
+            while (acc_bits < width) {
+                acc |= (uint64_t)in[pos++] << acc_bits;
+                acc_bits += 8;
+            }
+            int32_t residual = zigzag_decode((uint32_t)(acc & mask));
+            acc >>= width;
+            acc_bits -= width;
+
+            int32_t q = residual + 2 * prev1 - prev2;
+            out[start + i] = q * step;
+            prev2 = prev1;
+            prev1 = q;
+        }
+    }
+
+    return (int)n;
+}
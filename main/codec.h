@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of residuals sharing the same bit width in the packed stream
+#define RAW_CODEC_BLOCK_SIZE 64
+
+// Size of the stream header: number of samples (uint32) and quantization step (float32)
+#define RAW_CODEC_HEADER_SIZE 8
+
+size_t raw_codec_max_encoded_size(int n_samples);
+size_t raw_codec_encode(const float *samples, int n_samples, float step, uint8_t *out);
+int raw_codec_decode(const uint8_t *in, size_t len, float *out, int max_samples);
@@ -0,0 +1,261 @@
+#include "compressive.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COMPRESSIVE_PI 3.14159265358979f
+
+/**
+ * @brief Draws the times of the samples of one window: m distinct indices of a grid of n, in increasing order.
+ *
+ * Each index is selected with probability (samples left) / (indices left) (selection sampling), so every subset of
+ * m indices is equally likely, in one pass over the grid.
+ *
+ * @param indices The output indices, m of them.
+ * @param m The number of samples, at most n.
+ * @param n The number of points of the grid.
+ * @param rng The xorshift32 state, non-zero.
+ */
+void compressive_schedule(uint32_t *indices, int m, int n, uint32_t *rng)
+{
+    int selected = 0;
+    for (int t = 0; t < n && selected < m; t++) {
+        *rng ^= *rng << 13;
+        *rng ^= *rng >> 17;
+        *rng ^= *rng << 5;
+        if ((uint64_t)*rng * (uint64_t)(n - t) < ((uint64_t)(m - selected) << 32)) {
+            indices[selected++] = t;
+        }
+    }
+}
+
+/**
+ * @brief Fits the values with the atoms by least squares, through the normal equations and a Cholesky factorization.
+ *
+ * @param atoms The atoms evaluated at the sample times, column-major, m rows and p columns.
+ * @param values The samples.
+ * @param m The number of samples.
+ * @param p The number of atoms.
+ * @param coefficients The output coefficients, p of them.
+ * @param residual The output residual of the samples, m of them.
+ * @return The energy of the residual, or -1 if the atoms are linearly dependent at the sample times.
+ */
+static double least_squares(const float *atoms, const float *values, int m, int p, float *coefficients, float *residual)
+{
+    double gram[COMPRESSIVE_MAX_ATOMS][COMPRESSIVE_MAX_ATOMS];
+    double rhs[COMPRESSIVE_MAX_ATOMS];
+    for (int a = 0; a < p; a++) {
+        const float *column_a = atoms + a * m;
+        double dot = 0;
+        for (int i = 0; i < m; i++) {
+            dot += column_a[i] * values[i];
+        }
+        rhs[a] = dot;
+        for (int b = 0; b <= a; b++) {
+            const float *column_b = atoms + b * m;
+            double product = 0;
+            for (int i = 0; i < m; i++) {
+                product += column_a[i] * column_b[i];
+            }
+            gram[a][b] = product;
+        }
+    }
+
+    // Cholesky factorization, in place in the lower triangle
+    for (int a = 0; a < p; a++) {
+        for (int b = 0; b <= a; b++) {
+            double sum = gram[a][b];
+            for (int k = 0; k < b; k++) {
+                sum -= gram[a][k] * gram[b][k];
+            }
+            if (a == b) {
+                if (sum <= 1e-9 * m) {
+                    return -1;
+                }
+                gram[a][a] = sqrt(sum);
+            } else {
+                gram[a][b] = sum / gram[b][b];
+            }
+        }
+    }
+
+    // Forward then backward substitution
+    double solution[COMPRESSIVE_MAX_ATOMS];
+    for (int a = 0; a < p; a++) {
+        double sum = rhs[a];
+        for (int k = 0; k < a; k++) {
+            sum -= gram[a][k] * solution[k];
+        }
+        solution[a] = sum / gram[a][a];
+    }
+    for (int a = p - 1; a >= 0; a--) {
+        double sum = solution[a];
+        for (int k = a + 1; k < p; k++) {
+            sum -= gram[k][a] * solution[k];
+        }
+        solution[a] = sum / gram[a][a];
+        coefficients[a] = (float)solution[a];
+    }
+
+    double energy = 0;
+    for (int i = 0; i < m; i++) {
+        float fitted = 0;
+        for (int a = 0; a < p; a++) {
+            fitted += coefficients[a] * atoms[a * m + i];
+        }
+        residual[i] = values[i] - fitted;
+        energy += residual[i] * residual[i];
+    }
+    return energy;
+}
+
+/**
+ * @brief Recovers the mean and the strongest tones of a window from randomly timed samples, by orthogonal matching
+ * pursuit over the cosines and sines of the grid frequencies.
+ *
+ * The samples were taken at indices[i] / grid_rate seconds, on a grid of n points covering the window, so the
+ * frequencies of the dictionary are the multiples of grid_rate / n up to grid_rate / 2. At each iteration, the
+ * frequency best correlated with the residual is added (a cosine and a sine, for any phase), then all the
+ * coefficients are fitted again by least squares. The correlations with all the frequencies are computed by rotating
+ * one phasor per sample, without any trigonometric call in the inner loop: O(m * n / 2) per tone.
+ * As the tones of the grid complete whole periods over the window, the mean of the window is the constant coefficient.
+ *
+ * @param indices The grid indices of the samples, distinct.
+ * @param values The samples.
+ * @param m The number of samples, at most COMPRESSIVE_MAX_SAMPLES.
+ * @param n The number of points of the grid.
+ * @param grid_rate The rate of the grid in Hz, at least twice the highest frequency of the signal.
+ * @param max_tones The maximum number of tones, at most COMPRESSIVE_MAX_TONES.
+ * @param tolerance Relative energy of the residual below which no more tones are searched.
+ * @param result The output model.
+ * @return true on success, false if the arguments are invalid or memory could not be allocated.
+ */
+bool compressive_recover(const uint32_t *indices, const float *values, int m, int n, float grid_rate, int max_tones,
+                         float tolerance, compressive_result_t *result)
+{
+    memset(result, 0, sizeof(compressive_result_t));
+    if (m <= 0 || m > COMPRESSIVE_MAX_SAMPLES || n < 4) {
+        return false;
+    }
+    if (max_tones > COMPRESSIVE_MAX_TONES) {
+        max_tones = COMPRESSIVE_MAX_TONES;
+    }
+
+    // Bins 1 to n / 2 - 1: the Nyquist bin has no sine
+    int n_bins = n / 2;
+    float *correlation = (float *)malloc(2 * n_bins * sizeof(float));
+    float *atoms = (float *)malloc(m * COMPRESSIVE_MAX_ATOMS * sizeof(float));
+    float *residual = (float *)malloc(m * sizeof(float));
+    if (correlation == NULL || atoms == NULL || residual == NULL) {
+        free(correlation);
+        free(atoms);
+        free(residual);
+        return false;
+    }
+
+    double energy = 0;
+    for (int i = 0; i < m; i++) {
+        atoms[i] = 1;
+        energy += values[i] * values[i];
+    }
+    int n_atoms = 1;
+    int bins[COMPRESSIVE_MAX_TONES];
+    float coefficients[COMPRESSIVE_MAX_ATOMS];
+    double residual_energy = least_squares(atoms, values, m, n_atoms, coefficients, residual);
+
+    while (result->n_tones < max_tones && residual_energy > tolerance * energy) {
+        memset(correlation, 0, 2 * n_bins * sizeof(float));
+        for (int i = 0; i < m; i++) {
+            float angle = 2 * COMPRESSIVE_PI * indices[i] / n;
+            float step_cos = cosf(angle), step_sin = sinf(angle);
+            float c = step_cos, s = step_sin;
+            float r = residual[i];
+            for (int k = 1; k < n_bins; k++) {
+                correlation[2 * k] += r * c;
+                correlation[2 * k + 1] += r * s;
+                float next = c * step_cos - s * step_sin;
+                s = s * step_cos + c * step_sin;
+                c = next;
+            }
+        }
+
+        int best = 0;
+        float best_power = 0;
+        for (int k = 1; k < n_bins; k++) {
+            float power = correlation[2 * k] * correlation[2 * k] + correlation[2 * k + 1] * correlation[2 * k + 1];
+            bool used = false;
+            for (int j = 0; j < result->n_tones; j++) {
+                used |= bins[j] == k;
+            }
+            if (!used && power > best_power) {
+                best_power = power;
+                best = k;
+            }
+        }
+        if (best == 0) {
+            break;
+        }
+
+        // Exact phases of the new atoms, (k * index) mod n keeping the angle small
+        float *column_cos = atoms + n_atoms * m, *column_sin = column_cos + m;
+        for (int i = 0; i < m; i++) {
+            float angle = 2 * COMPRESSIVE_PI * (float)(((uint64_t)best * indices[i]) % n) / n;
+            column_cos[i] = cosf(angle);
+            column_sin[i] = sinf(angle);
+        }
+        double fitted = least_squares(atoms, values, m, n_atoms + 2, coefficients, residual);
+        if (fitted < 0) {
+            break;
+        }
+        residual_energy = fitted;
+        n_atoms += 2;
+        bins[result->n_tones++] = best;
+    }
+
+    // The last fit succeeded with n_atoms atoms, the coefficients are those of the model
+    result->mean = coefficients[0];
+    for (int j = 0; j < result->n_tones; j++) {
+        result->tones[j].frequency = bins[j] * grid_rate / n;
+        result->tones[j].amplitude = hypotf(coefficients[1 + 2 * j], coefficients[2 + 2 * j]);
+    }
+    result->residual = energy > 0 ? (float)(residual_energy / energy) : 0;
+
+    free(correlation);
+    free(atoms);
+    free(residual);
+    return true;
+}
+
+/**
+ * @brief Formats a compressive window as the JSON message of the /compressive topic, with the samples so the edge
+ * server can run its own recovery:
+ *   {"node_id":"node000000","grid_rate":500.0,"n":2500,"indices":[3,41,...],"values":[1.2345,...],
+ *    "mean":0.0012,"residual":0.0001,"tones":[[5.0,4.0],...]}
+ *
+ * @return The length of the message, at least size if it was truncated.
+ */
+int compressive_to_json(const uint32_t *indices, const float *values, int m, int n, float grid_rate,
+                        const compressive_result_t *result, const char *node_id, char *buffer, size_t size)
+{
+    int len = snprintf(buffer, size, "{\"node_id\":\"%s\",\"grid_rate\":%.3f,\"n\":%d,\"indices\":[", node_id, grid_rate, n);
+    for (int i = 0; i < m && len < (int)size; i++) {
+        len += snprintf(buffer + len, size - len, "%s%u", i == 0 ? "" : ",", (unsigned)indices[i]);
+    }
+    if (len < (int)size) {
+        len += snprintf(buffer + len, size - len, "],\"values\":[");
+    }
+    for (int i = 0; i < m && len < (int)size; i++) {
+        len += snprintf(buffer + len, size - len, "%s%.4f", i == 0 ? "" : ",", values[i]);
+    }
+    if (len < (int)size) {
+        len += snprintf(buffer + len, size - len, "],\"mean\":%.4f,\"residual\":%.5f,\"tones\":[", result->mean, result->residual);
+    }
+    for (int j = 0; j < result->n_tones && len < (int)size; j++) {
+        len += snprintf(buffer + len, size - len, "%s[%.3f,%.4f]", j == 0 ? "" : ",", result->tones[j].frequency, result->tones[j].amplitude);
+    }
+    if (len < (int)size) {
+        len += snprintf(buffer + len, size - len, "]}");
+    }
+    return len;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum number of tones recovered on the node, and of random samples in one window
+#define COMPRESSIVE_MAX_TONES 4
+#define COMPRESSIVE_MAX_SAMPLES 256
+
+// Columns of the least squares problem: the mean plus a cosine and a sine per tone
+#define COMPRESSIVE_MAX_ATOMS (2 * COMPRESSIVE_MAX_TONES + 1)
+
+typedef struct {
+    float frequency;    // Hz, on the grid of frequency resolution 1 / window
+    float amplitude;
+} compressive_tone_t;
+
+// Sparse model of one window recovered from randomly timed samples
+typedef struct {
+    float mean;         // Mean of the signal over the window, the aggregate
+    int n_tones;
+    compressive_tone_t tones[COMPRESSIVE_MAX_TONES];  // In the order they were found, strongest first
+    float residual;     // Energy of the samples not explained by the model, relative to their energy
+} compressive_result_t;
+
+void compressive_schedule(uint32_t *indices, int m, int n, uint32_t *rng);
+bool compressive_recover(const uint32_t *indices, const float *values, int m, int n, float grid_rate, int max_tones,
+                         float tolerance, compressive_result_t *result);
+int compressive_to_json(const uint32_t *indices, const float *values, int m, int n, float grid_rate,
+                        const compressive_result_t *result, const char *node_id, char *buffer, size_t size);
@@ -1,5 +1,12 @@
 #include "esp_wifi.h"
 #include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include <string.h>
 
 // Wi-Fi Configuration
@@ -7,59 +14,296 @@
 const char *ssid = "BernardoPixel";
 const char *pass = "12345678";
 
-// Number of retries to connect to Wi-Fi
+// Tag used for Logging
+static const char *WIFITAG = "WIFI";
+
+// Event group used to signal the connection state to the rest of the application
+static EventGroupHandle_t wifi_event_group = NULL;
+#define WIFI_CONNECTED_BIT BIT0
+
+// Reconnection backoff: the delay doubles on every failed attempt up to the maximum, with full jitter applied on top.
+// There is no retry cap, the station keeps trying until the access point comes back.
+#define WIFI_BACKOFF_BASE_MS 500
+#define WIFI_BACKOFF_MAX_MS 60000
+
+// Number of consecutive failed attempts since the last successful connection
 int retry_num = 0;
 
+// One-shot timer used to schedule the next connection attempt outside of the event handler
+static esp_timer_handle_t wifi_retry_timer = NULL;
+
+// Network interface of the station, used to apply the cached IP configuration
+static esp_netif_t *wifi_sta_netif = NULL;
+
+// Connection cache persisted in NVS, allowing to skip the full scan and the DHCP handshake after a reboot
+#define WIFI_CACHE_NAMESPACE "wifi_cache"
+#define WIFI_CACHE_KEY "ap"
+typedef struct {
+    uint8_t bssid[6];           // BSSID of the access point the station was last connected to
+    uint8_t channel;            // Primary channel of that access point
+    esp_netif_ip_info_t ip;     // IP address, netmask and gateway of the last DHCP lease
+} wifi_cache_t;
+
+static wifi_cache_t wifi_cache;
+static bool wifi_cache_valid = false;     // Whether the cache was loaded from NVS and is being used for the fast path
+static bool wifi_static_ip_active = false; // Whether the cached IP is applied instead of DHCP
+static bool wifi_ip_obtained = false;      // Whether the current association reached IP_EVENT_STA_GOT_IP
+
+// The cached IP is only a bridge until the broker is reached: DHCP is then restarted in the background to renew the
+// lease, which updates the cache. If the broker is not reached within WIFI_CACHE_VERIFY_MS of applying the cached IP
+// (expired lease, address taken by another device, gateway gone), the cache is dropped and DHCP takes over.
+#define WIFI_CACHE_VERIFY_MS 15000
+static esp_timer_handle_t wifi_verify_timer = NULL;
+
+/**
+ * @brief Hands the interface back to DHCP if the cached IP is applied, to renew the lease in the background.
+ */
+static void wifi_dhcp_renew(void)
+{
+    if (wifi_static_ip_active)
+    {
+        esp_netif_dhcpc_start(wifi_sta_netif);
+        wifi_static_ip_active = false;
+    }
+}
+
+/**
+ * @brief Loads the cached access point and IP information from NVS.
+ *
+ * @return true if a cache entry was found, false otherwise.
+ */
+static bool wifi_cache_load(void)
+{
+    nvs_handle_t handle;
+    if (nvs_open(WIFI_CACHE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return false;
+    }
+    size_t size = sizeof(wifi_cache);
+    esp_err_t err = nvs_get_blob(handle, WIFI_CACHE_KEY, &wifi_cache, &size);
+    nvs_close(handle);
+    return err == ESP_OK && size == sizeof(wifi_cache);
+}
+
+/**
+ * @brief Stores the access point and IP information in NVS, only writing to flash if it changed.
+ *
+ * @param cache The connection information to be stored.
+ */
+static void wifi_cache_store(const wifi_cache_t *cache)
+{
+    if (wifi_cache_valid && memcmp(cache, &wifi_cache, sizeof(wifi_cache_t)) == 0)
+    {
+        return;
+    }
+
+    nvs_handle_t handle;
+    if (nvs_open(WIFI_CACHE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGE(WIFITAG, "Failed to open NVS to store the Wi-Fi cache");
+        return;
+    }
+    if (nvs_set_blob(handle, WIFI_CACHE_KEY, cache, sizeof(wifi_cache_t)) == ESP_OK)
+    {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    memcpy(&wifi_cache, cache, sizeof(wifi_cache_t));
+    wifi_cache_valid = true;
+}
+
+/**
+ * @brief Drops the cached connection information and returns to a full scan with DHCP.
+ *
+ * Called when a connection attempt using the cache fails, since the access point may have moved to another
+ * channel, been replaced, or the IP lease may have been given to another device.
+ */
+static void wifi_cache_invalidate(void)
+{
+    wifi_cache_valid = false;
+
+    nvs_handle_t handle;
+    if (nvs_open(WIFI_CACHE_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        nvs_erase_key(handle, WIFI_CACHE_KEY);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+
+    wifi_config_t wifi_configuration;
+    esp_wifi_get_config(WIFI_IF_STA, &wifi_configuration);
+    wifi_configuration.sta.bssid_set = false;
+    wifi_configuration.sta.channel = 0;
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_configuration);
+
+    wifi_dhcp_renew();
+}
+
+/**
+ * @brief Timer callback fired when the broker was not reached with the cached IP in time.
+ */
+static void wifi_verify_timer_callback(void *arg)
+{
+    if (wifi_static_ip_active)
+    {
+        ESP_LOGW(WIFITAG, "Broker not reached within %d ms with the cached IP, dropping the cache", WIFI_CACHE_VERIFY_MS);
+        wifi_cache_invalidate();
+    }
+}
+
+/**
+ * @brief Confirms that the network works with the current configuration, called once the broker is reached.
+ *
+ * If the cached IP is applied, DHCP is restarted to renew the lease: the cache is then updated from the new lease on
+ * IP_EVENT_STA_GOT_IP, so it never gets older than one connection.
+ */
+void wifi_cache_confirm(void)
+{
+    esp_timer_stop(wifi_verify_timer);
+    if (wifi_static_ip_active)
+    {
+        ESP_LOGI(WIFITAG, "Broker reached with the cached IP, renewing the lease with DHCP");
+        wifi_dhcp_renew();
+    }
+}
+
+/**
+ * @brief Computes the delay before the next reconnection attempt.
+ *
+ * Exponential backoff with full jitter: a random delay between 0 and min(max, base * 2^retry), so that a fleet of
+ * nodes losing the access point at the same time doesn't reconnect in lockstep.
+ *
+ * @return The delay in milliseconds.
+ */
+static uint32_t wifi_backoff_delay_ms(void)
+{
+    uint32_t ceiling = WIFI_BACKOFF_MAX_MS;
+    if (retry_num < 16 && (WIFI_BACKOFF_BASE_MS << retry_num) < WIFI_BACKOFF_MAX_MS)
+    {
+        ceiling = WIFI_BACKOFF_BASE_MS << retry_num;
+    }
+    return esp_random() % (ceiling + 1);
+}
+
+/**
+ * @brief Timer callback that performs the scheduled connection attempt.
+ */
+static void wifi_retry_timer_callback(void *arg)
+{
+    printf("Retrying to Connect (attempt %d)...\n", retry_num);
+    esp_wifi_connect();
+}
 
 /**
  * @brief WiFi event handler function.
  *
  * This function is called when a WiFi event occurs. It handles different WiFi events and performs corresponding actions
  * following the examples seen in class
- * 
+ *
  * @param event_handler_arg Pointer to the event handler argument (not used).
  * @param event_base The event base associated with the event.
  * @param event_id The ID of the event.
- * @param event_data Pointer to the event data (not used).
+ * @param event_data Pointer to the event data.
  */
 static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
-    if (event_id == WIFI_EVENT_STA_START)
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
     {
         printf("WIFI CONNECTING....\n");
+        esp_wifi_connect();
     }
-    else if (event_id == WIFI_EVENT_STA_CONNECTED)
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
     {
         printf("WiFi CONNECTED\n");
+
+        // Reuse the cached IP lease instead of waiting for DHCP. Setting the IP info posts IP_EVENT_STA_GOT_IP, so the
+        // cache is only trusted until the broker is reached (wifi_cache_confirm) or WIFI_CACHE_VERIFY_MS expire
+        if (wifi_cache_valid && wifi_cache.ip.ip.addr != 0)
+        {
+            esp_netif_dhcpc_stop(wifi_sta_netif);
+            if (esp_netif_set_ip_info(wifi_sta_netif, &wifi_cache.ip) == ESP_OK)
+            {
+                wifi_static_ip_active = true;
+                esp_timer_stop(wifi_verify_timer);
+                esp_timer_start_once(wifi_verify_timer, (uint64_t)WIFI_CACHE_VERIFY_MS * 1000);
+            }
+            else
+            {
+                esp_netif_dhcpc_start(wifi_sta_netif);
+            }
+        }
     }
-    else if (event_id == WIFI_EVENT_STA_DISCONNECTED)
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
     {
         printf("WiFi lost connection\n");
-        if (retry_num < 5)
+        xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        esp_timer_stop(wifi_verify_timer);
+
+        // An attempt using the cache that never got an IP means the cache is stale
+        if (wifi_cache_valid && !wifi_ip_obtained)
         {
-            esp_wifi_connect();
-            retry_num++;
-            printf("Retrying to Connect...\n");
+            ESP_LOGW(WIFITAG, "Connection with cached AP information failed, falling back to a full scan");
+            wifi_cache_invalidate();
         }
+
+        wifi_ip_obtained = false;
+
+        uint32_t delay_ms = wifi_backoff_delay_ms();
+        retry_num++;
+        ESP_LOGI(WIFITAG, "Next connection attempt in %" PRIu32 " ms", delay_ms);
+        esp_timer_stop(wifi_retry_timer);
+        esp_timer_start_once(wifi_retry_timer, (uint64_t)delay_ms * 1000);
     }
-    else if (event_id == IP_EVENT_STA_GOT_IP)
+    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
     {
         printf("Wifi got IP...\n\n");
+        ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+        retry_num = 0;
+        wifi_ip_obtained = true;
+
+        // Cache the access point and the lease for the next boot
+        wifi_ap_record_t ap_info;
+        if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+        {
+            wifi_cache_t cache = {0};
+            memcpy(cache.bssid, ap_info.bssid, sizeof(cache.bssid));
+            cache.channel = ap_info.primary;
+            cache.ip = event->ip_info;
+            wifi_cache_store(&cache);
+        }
+
+        xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
 
 /**
  * @brief Function to connect to Wi-Fi.
  *
- * This function initializes the Wi-Fi module, and connects to the specified Wi-Fi network.
+ * This function initializes the Wi-Fi module, and starts connecting to the specified Wi-Fi network. If a previous
+ * connection was cached in NVS, the BSSID and channel are pinned so the station skips the full scan.
+ * The connection is completed asynchronously, use wifi_wait_connected() to block until an IP is obtained.
  */
 void wifi_connection()
 {
+    wifi_event_group = xEventGroupCreate();
+
+    const esp_timer_create_args_t retry_timer_args = {
+        .callback = wifi_retry_timer_callback,
+        .name = "wifi_retry",
+    };
+    esp_timer_create(&retry_timer_args, &wifi_retry_timer);
+    const esp_timer_create_args_t verify_timer_args = {
+        .callback = wifi_verify_timer_callback,
+        .name = "wifi_cache_verify",
+    };
+    esp_timer_create(&verify_timer_args, &wifi_verify_timer);
+
     //                          s1.4
     // 2 - Wi-Fi Configuration Phase
     esp_netif_init();
     esp_event_loop_create_default();     // event loop                    s1.2
-    esp_netif_create_default_wifi_sta(); // WiFi station                      s1.3
+    wifi_sta_netif = esp_netif_create_default_wifi_sta(); // WiFi station                      s1.3
     wifi_init_config_t wifi_initiation = WIFI_INIT_CONFIG_DEFAULT();
     esp_wifi_init(&wifi_initiation); //
     esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_event_handler, NULL);
@@ -74,12 +318,33 @@ void wifi_connection()
     };
     strcpy((char *)wifi_configuration.sta.ssid, ssid);
     strcpy((char *)wifi_configuration.sta.password, pass);
+
+    // Fast path: connect straight to the cached access point on its known channel
+    wifi_cache_valid = wifi_cache_load();
+    if (wifi_cache_valid)
+    {
+        ESP_LOGI(WIFITAG, "Using cached AP " MACSTR " on channel %d", MAC2STR(wifi_cache.bssid), wifi_cache.channel);
+        wifi_configuration.sta.bssid_set = true;
+        memcpy(wifi_configuration.sta.bssid, wifi_cache.bssid, sizeof(wifi_cache.bssid));
+        wifi_configuration.sta.channel = wifi_cache.channel;
+    }
+
     // esp_log_write(ESP_LOG_INFO, "Kconfig", "SSID=%s, PASS=%s", ssid, pass);
-    esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_configuration);
-    // 3 - Wi-Fi Start Phase
-    esp_wifi_start();
     esp_wifi_set_mode(WIFI_MODE_STA);
-    // 4- Wi-Fi Connect Phase
-    esp_wifi_connect();
-    printf("wifi_init_softap finished. SSID:%s  password:%s", ssid, pass);
-}
\ No newline at end of file
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_configuration);
+    // 3 - Wi-Fi Start Phase. The connection is triggered on WIFI_EVENT_STA_START
+    esp_wifi_start();
+    printf("wifi_init_sta finished. SSID:%s  password:%s\n", ssid, pass);
+}
+
+/**
+ * @brief Blocks until the station has obtained an IP address.
+ *
+ * @param timeout Maximum time to wait, in ticks (portMAX_DELAY to wait forever).
+ * @return true if connected, false if the timeout expired.
+ */
+bool wifi_wait_connected(TickType_t timeout)
+{
+    EventBits_t bits = xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, timeout);
+    return (bits & WIFI_CONNECTED_BIT) != 0;
+}
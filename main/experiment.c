@@ -0,0 +1,145 @@
+#include "experiment.h"
+#include <stdbool.h>
+#include <string.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "cJSON.h"
+#include "runtime_config.h"
+
+static const char *EXPTAG = "EXPERIMENT";
+
+// NVS location of the last matrix received
+#define EXPERIMENT_NVS_NAMESPACE "experiment"
+#define EXPERIMENT_NVS_KEY "matrix"
+
+/**
+ * @brief Fills the matrix with the bonus experiment: signals 1 to 3 at 500Hz with a 5 second window, 5 repetitions.
+ *
+ * @param matrix The matrix to be filled.
+ * @param max_fft_size The FFT size used for every run.
+ */
+void experiment_matrix_default(experiment_matrix_t *matrix, int max_fft_size)
+{
+    matrix->count = 3;
+    for (int i = 0; i < 3; i++) {
+        matrix->runs[i] = (experiment_config_t){
+            .signal = i + 1,
+            .base_rate = 500,
+            .time_window = 5,
+            .repetitions = 5,
+            .qos = 0,
+            .fft_size = max_fft_size,
+        };
+    }
+}
+
+// Reads an integer member of a JSON object between min and max, falling back to a default value if missing. A present
+// member must be a number with an integer raw value in range, like the fields of the runtime configuration.
+static bool json_get_member_int(const cJSON *object, const char *name, int min, int max, int default_value, int *value)
+{
+    const cJSON *item = cJSON_GetObjectItemCaseSensitive(object, name);
+    if (item == NULL) {
+        *value = default_value;
+        return true;
+    }
+    return json_get_int_in_range(item, min, max, value);
+}
+
+/**
+ * @brief Parses an experiment matrix received on the control topic.
+ *
+ * The expected format is a JSON object with a list of runs, where any missing field takes the bonus experiment value:
+ *   {"runs": [{"signal": 1, "base_rate": 500, "time_window": 5, "repetitions": 5, "qos": 1, "fft_size": 4096}, ...]}
+ * Runs with out of range values, or fields which are not integers (e.g. a string or 1e10), are rejected as a whole, so
+ * a bad matrix never partially executes. This includes runs
+ * whose phases (repetitions windows of time_window seconds) last more than EXPERIMENT_MAX_PHASE_SECONDS.
+ *
+ * @param json The JSON payload (not necessarily null-terminated).
+ * @param len The length of the payload.
+ * @param matrix The parsed matrix.
+ * @param max_fft_size The largest FFT size supported by the node.
+ * @return The number of runs parsed, or -1 if the payload is invalid.
+ */
+int experiment_matrix_parse(const char *json, int len, experiment_matrix_t *matrix, int max_fft_size)
+{
+    cJSON *root = cJSON_ParseWithLength(json, len);
+    const cJSON *runs = cJSON_GetObjectItemCaseSensitive(root, "runs");
+    if (!cJSON_IsArray(runs) || cJSON_GetArraySize(runs) == 0 || cJSON_GetArraySize(runs) > EXPERIMENT_MAX_RUNS) {
+        ESP_LOGE(EXPTAG, "Invalid experiment matrix: expected 1 to %d runs", EXPERIMENT_MAX_RUNS);
+        cJSON_Delete(root);
+        return -1;
+    }
+
+    int count = 0;
+    const cJSON *run;
+    cJSON_ArrayForEach(run, runs) {
+        int signal, base_rate, time_window, repetitions, qos, fft_size;
+        bool valid = json_get_member_int(run, "signal", 1, 3, 1, &signal) &&
+                     json_get_member_int(run, "base_rate", 1, 1000, 500, &base_rate) &&
+                     json_get_member_int(run, "time_window", 1, 600, 5, &time_window) &&
+                     json_get_member_int(run, "repetitions", 1, 100, 5, &repetitions) &&
+                     json_get_member_int(run, "qos", 0, 2, 0, &qos) &&
+                     json_get_member_int(run, "fft_size", 64, max_fft_size, max_fft_size, &fft_size);
+        if (!valid || (fft_size & (fft_size - 1)) != 0 || time_window * repetitions > EXPERIMENT_MAX_PHASE_SECONDS) {
+            ESP_LOGE(EXPTAG, "Invalid experiment run %d", count);
+            cJSON_Delete(root);
+            return -1;
+        }
+
+        matrix->runs[count++] = (experiment_config_t){
+            .signal = signal,
+            .base_rate = base_rate,
+            .time_window = time_window,
+            .repetitions = repetitions,
+            .qos = qos,
+            .fft_size = fft_size,
+        };
+    }
+    matrix->count = count;
+
+    cJSON_Delete(root);
+    return count;
+}
+
+/**
+ * @brief Loads the last experiment matrix stored in NVS.
+ *
+ * @param matrix The loaded matrix.
+ * @return ESP_OK if a matrix was found, otherwise the NVS error.
+ */
+esp_err_t experiment_matrix_load(experiment_matrix_t *matrix)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(EXPERIMENT_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    size_t size = sizeof(experiment_matrix_t);
+    err = nvs_get_blob(handle, EXPERIMENT_NVS_KEY, matrix, &size);
+    nvs_close(handle);
+    if (err == ESP_OK && (size != sizeof(experiment_matrix_t) || matrix->count < 1 || matrix->count > EXPERIMENT_MAX_RUNS)) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    return err;
+}
+
+/**
+ * @brief Stores the experiment matrix in NVS so that it survives a reboot.
+ *
+ * @param matrix The matrix to be stored.
+ * @return ESP_OK on success, otherwise the NVS error.
+ */
+esp_err_t experiment_matrix_store(const experiment_matrix_t *matrix)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(EXPERIMENT_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(handle, EXPERIMENT_NVS_KEY, matrix, sizeof(experiment_matrix_t));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
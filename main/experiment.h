@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+// Maximum number of runs in an experiment matrix
+#define EXPERIMENT_MAX_RUNS 16
+
+// Longest phase of a run in seconds (repetitions * time_window), measured twice with the INA219: runs whose phases the
+// power measurement can't cover are rejected
+#define EXPERIMENT_MAX_PHASE_SECONDS 3600
+
+// One run of the experiment matrix
+typedef struct {
+    uint8_t signal;         // Input signal (1 to 3)
+    uint16_t base_rate;     // Original (over)sampling rate in Hz, also used for the FFT
+    uint16_t time_window;   // Tumbling window in seconds
+    uint8_t repetitions;    // Number of windows aggregated and published per sampling rate
+    uint8_t qos;            // QoS of the /average publishes (latency is measured on PUBACK for QoS 1 and 2)
+    uint16_t fft_size;      // Number of samples of the FFT (power of two, at most N_SAMPLES)
+} experiment_config_t;
+
+// Matrix of runs executed back-to-back by the experiment runner
+typedef struct {
+    int count;
+    experiment_config_t runs[EXPERIMENT_MAX_RUNS];
+} experiment_matrix_t;
+
+// Result of one run, published as a structured record on the /experiment topic
+typedef struct {
+    float highest_frequency;        // Highest frequency peak found by the FFT in Hz
+    float optimal_sampling_rate;    // Optimal sampling rate in Hz (Nyquist)
+    float energy_optimal_wh;        // Energy of the windows sampled at the optimal rate in Wh
+    float energy_original_wh;       // Energy of the windows sampled at the base rate in Wh
+    int latency_count;              // Number of PUBACKs received
+    int64_t latency_avg_us;         // Average publish to PUBACK latency in microseconds
+    int64_t latency_max_us;         // Maximum publish to PUBACK latency in microseconds
+} experiment_result_t;
+
+void experiment_matrix_default(experiment_matrix_t *matrix, int max_fft_size);
+int experiment_matrix_parse(const char *json, int len, experiment_matrix_t *matrix, int max_fft_size);
+esp_err_t experiment_matrix_load(experiment_matrix_t *matrix);
+esp_err_t experiment_matrix_store(const experiment_matrix_t *matrix);
@@ -0,0 +1,392 @@
+#include "fft_backend.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_dsp.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+static const char *FFTTAG = "FFT_BACKEND";
+
+// NVS location of the tuning
+#define FFT_BACKEND_NVS_NAMESPACE "fft_backend"
+#define FFT_BACKEND_NVS_KEY "tuning"
+
+// Number of timed runs of each kernel, the fastest one is kept
+#define FFT_BACKEND_RUNS 5
+
+// Bins compared with the direct DFT, and largest error allowed on their power relative to the strongest one
+#define FFT_BACKEND_CHECK_BINS 8
+#define FFT_BACKEND_CHECK_TOLERANCE 1e-3f
+
+// The reference DFT rotates its twiddle factor by a complex multiplication and recomputes it exactly every this many
+// samples, so that the rounding errors of the float recurrence don't build up on the largest sizes
+#define FFT_BACKEND_PHASOR_RESYNC 64
+
+// Complex transforms of the n samples with a zero imaginary part. The spectrum is read from the first n / 2 bins.
+static esp_err_t fft2r_complex(float *data, int n)
+{
+    esp_err_t err = dsps_fft2r_fc32(data, n);
+    if (err == ESP_OK) {
+        err = dsps_bit_rev_fc32(data, n);
+    }
+    if (err == ESP_OK) {
+        err = dsps_cplx2reC_fc32(data, n);
+    }
+    return err;
+}
+
+static esp_err_t fft2r_ansi_complex(float *data, int n)
+{
+    esp_err_t err = dsps_fft2r_fc32_ansi(data, n);
+    if (err == ESP_OK) {
+        err = dsps_bit_rev_fc32(data, n);
+    }
+    if (err == ESP_OK) {
+        err = dsps_cplx2reC_fc32(data, n);
+    }
+    return err;
+}
+
+static esp_err_t fft4r_complex(float *data, int n)
+{
+    esp_err_t err = dsps_fft4r_fc32(data, n);
+    if (err == ESP_OK) {
+        err = dsps_bit_rev4r_fc32(data, n);
+    }
+    return err;
+}
+
+static esp_err_t fft4r_ansi_complex(float *data, int n)
+{
+    esp_err_t err = dsps_fft4r_fc32_ansi(data, n);
+    if (err == ESP_OK) {
+        err = dsps_bit_rev4r_fc32(data, n);
+    }
+    return err;
+}
+
+// Real transforms: the n real samples as n / 2 complex values, then split into the spectrum of the real signal
+static esp_err_t fft2r_real(float *data, int n)
+{
+    esp_err_t err = dsps_fft2r_fc32(data, n / 2);
+    if (err == ESP_OK) {
+        err = dsps_bit_rev_fc32(data, n / 2);
+    }
+    if (err == ESP_OK) {
+        err = dsps_cplx2real_fc32(data, n / 2);
+    }
+    return err;
+}
+
+static esp_err_t fft4r_real(float *data, int n)
+{
+    esp_err_t err = dsps_fft4r_fc32(data, n / 2);
+    if (err == ESP_OK) {
+        err = dsps_bit_rev4r_fc32(data, n / 2);
+    }
+    if (err == ESP_OK) {
+        err = dsps_cplx2real_fc32(data, n / 2);
+    }
+    return err;
+}
+
+// Registry of the kernels. dsps_fft2r_fc32 and dsps_fft4r_fc32 are the implementations esp-dsp selects for the chip
+// (assembly on the ESP32 and the ESP32-S3), the _ansi ones are the portable C implementations. Entry 0 is the
+// historical path of compute_power_spectrum(), used for the sizes that are not tuned.
+const fft_backend_t fft_backends[] = {
+    {"fft2r", false, fft2r_complex},
+    {"fft2r_ansi", false, fft2r_ansi_complex},
+    {"fft4r", false, fft4r_complex},
+    {"fft4r_ansi", false, fft4r_ansi_complex},
+    {"fft2r_real", true, fft2r_real},
+    {"fft4r_real", true, fft4r_real},
+};
+const int fft_backend_count = sizeof(fft_backends) / sizeof(fft_backends[0]);
+
+// Kernel applied for each size, indexed by log2(n / FFT_BACKEND_MIN_SIZE)
+static uint8_t fft_backend_choice[FFT_BACKEND_SIZES];
+
+// Returns the index of a size in the tuning, or -1 if it is not a tuned power of two
+static int size_index(int n)
+{
+    int index = 0;
+    for (int size = FFT_BACKEND_MIN_SIZE; size <= FFT_BACKEND_MAX_SIZE; size *= 2, index++) {
+        if (size == n) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Returns the kernel to use for an FFT of n points: the one chosen by the tuning, or the default one.
+ */
+const fft_backend_t *fft_backend_for_size(int n)
+{
+    int index = size_index(n);
+    return index < 0 ? &fft_backends[0] : &fft_backends[fft_backend_choice[index]];
+}
+
+/**
+ * @brief Loads a windowed real signal into the working array, in the layout of the kernel.
+ *
+ * @param backend The kernel.
+ * @param signal The n samples.
+ * @param window The n window coefficients.
+ * @param work The working array, 2 * n floats.
+ * @param n The number of points of the FFT.
+ */
+void fft_backend_load(const fft_backend_t *backend, const float *signal, const float *window, float *work, int n)
+{
+    if (backend->real_input) {
+        for (int i = 0; i < n; i++) {
+            work[i] = signal[i] * window[i];
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            work[i * 2 + 0] = signal[i] * window[i];
+            work[i * 2 + 1] = 0; // Imaginary part is zero
+        }
+    }
+}
+
+/**
+ * @brief Computes the power spectrum in dB of the transformed working array, bins 0 to n / 2 - 1, with the same
+ * scaling for every kernel.
+ */
+void fft_backend_power_db(const fft_backend_t *backend, const float *work, float *power_spectrum, int n)
+{
+    for (int i = 0; i < n / 2; i++) {
+        power_spectrum[i] = 10 * log10f((work[i * 2] * work[i * 2] + work[i * 2 + 1] * work[i * 2 + 1]) / n);
+    }
+}
+
+// Fills the workspace with the test signal of the check and the benchmark: two tones between bins, 40 dB apart, and
+// a low level of noise, under a Hann window
+static void fill_test_signal(const fft_backend_workspace_t *workspace, int n)
+{
+    uint32_t rng = 0x2545F491;
+    for (int i = 0; i < n; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        float noise = ((float)rng / 4294967296.0f - 0.5f) * 1e-3f;
+        workspace->signal[i] = sinf(2 * M_PI * 0.1103f * i) + 0.01f * sinf(2 * M_PI * 0.3171f * i + 1.0f) + noise;
+    }
+    dsps_wind_hann_f32(workspace->window, n);
+}
+
+/**
+ * @brief Computes the power of one bin of the windowed test signal with a direct DFT.
+ *
+ * The twiddle factor is advanced by a phasor recurrence in float (the ESP32-S3 has no double FPU), so a bin costs n
+ * complex multiply-adds and only n / FFT_BACKEND_PHASOR_RESYNC calls to cosf/sinf.
+ *
+ * @param workspace The buffers, with the test signal and the window.
+ * @param n The number of points of the FFT.
+ * @param bin The bin.
+ * @return The power of the bin, scaled like fft_backend_power_db.
+ */
+static float reference_power(const fft_backend_workspace_t *workspace, int n, int bin)
+{
+    float step_re = cosf(2 * (float)M_PI * bin / n);
+    float step_im = -sinf(2 * (float)M_PI * bin / n);
+    float phasor_re = 1, phasor_im = 0;
+    float re = 0, im = 0;
+    for (int i = 0; i < n; i++) {
+        if (i % FFT_BACKEND_PHASOR_RESYNC == 0) {
+            float angle = 2 * (float)M_PI * (float)(((int64_t)bin * i) % n) / n;
+            phasor_re = cosf(angle);
+            phasor_im = -sinf(angle);
+        }
+        float x = workspace->signal[i] * workspace->window[i];
+        re += x * phasor_re;
+        im += x * phasor_im;
+        float next_re = phasor_re * step_re - phasor_im * step_im;
+        phasor_im = phasor_re * step_im + phasor_im * step_re;
+        phasor_re = next_re;
+    }
+    return (re * re + im * im) / n;
+}
+
+/**
+ * @brief Checks a kernel against a direct DFT of the test signal, on a few bins: both tones, the edges of the
+ * spectrum and bins of noise.
+ *
+ * The power of each bin must match the reference within FFT_BACKEND_CHECK_TOLERANCE of the strongest bin, which
+ * catches a wrong ordering or scaling of the output, and the kernel must not return an error (unsupported size). The
+ * reference costs FFT_BACKEND_CHECK_BINS * n float multiply-adds, about as much as the transform itself.
+ *
+ * @param backend The kernel.
+ * @param workspace The buffers.
+ * @param n The number of points of the FFT.
+ * @return true if the kernel is correct for n points, false otherwise.
+ */
+bool fft_backend_check(const fft_backend_t *backend, const fft_backend_workspace_t *workspace, int n)
+{
+    fill_test_signal(workspace, n);
+    fft_backend_load(backend, workspace->signal, workspace->window, workspace->work, n);
+    if (backend->transform(workspace->work, n) != ESP_OK) {
+        return false;
+    }
+    fft_backend_power_db(backend, workspace->work, workspace->power, n);
+
+    int bins[FFT_BACKEND_CHECK_BINS] = {0, 1, (int)(0.1103f * n + 0.5f), (int)(0.3171f * n + 0.5f), n / 4 + 1, n / 3, n / 2 - 2, n / 2 - 1};
+    float reference[FFT_BACKEND_CHECK_BINS];
+    float max_power = 0;
+    for (int b = 0; b < FFT_BACKEND_CHECK_BINS; b++) {
+        reference[b] = reference_power(workspace, n, bins[b]);
+        max_power = fmaxf(max_power, reference[b]);
+    }
+    for (int b = 0; b < FFT_BACKEND_CHECK_BINS; b++) {
+        float power = powf(10, workspace->power[bins[b]] / 10);
+        if (fabsf(power - reference[b]) > FFT_BACKEND_CHECK_TOLERANCE * max_power) {
+            ESP_LOGW(FFTTAG, "%s is wrong for %d points at bin %d: %g instead of %g", backend->name, n, bins[b], power, reference[b]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Benchmarks every correct kernel of the registry on every size from FFT_BACKEND_MIN_SIZE to max_size and
+ * keeps the fastest one for each size.
+ *
+ * Only the transform is timed (CPU cycles, best of FFT_BACKEND_RUNS), the load and the power spectrum being the same
+ * for every kernel. A size with no correct kernel keeps the default one.
+ *
+ * @param workspace The buffers, for max_size points.
+ * @param max_size The largest size to tune.
+ * @param tuning The output tuning.
+ */
+void fft_backend_autotune(const fft_backend_workspace_t *workspace, int max_size, fft_backend_tuning_t *tuning)
+{
+    memset(tuning, 0, sizeof(fft_backend_tuning_t));
+    tuning->version = FFT_BACKEND_CACHE_VERSION << 8 | fft_backend_count;
+
+    int index = 0;
+    for (int n = FFT_BACKEND_MIN_SIZE; n <= max_size && n <= FFT_BACKEND_MAX_SIZE; n *= 2, index++) {
+        uint32_t best_cycles = UINT32_MAX;
+        for (int b = 0; b < fft_backend_count; b++) {
+            const fft_backend_t *backend = &fft_backends[b];
+            if (!fft_backend_check(backend, workspace, n)) {
+                continue;
+            }
+            uint32_t cycles = UINT32_MAX;
+            for (int run = 0; run < FFT_BACKEND_RUNS; run++) {
+                fft_backend_load(backend, workspace->signal, workspace->window, workspace->work, n);
+                unsigned int start = dsp_get_cpu_cycle_count();
+                backend->transform(workspace->work, n);
+                unsigned int elapsed = dsp_get_cpu_cycle_count() - start;
+                cycles = elapsed < cycles ? elapsed : cycles;
+            }
+            if (b == 0) {
+                tuning->default_cycles[index] = cycles;
+            }
+            if (cycles < best_cycles) {
+                best_cycles = cycles;
+                tuning->backend[index] = b;
+                tuning->cycles[index] = cycles;
+            }
+        }
+        if (best_cycles == UINT32_MAX) {
+            ESP_LOGE(FFTTAG, "No correct FFT kernel for %d points, keeping %s", n, fft_backends[0].name);
+        } else {
+            ESP_LOGI(FFTTAG, "%d points: %s in %" PRIu32 " cycles (%s: %" PRIu32 ")", n, fft_backends[tuning->backend[index]].name,
+                     tuning->cycles[index], fft_backends[0].name, tuning->default_cycles[index]);
+        }
+    }
+}
+
+/**
+ * @brief Checks that a tuning was made with this registry and that its kernels are still correct, e.g., after an
+ * update of esp-dsp.
+ */
+bool fft_backend_verify(const fft_backend_tuning_t *tuning, const fft_backend_workspace_t *workspace, int max_size)
+{
+    if (tuning->version != (FFT_BACKEND_CACHE_VERSION << 8 | fft_backend_count)) {
+        return false;
+    }
+    int index = 0;
+    for (int n = FFT_BACKEND_MIN_SIZE; n <= max_size && n <= FFT_BACKEND_MAX_SIZE; n *= 2, index++) {
+        if (tuning->backend[index] >= fft_backend_count || !fft_backend_check(&fft_backends[tuning->backend[index]], workspace, n)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Uses the kernels of a tuning from now on.
+ */
+void fft_backend_apply(const fft_backend_tuning_t *tuning)
+{
+    for (int i = 0; i < FFT_BACKEND_SIZES; i++) {
+        fft_backend_choice[i] = tuning->backend[i] < fft_backend_count ? tuning->backend[i] : 0;
+    }
+}
+
+/**
+ * @brief Loads the tuning stored in NVS.
+ *
+ * @param tuning The loaded tuning.
+ * @return ESP_OK if a tuning was found, otherwise the NVS error.
+ */
+esp_err_t fft_backend_tuning_load(fft_backend_tuning_t *tuning)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(FFT_BACKEND_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    size_t size = sizeof(fft_backend_tuning_t);
+    err = nvs_get_blob(handle, FFT_BACKEND_NVS_KEY, tuning, &size);
+    nvs_close(handle);
+    if (err == ESP_OK && size != sizeof(fft_backend_tuning_t)) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    return err;
+}
+
+/**
+ * @brief Stores the tuning in NVS, so the benchmark only runs at the first boot.
+ *
+ * @param tuning The tuning to be stored.
+ * @return ESP_OK on success, otherwise the NVS error.
+ */
+esp_err_t fft_backend_tuning_store(const fft_backend_tuning_t *tuning)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(FFT_BACKEND_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(handle, FFT_BACKEND_NVS_KEY, tuning, sizeof(fft_backend_tuning_t));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+/**
+ * @brief Formats a tuning as the JSON message of the /fft_backend topic:
+ *   {"node_id":"node000000","cached":false,"sizes":[{"n":64,"backend":"fft4r_real","cycles":2100,"default_cycles":4650},...]}
+ *
+ * @return The length of the message.
+ */
+int fft_backend_tuning_to_json(const fft_backend_tuning_t *tuning, int max_size, bool cached, const char *node_id, char *buffer, size_t size)
+{
+    int len = snprintf(buffer, size, "{\"node_id\":\"%s\",\"cached\":%s,\"sizes\":[", node_id, cached ? "true" : "false");
+    int index = 0;
+    for (int n = FFT_BACKEND_MIN_SIZE; n <= max_size && n <= FFT_BACKEND_MAX_SIZE && len < (int)size; n *= 2, index++) {
+        len += snprintf(buffer + len, size - len, "%s{\"n\":%d,\"backend\":\"%s\",\"cycles\":%" PRIu32 ",\"default_cycles\":%" PRIu32 "}",
+                        index == 0 ? "" : ",", n, fft_backends[tuning->backend[index]].name, tuning->cycles[index], tuning->default_cycles[index]);
+    }
+    if (len < (int)size) {
+        len += snprintf(buffer + len, size - len, "]}");
+    }
+    return len;
+}
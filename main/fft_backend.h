@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// Range of FFT sizes tuned at boot, powers of two
+#define FFT_BACKEND_MIN_SIZE 64
+#define FFT_BACKEND_MAX_SIZE 4096
+#define FFT_BACKEND_SIZES 7
+
+// Version of the registry: the tuning cached in NVS is discarded if it was made with another registry
+#define FFT_BACKEND_CACHE_VERSION 1
+
+// Float32 FFT kernel with a uniform interface: the windowed real signal is loaded into the working array by
+// fft_backend_load(), transformed in place by transform(), and the power spectrum is read by fft_backend_power_db()
+typedef struct {
+    const char *name;
+    bool real_input;    // The n real samples are packed as n / 2 complex values and split with dsps_cplx2real_fc32
+    esp_err_t (*transform)(float *data, int n);
+} fft_backend_t;
+
+// Kernel chosen for each size, with its cycles and the cycles of the default kernel (registry entry 0)
+typedef struct {
+    uint32_t version;
+    uint8_t backend[FFT_BACKEND_SIZES];
+    uint32_t cycles[FFT_BACKEND_SIZES];
+    uint32_t default_cycles[FFT_BACKEND_SIZES];
+} fft_backend_tuning_t;
+
+// Buffers used by the benchmark and the correctness check, for the largest size: max_size floats for the signal,
+// the window and the power spectrum, 2 * max_size floats for the working array (16-byte aligned)
+typedef struct {
+    float *signal;
+    float *window;
+    float *work;
+    float *power;
+} fft_backend_workspace_t;
+
+extern const fft_backend_t fft_backends[];
+extern const int fft_backend_count;
+
+const fft_backend_t *fft_backend_for_size(int n);
+void fft_backend_load(const fft_backend_t *backend, const float *signal, const float *window, float *work, int n);
+void fft_backend_power_db(const fft_backend_t *backend, const float *work, float *power_spectrum, int n);
+bool fft_backend_check(const fft_backend_t *backend, const fft_backend_workspace_t *workspace, int n);
+void fft_backend_autotune(const fft_backend_workspace_t *workspace, int max_size, fft_backend_tuning_t *tuning);
+bool fft_backend_verify(const fft_backend_tuning_t *tuning, const fft_backend_workspace_t *workspace, int max_size);
+void fft_backend_apply(const fft_backend_tuning_t *tuning);
+esp_err_t fft_backend_tuning_load(fft_backend_tuning_t *tuning);
+esp_err_t fft_backend_tuning_store(const fft_backend_tuning_t *tuning);
+int fft_backend_tuning_to_json(const fft_backend_tuning_t *tuning, int max_size, bool cached, const char *node_id, char *buffer, size_t size);
@@ -0,0 +1,113 @@
+#include "fft_q15.h"
+#include <math.h>
+#include "esp_dsp.h"
+
+// Full scale of a Q15 value
+#define Q15_ONE 32768.0f
+
+/**
+ * @brief Initializes the esp-dsp tables for the 16-bit fixed-point FFT.
+ *
+ * @param max_fft_size The maximum FFT size that will be used.
+ * @return ESP_OK on success, otherwise the esp-dsp error code.
+ */
+esp_err_t fft_q15_init(int max_fft_size)
+{
+    return dsps_fft2r_init_sc16(NULL, max_fft_size);
+}
+
+/**
+ * @brief Generates a Hann window in Q15.
+ *
+ * Same coefficients as dsps_wind_hann_f32, saturated to the Q15 range, taking half the memory.
+ *
+ * @param window Output array for the window coefficients.
+ * @param n The window length.
+ */
+void fft_q15_window_hann(int16_t *window, int n)
+{
+    for (int i = 0; i < n; i++) {
+        float w = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / n);
+        int32_t q = (int32_t)lrintf(w * Q15_ONE);
+        window[i] = q > INT16_MAX ? INT16_MAX : (int16_t)q;
+    }
+}
+
+/**
+ * @brief Applies the window and converts the signal to Q15 complex data with block floating point scaling.
+ *
+ * The whole block shares one exponent, chosen as the largest power of two that keeps the windowed peak inside the
+ * Q15 range, so quiet signals still use the full 16 bits. The imaginary part is set to zero.
+ *
+ * @param signal The input signal.
+ * @param window The Q15 window coefficients.
+ * @param data Output complex array (re, im interleaved) of 2 * n elements.
+ * @param n The number of samples.
+ * @return The block exponent: data = signal * window * 2^exponent.
+ */
+int fft_q15_load_windowed(const float *signal, const int16_t *window, int16_t *data, int n)
+{
+    float max_abs = 0;
+    for (int i = 0; i < n; i++) {
+        float v = fabsf(signal[i] * (window[i] / Q15_ONE));
+        if (v > max_abs) {
+            max_abs = v;
+        }
+    }
+
+    int exponent = 0;
+    if (max_abs > 0) {
+        exponent = (int)floorf(log2f(INT16_MAX / max_abs));
+    }
+    float scale = ldexpf(1.0f, exponent) / Q15_ONE;
+
+    for (int i = 0; i < n; i++) {
+        int32_t q = (int32_t)lrintf(signal[i] * window[i] * scale);
+        if (q > INT16_MAX) {
+            q = INT16_MAX;
+        } else if (q < INT16_MIN) {
+            q = INT16_MIN;
+        }
+        data[i * 2 + 0] = (int16_t)q;
+        data[i * 2 + 1] = 0;
+    }
+
+    return exponent;
+}
+
+/**
+ * @brief Runs the radix-2 Q15 FFT in place, leaving the bins in natural order.
+ *
+ * The complex-to-real split done by dsps_cplx2reC_fc32 on the float path is skipped: the imaginary input is zero,
+ * so bins 0..n/2 are already the spectrum of the real signal, which is all the peak detection looks at.
+ *
+ * @param data Complex array (re, im interleaved) of 2 * n elements.
+ * @param n The FFT size.
+ */
+void fft_q15_run(int16_t *data, int n)
+{
+    dsps_fft2r_sc16(data, n);
+    dsps_bit_rev_sc16_ansi(data, n);
+}
+
+/**
+ * @brief Computes the power spectrum in dB from the Q15 FFT output, on the same scale as the float path.
+ *
+ * dsps_fft2r_sc16 halves the data at every stage to avoid overflow, so the output is the true transform scaled by
+ * 2^exponent / n. Undoing both, |X|^2 / n = |Y|^2 * n / 2^(2 * exponent), which in dB becomes an offset applied
+ * to 10 * log10(|Y|^2).
+ *
+ * @param data The FFT output.
+ * @param n The FFT size.
+ * @param exponent The block exponent returned by fft_q15_load_windowed().
+ * @param power_spectrum Output array of n / 2 power values in dB.
+ */
+void fft_q15_power_spectrum_db(const int16_t *data, int n, int exponent, float *power_spectrum)
+{
+    float offset_db = 10 * log10f((float)n) - 20 * log10f(2.0f) * exponent;
+    for (int i = 0; i < n / 2; i++) {
+        int32_t re = data[i * 2 + 0];
+        int32_t im = data[i * 2 + 1];
+        power_spectrum[i] = 10 * log10f((float)(re * re + im * im)) + offset_db;
+    }
+}
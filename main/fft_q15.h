@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+esp_err_t fft_q15_init(int max_fft_size);
+void fft_q15_window_hann(int16_t *window, int n);
+int fft_q15_load_windowed(const float *signal, const int16_t *window, int16_t *data, int n);
+void fft_q15_run(int16_t *data, int n);
+void fft_q15_power_spectrum_db(const int16_t *data, int n, int exponent, float *power_spectrum);
@@ -0,0 +1,128 @@
+#include "freq_estimator.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * @brief Resets the estimator, the next complete window becoming the new baseline.
+ *
+ * To be called whenever the sampling frequency changes, since the features depend on it.
+ *
+ * @param estimator The estimator.
+ */
+void freq_estimator_reset(freq_estimator_t *estimator)
+{
+    memset(estimator, 0, sizeof(freq_estimator_t));
+}
+
+/**
+ * @brief Accumulates the samples of one frame of the current window.
+ *
+ * Counts the crossings of the mean of the previous window and accumulates the sums needed for the mean, the variance
+ * and the lag-1 autocorrelation. Frames are chained, the first sample of a frame pairing with the last of the previous.
+ * The first window after a reset has no previous mean and crosses the mean of its first frame instead: a level of 0
+ * would miss every crossing of a signal with a DC offset (e.g. the ADC) and flag the next window as a change.
+ *
+ * @param estimator The estimator.
+ * @param samples The samples of the frame.
+ * @param len The number of samples.
+ */
+void freq_estimator_update(freq_estimator_t *estimator, const float *samples, int len)
+{
+    if (!estimator->level_valid && len > 0) {
+        float sum = 0;
+        for (int i = 0; i < len; i++) {
+            sum += samples[i];
+        }
+        estimator->level = sum / len;
+        estimator->level_valid = true;
+    }
+
+    float previous = estimator->previous;
+    float level = estimator->level;
+    for (int i = 0; i < len; i++) {
+        float x = samples[i];
+        estimator->sum += x;
+        estimator->sum_squares += x * x;
+        if (estimator->count + i > 0) {
+            estimator->sum_lag1 += x * previous;
+            if ((x >= level) != (previous >= level)) {
+                estimator->crossings++;
+            }
+        }
+        previous = x;
+    }
+    estimator->previous = previous;
+    estimator->count += len;
+}
+
+/**
+ * @brief Relative difference between two non-negative values, 0 if both are (close to) 0.
+ */
+static float relative_change(float value, float reference)
+{
+    float scale = fmaxf(fabsf(value), fabsf(reference));
+    return scale > 1e-6f ? fabsf(value - reference) / scale : 0;
+}
+
+/**
+ * @brief Completes the current window, estimating its frequency content and comparing it with the baseline.
+ *
+ * Two cheap estimates are used: the zero-crossing rate, which follows the dominant component, and the lag-1
+ * autocorrelation r1, from which acos(r1) is the power-weighted RMS angular frequency of the spectrum. The window is
+ * meant to be sampled well above the frequencies of interest (the maximum sampling rate), where both are stable from
+ * one window to the next. The spectrum likely changed if either estimate or the variance moved beyond the tolerances
+ * since the baseline, and likely exceeds the Nyquist frequency of the current sampling rate if either estimate is
+ * above it while the baseline was not. The first window after a reset becomes the baseline and reports no change.
+ *
+ * @param estimator The estimator.
+ * @param sampling_frequency The sampling frequency of the window in Hz.
+ * @param nyquist_frequency Half of the sampling frequency currently used to aggregate the signal, in Hz.
+ * @return true if the sampling frequency should be re-tuned with the full FFT, false otherwise.
+ */
+bool freq_estimator_window_end(freq_estimator_t *estimator, float sampling_frequency, float nyquist_frequency)
+{
+    uint32_t n = estimator->count;
+    if (n < 2) {
+        return false;
+    }
+
+    double mean = estimator->sum / n;
+    double variance = estimator->sum_squares / n - mean * mean;
+    double covariance = estimator->sum_lag1 / (n - 1) - mean * mean;
+    float r1 = variance > 1e-12 ? (float)(covariance / variance) : 1;
+    r1 = fminf(fmaxf(r1, -1), 1);
+
+    freq_estimate_t estimate = {
+        .zero_crossing_frequency = estimator->crossings * sampling_frequency / (2.0f * (n - 1)),
+        .autocorrelation_frequency = acosf(r1) * sampling_frequency / (2 * (float)M_PI),
+        .variance = (float)variance,
+    };
+    estimator->last = estimate;
+
+    // Start the next window, crossing the mean of this one
+    estimator->count = 0;
+    estimator->crossings = 0;
+    estimator->sum = estimator->sum_squares = estimator->sum_lag1 = 0;
+    estimator->level = (float)mean;
+
+    // The baseline is taken right after the FFT re-tuned the sampling frequency, so it is recorded even if it is above
+    // the Nyquist limit (e.g. the rate is capped at the maximum), otherwise every following window would force the FFT
+    if (!estimator->baseline_valid) {
+        estimator->baseline = estimate;
+        estimator->baseline_valid = true;
+        return false;
+    }
+
+    const freq_estimate_t *baseline = &estimator->baseline;
+    float nyquist_limit = nyquist_frequency * (1 + FREQ_ESTIMATOR_FREQUENCY_TOLERANCE);
+    bool above_nyquist = estimate.zero_crossing_frequency > nyquist_limit || estimate.autocorrelation_frequency > nyquist_limit;
+    bool baseline_above_nyquist = baseline->zero_crossing_frequency > nyquist_limit || baseline->autocorrelation_frequency > nyquist_limit;
+    if (above_nyquist && !baseline_above_nyquist) {
+        return true;
+    }
+
+    float variance_ratio = (estimate.variance + 1e-6f) / (baseline->variance + 1e-6f);
+    return relative_change(estimate.zero_crossing_frequency, baseline->zero_crossing_frequency) > FREQ_ESTIMATOR_FREQUENCY_TOLERANCE ||
+           relative_change(estimate.autocorrelation_frequency, baseline->autocorrelation_frequency) > FREQ_ESTIMATOR_FREQUENCY_TOLERANCE ||
+           variance_ratio > FREQ_ESTIMATOR_VARIANCE_TOLERANCE || variance_ratio < 1 / FREQ_ESTIMATOR_VARIANCE_TOLERANCE;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Relative change of the estimated frequencies, and ratio of the variance, above which the spectrum is considered changed
+#define FREQ_ESTIMATOR_FREQUENCY_TOLERANCE 0.15f
+#define FREQ_ESTIMATOR_VARIANCE_TOLERANCE 1.5f
+
+// Features of one window, computed from the streaming sums
+typedef struct {
+    float zero_crossing_frequency;  // Frequency from the rate of crossings of the mean, in Hz
+    float autocorrelation_frequency;// Power-weighted RMS frequency from the lag-1 autocorrelation, in Hz
+    float variance;
+} freq_estimate_t;
+
+// Streaming estimator state, updated one frame at a time in O(n)
+typedef struct {
+    // Sums of the current window
+    uint32_t count;
+    uint32_t crossings;
+    double sum;
+    double sum_squares;
+    double sum_lag1;
+    float previous;             // Last sample of the previous frame
+    float level;                // Crossing level: the mean of the previous window, or of the first frame after a reset
+    bool level_valid;
+    // Reference features, taken from the first window after a reset
+    bool baseline_valid;
+    freq_estimate_t baseline;
+    freq_estimate_t last;
+} freq_estimator_t;
+
+void freq_estimator_reset(freq_estimator_t *estimator);
+void freq_estimator_update(freq_estimator_t *estimator, const float *samples, int len);
+bool freq_estimator_window_end(freq_estimator_t *estimator, float sampling_frequency, float nyquist_frequency);
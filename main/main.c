@@ -9,10 +9,60 @@
 #include "mqtt.c"
 #include "nvs_flash.h"
 #include <ina219.h>
+#include "esp_heap_caps.h"
+#include "codec.h"
+#include "fft_q15.h"
+#include "experiment.h"
+#include "runtime_config.h"
+#include "synth.h"
+#include "report_policy.h"
+#include "zoom_fft.h"
+#include "acquisition.h"
+#include "freq_estimator.h"
+#include "timesync.h"
+#include "spectral_sketch.h"
+#include "spectral_change.h"
+#include "multires.h"
+#include "compressive.h"
+#include "fft_backend.h"
+#include "resource_stats.h"
+#include "freertos/queue.h"
 
 // Boolean that triggers the power measurement. Should be set to false when the ESP32 is connected via USB.
 bool power_measurement_active = true;
 
+// Boolean that enables the occasional upload of full-fidelity raw windows to the /raw topic
+bool raw_upload_active = false;
+
+// Booleans that run the bonus benchmarks at boot: the synthetic source against the sin() based signal functions, the
+// Q15 FFT path against the float32 one (2 x FFT_BENCHMARK_REPETITIONS transforms per signal, measured with the INA219
+// and published to /energy) and the frequency pre-check against the FFT. They delay the sampling loop, so they are off
+// unless one of them is being evaluated.
+bool synthesis_benchmark_active = false;
+bool fixed_point_benchmark_active = false;
+bool freq_precheck_benchmark_active = false;
+
+// Boolean that refines the peak found by the coarse FFT with a zoom-FFT before choosing the sampling frequency
+bool zoom_fft_active = false;
+
+// Zoom-FFT: the band of width fs / ZOOM_FFT_DECIMATION around the coarse peak is analyzed with a ZOOM_FFT_SIZE-point
+// FFT, a resolution of fs / (ZOOM_FFT_DECIMATION * ZOOM_FFT_SIZE), 8 times finer than the 4096-point coarse FFT.
+// ZOOM_FFT_SIZE complex values must fit in signal_, which is reused as the work buffer.
+#define ZOOM_FFT_DECIMATION 64
+#define ZOOM_FFT_SIZE 512
+
+// Acquisition backend of the continuous adaptive sampling: ACQUISITION_FUNCTION samples input_signal_1 as in the
+// rest of the assignment, ACQUISITION_SYNTH generates synth_signals[0] and ACQUISITION_ADC reads ACQUISITION_ADC_CHANNEL
+// of ADC unit 1
+#define ACQUISITION_BACKEND ACQUISITION_FUNCTION
+#define ACQUISITION_ADC_CHANNEL ADC_CHANNEL_3
+
+// Raw window upload: one window out of every RAW_UPLOAD_EVERY_N_WINDOWS is compressed and sent in chunks of
+// RAW_UPLOAD_CHUNK_SIZE bytes, quantized to RAW_UPLOAD_QUANTIZATION_STEP (same 3 decimals as the /average topic)
+#define RAW_UPLOAD_EVERY_N_WINDOWS 10
+#define RAW_UPLOAD_CHUNK_SIZE 1024
+#define RAW_UPLOAD_QUANTIZATION_STEP 0.001f
+
 // Define the number PI for sine calculation
 #define PI 3.14159265
 
@@ -28,19 +78,136 @@ int N = N_SAMPLES;
 #define SIGNAL_ORIGINAL_SAMPLING_FREQUENCY 100
 #define TIME_BETWEEN_SAMPLES (1.0 / SIGNAL_ORIGINAL_SAMPLING_FREQUENCY)
 
-// Window coefficients
-__attribute__((aligned(16))) float wind[N_SAMPLES];
+// Selects the FFT path at compile time: 0 for the float32 path (dsps_fft2r_fc32), 1 for the Q15 fixed-point path
+// (dsps_fft2r_sc16 with block floating point scaling), which halves the memory of the window and of the FFT working
+// array and runs faster on cores without a fast FPU. Both paths produce the same dB power spectrum.
+#define FFT_FIXED_POINT 0
+
 // Signal array
 __attribute__((aligned(16))) float signal_[N_SAMPLES];
+#if FFT_FIXED_POINT
+// Window coefficients (Q15)
+__attribute__((aligned(16))) int16_t wind_q15[N_SAMPLES];
+// FFT working complex array (Q15), sharing the block exponent y_sc_exponent
+__attribute__((aligned(16))) int16_t y_sc[N_SAMPLES * 2];
+int y_sc_exponent = 0;
+#else
+// Window coefficients
+__attribute__((aligned(16))) float wind[N_SAMPLES];
 // FFT working complex array
 __attribute__((aligned(16))) float y_cf[N_SAMPLES * 2];
+#endif
 // Power spectrum array
 __attribute__((aligned(16))) float power_spectrum[N_SAMPLES];
 
-// Latency measurement
+// Latency measurement: publish_msg_id is the id of the last message published by publish_data(), and only the
+// PUBACK of latency_msg_id completes a measurement (the other QoS 1 topics are acknowledged too)
 int64_t publish_start_time = 0;
+int64_t last_publish_latency = 0;
+int publish_msg_id = -1;
+int latency_msg_id = -1;
 bool measuring_latency = false;
 
+// End-to-end latency tracing: the node clock is synchronized with the edge server over MQTT (requests on /timesync,
+// responses on the control topic), and the timestamps of each window are sent along with it in the edge clock
+#define TIMESYNC_CONTROL_TOPIC "/control/" NODE_ID "/timesync"
+#define TIMESYNC_REQUESTS 4
+timesync_t timesync;
+portMUX_TYPE timesync_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Timestamps of one window on the node clock
+typedef struct {
+    int64_t sample_end_us;      // Last sample of the window taken
+    int64_t aggregate_ready_us; // Aggregate computed
+} window_trace_t;
+
+// Time the last sample of the latest window was taken, on the node clock
+int64_t last_sample_end_us = 0;
+
+// Set by the backpressure callback of the MQTT outbox: while congested, the sampling loop publishes full batches and
+// skips the raw window uploads
+volatile bool publish_congested = false;
+
+// Experiment runner: matrices received on the control topic are queued here until the current matrix is finished
+#define EXPERIMENT_CONTROL_TOPIC "/control/" NODE_ID "/experiments"
+QueueHandle_t experiment_queue = NULL;
+
+// Runtime configuration: the active copy is only changed by the sampling loop, between windows. Updates received on
+// the control topic are validated, persisted and staged in pending_config until then.
+#define CONFIG_CONTROL_TOPIC "/control/" NODE_ID "/config"
+runtime_config_t runtime_config;
+runtime_config_t pending_config;
+bool config_pending = false;
+portMUX_TYPE config_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Number of windows after which the sampling loop runs the FFT again to re-tune the sampling rate
+#define RETUNE_EVERY_N_WINDOWS 12
+
+// Reporting policy of the sampling loop (send-on-delta), configured from the runtime configuration
+report_policy_t report_policy;
+
+// Boolean that replaces the periodic FFT of the sampling loop by a time-domain pre-check, running the FFT only when the
+// pre-check detects that the spectrum changed or exceeds the current Nyquist frequency
+bool freq_precheck_active = true;
+
+// Time-domain frequency estimator of the pre-check, whose baseline is taken right after each FFT
+freq_estimator_t freq_estimator;
+
+// Boolean that compares every spectrum of the re-tuning with a baseline fingerprint of the previous ones (band envelope
+// and strongest peaks, spectral_change.c), publishing a spectral change event with the new peaks to /spectral_change
+// when they differ by more than SPECTRAL_CHANGE_THRESHOLD_DB. While the spectrum is stationary, the rate of the previous
+// tuning is kept without refining or offloading it again, and the re-tunings are spaced out, up to
+// SPECTRAL_CHANGE_MAX_BACKOFF times RETUNE_EVERY_N_WINDOWS windows apart.
+bool spectral_change_active = true;
+#define SPECTRAL_CHANGE_THRESHOLD_DB 6.0f
+#define SPECTRAL_CHANGE_DECAY 0.25f
+#define SPECTRAL_CHANGE_MAX_BACKOFF 8
+spectral_baseline_t spectral_baseline;
+float spectral_baseline_rate = 0;
+
+// Boolean that offloads the spectral analysis of the re-tuning to the edge server: the node only runs a
+// SPECTRAL_SKETCH_FFT_SIZE-point FFT, uploads a sketch of it (strongest peaks and band envelope) to /spectrum and
+// applies the sampling rate the edge server recommends on the rate control topic, analyzing the history of the node and
+// of its neighbours. If no recommendation arrives within SPECTRAL_OFFLOAD_TIMEOUT_MS, the sketch is analyzed locally.
+bool spectral_offload_active = false;
+#define SPECTRAL_SKETCH_FFT_SIZE 512
+#define SPECTRAL_OFFLOAD_TIMEOUT_MS 3000
+#define SPECTRAL_RATE_CONTROL_TOPIC "/control/" NODE_ID "/rate"
+QueueHandle_t spectral_rate_queue = NULL;
+
+// Boolean that compares the randomized sub-Nyquist (compressive) sampling with the uniform sampling at the optimal rate
+// in the bonus section, with the INA219. A compressive window takes COMPRESSIVE_SAMPLES samples at random times of a grid
+// of COMPRESSIVE_GRID_RATE Hz, whatever the highest frequency of the signal, and recovers its mean and up to
+// COMPRESSIVE_MAX_TONES tones on the node (compressive.c). The samples are published to /compressive so that the edge
+// server can recover more tones.
+bool compressive_sampling_active = false;
+#define COMPRESSIVE_GRID_RATE 500
+#define COMPRESSIVE_SAMPLES 64
+#define COMPRESSIVE_TOLERANCE 1e-3f
+#define COMPRESSIVE_TIME_WINDOW 5
+#define COMPRESSIVE_REPETITIONS 5
+
+// Multi-resolution aggregation of the sampling loop (multires.c): the aggregation window of time_window seconds and the
+// rollup windows are computed in the same pass over the samples. The rollups and the statistics of any recent period
+// can be requested at runtime on the rollup control topic, e.g. {"windows": [60, 300], "query": [120]}, without
+// acquiring the signal again. Both are published to the /rollup topic.
+#define MULTIRES_CONTROL_TOPIC "/control/" NODE_ID "/rollup"
+#define MULTIRES_AGGREGATE_WINDOW 0
+multires_t multires;
+uint32_t rollup_windows[MULTIRES_MAX_WINDOWS - 1] = {60, 300};
+int n_rollup_windows = 2;
+multires_request_t pending_rollup_request;
+bool rollup_request_pending = false;
+portMUX_TYPE rollup_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Boolean that publishes the resources of the node to the /stats topic every RESOURCE_STATS_PERIOD_S seconds, from a
+// low-priority task (resource_stats.c): CPU load and stack high-water mark of each task, free heap against its largest
+// free block, and occupancy of the MQTT outbox. The loads and the list of tasks need CONFIG_FREERTOS_USE_TRACE_FACILITY
+// and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS to be enabled in menuconfig.
+bool resource_stats_active = true;
+#define RESOURCE_STATS_PERIOD_S 30
+#define RESOURCE_STATS_TASK_STACK 3072
+
 
 // INA219 variables
 #define I2C_PORT 0
@@ -52,9 +219,13 @@ bool measuring_latency = false;
 ina219_t dev;
 float power;
 
+// Longest power measurement in seconds. The samples are accumulated as they come, so the memory doesn't depend on the
+// duration, which only bounds the number of samples averaged.
+#define POWER_MEASUREMENT_MAX_SECONDS (3 * EXPERIMENT_MAX_PHASE_SECONDS)
+
 // Structure for Power Measurement Data
 typedef struct {
-    float *power_values; // Array to store power values
+    double power_sum; // Sum of the power values measured
     int max_samples; // Maximum number of samples to measure
     int current_sample_count; // Current number of samples measured
     bool measuring; // Flag to indicate if power measurement is active
@@ -68,8 +239,9 @@ typedef struct {
     float total_energy_wh; // Total energy in Wh
 } power_measurement_result_t;
 
-// Global power measurement control structure
+// Global power measurement control structure, shared with power_measurement_task
 power_measurement_t pm;
+portMUX_TYPE pm_mux = portMUX_INITIALIZER_UNLOCKED;
 
 // Define a function pointer type for the signal generation function
 typedef float (*signal_function_t)(float t);
@@ -89,6 +261,9 @@ float input_signal_3(float t) {
     return 3 * sin(2 * PI * 150 * t);
 }
 
+// Input signals selectable by number (1 to 3) in the experiment matrix
+signal_function_t input_signals[] = {input_signal_1, input_signal_2, input_signal_3};
+
 /**
  * @brief Samples a signal with fixed memory allocation.
  *
@@ -184,11 +359,31 @@ float* sample_signal_dynamic_with_delay(signal_function_t signal_func, float sam
     return signal_;
 }
 
+/**
+ * @brief Applies a Hann window to the samples in the signal array and stores the result in y_cf (or y_sc on the
+ * fixed-point path), ready for compute_power_spectrum().
+ *
+ * @param fft_size The number of samples, N or a smaller power of 2.
+ */
+void window_stored_signal(int fft_size) {
+#if FFT_FIXED_POINT
+    // Apply hann window to the signal, converting it to Q15 with a shared block exponent
+    fft_q15_window_hann(wind_q15, fft_size);
+    y_sc_exponent = fft_q15_load_windowed(signal_, wind_q15, y_sc, fft_size);
+#else
+    // Apply hann window to the signal, in the layout of the FFT kernel tuned for fft_size points
+    dsps_wind_hann_f32(wind, fft_size);
+    fft_backend_load(fft_backend_for_size(fft_size), signal_, wind, y_cf, fft_size);
+#endif
+
+    ESP_LOGI(TAG, "Signal data stored.");
+}
+
 /**
  * @brief Stores the generated signal in memory after applying a Hann window.
  * 
  * This function generates an input signal based on a signal function and stores it in memory (signal) with a certain sampling frequency.
- * It then applies a Hann window to the signal and stores the result in the complex array y_cf.
+ * It then applies a Hann window to the signal and stores the result in the complex array y_cf (or y_sc on the fixed-point path).
  * The imaginary part of each element in y_cf is set to zero.
  * 
  */
@@ -196,15 +391,89 @@ void store_signal(signal_function_t signal_func, int sampling_frequency) {
     // Generate input signal and store it in memory (signal) with a certain sampling frequency
     sample_signal_fixed_with_delay(signal_, N, sampling_frequency, signal_func);
 
-    // Apply hann window to the signal
-    dsps_wind_hann_f32(wind, N);
-    for (int i = 0; i < N; i++) {
-        y_cf[i * 2 + 0] = signal_[i] * wind[i];
-        y_cf[i * 2 + 1] = 0; // Imaginary part is zero
+    window_stored_signal(N);
+}
+
+/**
+ * @brief Stores fft_size samples of an acquisition in memory after applying a Hann window, like store_signal().
+ *
+ * The samples are read straight into the signal array, without going through the acquisition frames.
+ *
+ * @param acquisition The started acquisition.
+ * @param fft_size The number of samples, N or a smaller power of 2.
+ */
+void store_signal_acquisition(acquisition_t *acquisition, int fft_size) {
+    int count = acquisition_read(acquisition, signal_, fft_size);
+    if (count < fft_size) {
+        ESP_LOGE(TAG, "Acquisition stopped after %i of %i samples", count, fft_size);
+        memset(signal_ + count, 0, (fft_size - count) * sizeof(float));
     }
 
-    ESP_LOGI(TAG, "Signal data stored.");
+    window_stored_signal(fft_size);
+}
+
+/**
+ * @brief Computes the power spectrum of the stored signal.
+ *
+ * FFT processing to find the power spectrum, as seen in the official ESP-DSP example:
+ * https://github.com/espressif/esp-dsp/blob/master/examples/fft/README.md
+ * The result is stored in power_spectrum in dB, for the float32 or the Q15 path depending on FFT_FIXED_POINT.
+ *
+ * @param fft_size The size of the FFT, as given to window_stored_signal().
+ * @return The number of CPU cycles taken by the FFT itself. On the float32 path, this is the whole kernel of
+ * fft_backend.c, including its bit reversal and split, so it is higher than the butterflies alone measured before
+ * the registry. On the Q15 path, it includes the bit reversal too.
+ */
+unsigned int compute_power_spectrum(int fft_size) {
+#if FFT_FIXED_POINT
+    unsigned int start_b = dsp_get_cpu_cycle_count();
+    fft_q15_run(y_sc, fft_size);
+    unsigned int end_b = dsp_get_cpu_cycle_count();
+
+    fft_q15_power_spectrum_db(y_sc, fft_size, y_sc_exponent, power_spectrum);
+#else
+    // FFT kernel chosen by tune_fft_backends() for fft_size points (dsps_fft2r_fc32 by default)
+    const fft_backend_t *backend = fft_backend_for_size(fft_size);
+    unsigned int start_b = dsp_get_cpu_cycle_count();
+    backend->transform(y_cf, fft_size);
+    unsigned int end_b = dsp_get_cpu_cycle_count();
+
+    // Calculate power spectrum
+    fft_backend_power_db(backend, y_cf, power_spectrum, fft_size);
+#endif
+    return end_b - start_b;
+}
+
+#if !FFT_FIXED_POINT
+/**
+ * @brief Selects the fastest correct float32 FFT kernel for each size up to N_SAMPLES, at boot.
+ *
+ * The choice cached in NVS is reused after checking that its kernels are still correct, so the benchmark of the
+ * registry (fft_backend_autotune()) only runs at the first boot or after an update of the registry or of esp-dsp.
+ * The choice is published to the /fft_backend topic, with the cycles of each kernel against the default one.
+ * The signal, window, FFT and power spectrum arrays are used as workspace, so this runs before the signal is stored.
+ */
+void tune_fft_backends(void) {
+    fft_backend_workspace_t workspace = {signal_, wind, y_cf, power_spectrum};
+    fft_backend_tuning_t tuning;
+
+    bool cached = fft_backend_tuning_load(&tuning) == ESP_OK && fft_backend_verify(&tuning, &workspace, N_SAMPLES);
+    if (!cached) {
+        ESP_LOGW(TAG, "No valid FFT kernel tuning in NVS, benchmarking the kernels...");
+        fft_backend_autotune(&workspace, N_SAMPLES, &tuning);
+        esp_err_t err = fft_backend_tuning_store(&tuning);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to store the FFT kernel tuning: %s", esp_err_to_name(err));
+        }
+    }
+    fft_backend_apply(&tuning);
+
+    static char json[768];
+    fft_backend_tuning_to_json(&tuning, N_SAMPLES, cached, NODE_ID, json, sizeof(json));
+    mqtt_publish("/fft_backend", json, 1, 0);
+    ESP_LOGW(TAG, "FFT kernels: %s", json);
 }
+#endif
 
 /**
  * @brief Measures the maximum sampling frequency of stored signal data.
@@ -281,6 +550,91 @@ float find_highest_frequency_peak_above_db_level(float db_level, float sampling_
     }
 }
 
+/**
+ * @brief Compares a new spectrum with a baseline fingerprint, publishing a spectral change event to /spectral_change
+ * if they differ by more than SPECTRAL_CHANGE_THRESHOLD_DB, if the highest peak above the threshold moved, appeared
+ * or vanished, or if the baseline was not comparable (first spectrum, other sampling frequency or FFT size), then
+ * updates the baseline.
+ *
+ * @param baseline The baseline fingerprint.
+ * @param sketch The sketch of the new spectrum.
+ * @param highest_frequency The highest peak above the threshold in the full new spectrum in Hz, -1 for none.
+ * @return true if the spectrum is stationary, false if it changed.
+ */
+bool check_spectral_change(spectral_baseline_t *baseline, const spectral_sketch_t *sketch, float highest_frequency) {
+    float distance = -1;
+    bool changed = true;
+    if (spectral_baseline_comparable(baseline, sketch)) {
+        distance = spectral_change_distance(baseline, sketch);
+        changed = distance > SPECTRAL_CHANGE_THRESHOLD_DB || spectral_highest_frequency_moved(baseline, sketch, highest_frequency);
+    }
+    if (changed) {
+        char json[384];
+        spectral_change_to_json(baseline, sketch, distance, NODE_ID, json, sizeof(json));
+        mqtt_publish("/spectral_change", json, 1, 0);
+        ESP_LOGW(TAG, "Spectral change: distance %f dB from the baseline, highest peak %f Hz (was %f Hz), %d peaks", distance,
+                 highest_frequency, baseline->highest_frequency, sketch->n_peaks);
+    }
+    spectral_baseline_update(baseline, sketch, highest_frequency, changed, SPECTRAL_CHANGE_DECAY);
+    return !changed;
+}
+
+/**
+ * @brief Compresses a raw window and publishes it to the /raw topic in chunks.
+ *
+ * The window is encoded with the delta-of-delta bit-packing codec (codec.c) and prefixed with the sampling frequency.
+ * The frame is then split into chunks of at most RAW_UPLOAD_CHUNK_SIZE bytes, each one carrying a small binary header
+ * so the edge server can reassemble it:
+ *   node_id (10 bytes) | window_id (uint32) | chunk_index (uint16) | chunk_count (uint16) | data
+ *
+ * @param samples The samples of the window.
+ * @param num_samples The number of samples.
+ * @param sampling_frequency The sampling frequency of the window in Hz.
+ * @return The amount of bytes sent, or 0 if the window could not be published.
+ */
+size_t publish_raw_window(const float *samples, int num_samples, float sampling_frequency) {
+    static uint32_t window_id = 0;
+    const int header_size = 10 + 4 + 2 + 2;
+
+    // Encode the window after the sampling frequency
+    size_t frame_capacity = sizeof(float) + raw_codec_max_encoded_size(num_samples);
+    uint8_t *frame = (uint8_t *)malloc(frame_capacity);
+    uint8_t *chunk = (uint8_t *)malloc(header_size + RAW_UPLOAD_CHUNK_SIZE);
+    if (frame == NULL || chunk == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for the raw window upload");
+        free(frame);
+        free(chunk);
+        return 0;
+    }
+    memcpy(frame, &sampling_frequency, sizeof(float));
+    size_t frame_len = sizeof(float) + raw_codec_encode(samples, num_samples, RAW_UPLOAD_QUANTIZATION_STEP, frame + sizeof(float));
+
+    // Send the frame in chunks
+    uint16_t chunk_count = (frame_len + RAW_UPLOAD_CHUNK_SIZE - 1) / RAW_UPLOAD_CHUNK_SIZE;
+    memcpy(chunk, NODE_ID, 10);
+    memcpy(chunk + 10, &window_id, sizeof(window_id));
+    memcpy(chunk + 16, &chunk_count, sizeof(chunk_count));
+    size_t bytes_sent = 0;
+    for (uint16_t i = 0; i < chunk_count; i++) {
+        size_t offset = (size_t)i * RAW_UPLOAD_CHUNK_SIZE;
+        size_t len = frame_len - offset < RAW_UPLOAD_CHUNK_SIZE ? frame_len - offset : RAW_UPLOAD_CHUNK_SIZE;
+        memcpy(chunk + 14, &i, sizeof(i));
+        memcpy(chunk + header_size, frame + offset, len);
+        if (mqtt_publish_binary("/raw", chunk, header_size + len, 1) < 0) {
+            break;
+        }
+        bytes_sent += header_size + len;
+    }
+
+    ESP_LOGI(TAG, "Raw window %" PRIu32 ": %d samples compressed to %zu bytes (%.2fx) in %d chunks", window_id, num_samples,
+             frame_len, (float)(num_samples * sizeof(float)) / frame_len, chunk_count);
+    window_id++;
+
+    free(frame);
+    free(chunk);
+    return bytes_sent;
+}
+
 /**
  * Computes the aggregate function over a window.
  *
@@ -318,6 +672,12 @@ float compute_aggregate(float sampling_frequency, float time_window, signal_func
     float average = sum / count;
     ESP_LOGI(TAG, "Average value over the window: %f", average);
 
+    // Occasionally upload the full window for offline analysis
+    static int window_count = 0;
+    if (raw_upload_active && window_count++ % RAW_UPLOAD_EVERY_N_WINDOWS == 0) {
+        publish_raw_window(signal_, num_samples, sampling_frequency);
+    }
+
     // Free the dynamically allocated memory for the signal array
     free(signal_);
 
@@ -325,6 +685,60 @@ float compute_aggregate(float sampling_frequency, float time_window, signal_func
     return average;
 }
 
+/**
+ * @brief Computes the aggregate function (average) over a window of an acquisition, one frame at a time.
+ *
+ * The frames are processed in place as they arrive by the multi-resolution aggregator, which updates the rollup
+ * windows in the same pass, so no memory is allocated for the window, except when the window is due for the raw
+ * upload. The window is the registered aggregation window of the aggregator: it ends after time_window seconds of
+ * stream time, on a boundary of its base buckets.
+ *
+ * @param acquisition The started acquisition, at the sampling frequency to be used.
+ * @param time_window The number of seconds to sample.
+ * @return The average value over the window.
+ */
+float compute_aggregate_acquisition(acquisition_t *acquisition, float time_window) {
+    float sampling_frequency = acquisition->sampling_frequency;
+    int num_samples = (int)ceilf(sampling_frequency * time_window) + 1;
+    ESP_LOGI(TAG, "Aggregating %f seconds at %f Hz from the %s acquisition", time_window, sampling_frequency,
+             acquisition_backend_name(acquisition->backend));
+
+    // Keep a copy of the window only if it is uploaded
+    static int window_count = 0;
+    float *window = NULL;
+    if (raw_upload_active && window_count++ % RAW_UPLOAD_EVERY_N_WINDOWS == 0 && !publish_congested) {
+        window = (float *)malloc(num_samples * sizeof(float));
+    }
+
+    // Feed the aggregator frame by frame, never reading past the end of a base bucket so the window ends on time
+    multires_set_rate(&multires, sampling_frequency);
+    multires_stats_t stats = {0};
+    int count = 0;
+    while (!multires_window_ready(&multires, MULTIRES_AGGREGATE_WINDOW, &stats)) {
+        const float *frame;
+        int frame_len = acquisition_read_frame(acquisition, &frame, multires_samples_to_boundary(&multires));
+        if (frame_len == 0) {
+            ESP_LOGE(TAG, "Acquisition stopped after %i samples of the window", count);
+            break;
+        }
+        multires_update(&multires, frame, frame_len);
+        if (window != NULL && count < num_samples) {
+            memcpy(window + count, frame, (frame_len < num_samples - count ? frame_len : num_samples - count) * sizeof(float));
+        }
+        count += frame_len;
+    }
+    last_sample_end_us = esp_timer_get_time();
+
+    float average = multires_mean(&stats);
+    ESP_LOGI(TAG, "Average value over the window: %f (%" PRIu32 " samples, min %f, max %f)", average, stats.count, stats.min, stats.max);
+
+    if (window != NULL) {
+        publish_raw_window(window, count < num_samples ? count : num_samples, sampling_frequency);
+        free(window);
+    }
+    return average;
+}
+
 /**
  * Publishes a  value to the MQTT broker.
  *
@@ -364,7 +778,7 @@ size_t publish_data(float value, char* topic, int qos) {
     // Record the start time before publishing for latency measurement
     publish_start_time = esp_timer_get_time();
 
-    mqtt_publish(topic, json, qos, 0);
+    publish_msg_id = mqtt_publish(topic, json, qos, 0);
 
     // Return the amount of bytes sent in the message
     return strlen(json);
@@ -412,6 +826,49 @@ size_t publish_energy_experiment(float energy_opt, float energy_orig, char* deta
 }
 
 
+/**
+ * Publishes clock synchronization requests to the /timesync topic.
+ *
+ * The edge server answers each one on the timesync control topic, where the responses are handled by the MQTT event
+ * handler. Several requests are sent so that at least one is likely not delayed by queuing.
+ *
+ * @param count The number of requests.
+ */
+void request_time_sync(int count) {
+    for (int i = 0; i < count; i++) {
+        char json[96];
+        portENTER_CRITICAL(&timesync_mux);
+        uint32_t seq = timesync.seq++;
+        portEXIT_CRITICAL(&timesync_mux);
+        timesync_build_request(seq, NODE_ID, esp_timer_get_time(), json, sizeof(json));
+        mqtt_publish("/timesync", json, 0, 0);
+    }
+}
+
+/**
+ * Converts a time of the node clock to the edge server clock.
+ *
+ * @param local_us The time on the node clock (esp_timer) in microseconds.
+ * @return The time on the edge server clock in microseconds since the epoch, or -1 if the clocks are not synchronized.
+ */
+int64_t edge_time_us(int64_t local_us) {
+    portENTER_CRITICAL(&timesync_mux);
+    int64_t edge_us = timesync.valid ? timesync_to_edge_us(&timesync, local_us) : -1;
+    portEXIT_CRITICAL(&timesync_mux);
+    return edge_us;
+}
+
+/**
+ * Backpressure callback of the MQTT outbox, only recording the state for the sampling loop.
+ *
+ * @param congested Whether the outbox is congested.
+ * @param outbox_bytes The occupancy of the outbox in bytes.
+ * @param ctx Unused.
+ */
+static void publish_backpressure(bool congested, int outbox_bytes, void *ctx) {
+    publish_congested = congested;
+}
+
 /*
  * @brief Event handler registered to receive MQTT events
  *
@@ -430,18 +887,95 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        mqtt_connected = true;
+        mqtt_set_connected(true);
+        // The broker is reachable: trust the cached Wi-Fi configuration and renew its lease
+        wifi_cache_confirm();
+        // Subscribe to the control topics where experiment matrices and configuration changes are received
+        esp_mqtt_client_subscribe(client, EXPERIMENT_CONTROL_TOPIC, 1);
+        esp_mqtt_client_subscribe(client, CONFIG_CONTROL_TOPIC, 1);
+        esp_mqtt_client_subscribe(client, TIMESYNC_CONTROL_TOPIC, 0);
+        esp_mqtt_client_subscribe(client, SPECTRAL_RATE_CONTROL_TOPIC, 1);
+        esp_mqtt_client_subscribe(client, MULTIRES_CONTROL_TOPIC, 1);
+        request_time_sync(1);
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
-        mqtt_connected = false;
+        mqtt_set_connected(false);
         break;
     case MQTT_EVENT_PUBLISHED:
-        // Calculate the latency of the publish event (QoS 1, only gets called on PUBACK)
-        int64_t latency = esp_timer_get_time() - publish_start_time;
-        ESP_LOGI(TAG, "MQTT: Roundtrip Latency: %lld microseconds", latency);
-        measuring_latency = false;
-        
+        // Calculate the latency of the measured publish (QoS 1, only gets called on PUBACK)
+        if (measuring_latency && event->msg_id == latency_msg_id) {
+            int64_t latency = esp_timer_get_time() - publish_start_time;
+            ESP_LOGI(TAG, "MQTT: Roundtrip Latency: %lld microseconds", (long long)latency);
+            last_publish_latency = latency;
+            measuring_latency = false;
+        }
+
+        // The QoS 1/2 message left the outbox (QoS 0 messages are covered by the outbox monitor timer)
+        mqtt_outbox_check();
+        break;
+    case MQTT_EVENT_DELETED:
+        // A QoS 1/2 message expired in the outbox without being acknowledged
+        ESP_LOGW(TAG, "MQTT: Message %d deleted from the outbox", event->msg_id);
+        mqtt_outbox_check();
+        break;
+    case MQTT_EVENT_DATA:
+        // Only complete messages are handled, the receive buffer is sized for the largest control message
+        if (event->data_len != event->total_data_len) {
+            ESP_LOGE(TAG, "Control message too large (%d bytes), ignoring it", event->total_data_len);
+            break;
+        }
+        if (event->topic_len == strlen(TIMESYNC_CONTROL_TOPIC) && strncmp(event->topic, TIMESYNC_CONTROL_TOPIC, event->topic_len) == 0) {
+            // Update a copy, the sampling loop reads the offset while publishing
+            int64_t received_us = esp_timer_get_time();
+            timesync_t sync;
+            portENTER_CRITICAL(&timesync_mux);
+            sync = timesync;
+            portEXIT_CRITICAL(&timesync_mux);
+            if (timesync_handle_response(&sync, event->data, event->data_len, received_us)) {
+                portENTER_CRITICAL(&timesync_mux);
+                sync.seq = timesync.seq;
+                timesync = sync;
+                portEXIT_CRITICAL(&timesync_mux);
+            }
+        } else if (event->topic_len == strlen(SPECTRAL_RATE_CONTROL_TOPIC) && strncmp(event->topic, SPECTRAL_RATE_CONTROL_TOPIC, event->topic_len) == 0) {
+            float sampling_rate;
+            if (spectral_rate_parse(event->data, event->data_len, &sampling_rate)) {
+                xQueueOverwrite(spectral_rate_queue, &sampling_rate);
+            }
+        } else if (event->topic_len == strlen(MULTIRES_CONTROL_TOPIC) && strncmp(event->topic, MULTIRES_CONTROL_TOPIC, event->topic_len) == 0) {
+            multires_request_t request;
+            if (multires_parse_request(event->data, event->data_len, &request)) {
+                portENTER_CRITICAL(&rollup_mux);
+                pending_rollup_request = request;
+                rollup_request_pending = true;
+                portEXIT_CRITICAL(&rollup_mux);
+            } else {
+                ESP_LOGE(TAG, "Invalid rollup request");
+            }
+        } else if (event->topic_len == strlen(EXPERIMENT_CONTROL_TOPIC) && strncmp(event->topic, EXPERIMENT_CONTROL_TOPIC, event->topic_len) == 0) {
+            experiment_matrix_t matrix;
+            if (experiment_matrix_parse(event->data, event->data_len, &matrix, N_SAMPLES) > 0) {
+                ESP_LOGW(TAG, "Received experiment matrix with %d runs", matrix.count);
+                experiment_matrix_store(&matrix);
+                xQueueOverwrite(experiment_queue, &matrix);
+            }
+        } else if (event->topic_len == strlen(CONFIG_CONTROL_TOPIC) && strncmp(event->topic, CONFIG_CONTROL_TOPIC, event->topic_len) == 0) {
+            // Apply the update on top of the latest configuration, including one still waiting to be swapped in
+            runtime_config_t config;
+            portENTER_CRITICAL(&config_mux);
+            config = config_pending ? pending_config : runtime_config;
+            portEXIT_CRITICAL(&config_mux);
+
+            if (runtime_config_update_from_json(&config, event->data, event->data_len, N_SAMPLES) > 0) {
+                runtime_config_store(&config);
+                portENTER_CRITICAL(&config_mux);
+                pending_config = config;
+                config_pending = true;
+                portEXIT_CRITICAL(&config_mux);
+                ESP_LOGW(TAG, "Configuration update received, applying it after the current window");
+            }
+        }
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -478,14 +1012,25 @@ void mqtt_app_start(void)
             },
         },
         .network.timeout_ms = 10000,
+        .buffer.size = 4096,
+        .outbox.limit = mqtt_outbox_limit(),
     };
 
+    // Event group used to wait for the connection in app_main
+    mqtt_event_group = xEventGroupCreate();
+
+    // Coarsen the reporting of the sampling loop while the outbox is congested
+    mqtt_set_backpressure_callback(publish_backpressure, NULL);
+
     // Initialize the MQTT client with the configuration
     client = esp_mqtt_client_init(&mqtt_cfg);
     
     // Register the event handler for the MQTT client
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
 
+    // Re-evaluate the outbox congestion periodically, QoS 0 messages leave it without any event
+    mqtt_outbox_monitor_start();
+
     // Start the MQTT client
     esp_mqtt_client_start(client);
 }
@@ -516,7 +1061,7 @@ void initialize_ina219_library(void)
 /**
  * @brief Task for measuring power values using the INA219 sensor.
  *
- * This task continuously measures power values using the INA219 sensor and stores them in the `pm.power_values` array.
+ * This task continuously measures power values using the INA219 sensor and adds them to the running sum `pm.power_sum`.
  * It runs until the maximum number of samples is reached or the measurement is stopped.
  *
  * @param pvParameters Pointer to task parameters (not used in this task).
@@ -532,9 +1077,13 @@ void power_measurement_task(void *pvParameters) {
             // Get the power reading from the INA219 sensor
             esp_err_t ret = ina219_get_power(&dev, &power);
             if (ret == ESP_OK) {
-                // Store the power value in the power_values array and increment the sample count
-                pm.power_values[pm.current_sample_count] = power;
-                pm.current_sample_count++;
+                // Add the power value to the running sum, unless the measurement ended meanwhile
+                portENTER_CRITICAL(&pm_mux);
+                if (pm.measuring && pm.current_sample_count < pm.max_samples) {
+                    pm.power_sum += power;
+                    pm.current_sample_count++;
+                }
+                portEXIT_CRITICAL(&pm_mux);
             } else {
                 ESP_LOGE(TAG, "Failed to get power reading: %s", esp_err_to_name(ret));
             }
@@ -545,43 +1094,83 @@ void power_measurement_task(void *pvParameters) {
     }
 }
 
+/**
+ * @brief Task publishing a snapshot of the resources of the node to the /stats topic every RESOURCE_STATS_PERIOD_S seconds.
+ *
+ * The snapshot and the message are static so the stack of the task stays small, and the loads are measured over the
+ * period between two snapshots.
+ *
+ * @param pvParameters Pointer to task parameters (not used in this task).
+ */
+void resource_stats_task(void *pvParameters) {
+    static resource_stats_state_t state;
+    static resource_stats_t stats;
+    static char json[1024];
+
+    resource_stats_init(&state);
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(RESOURCE_STATS_PERIOD_S * 1000));
+
+        esp_err_t err = resource_stats_collect(&state, &stats);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to list the tasks: %s", esp_err_to_name(err));
+        }
+        int len = resource_stats_to_json(&stats, NODE_ID, json, sizeof(json));
+        if (len >= (int)sizeof(json)) {
+            ESP_LOGE(TAG, "Resource statistics truncated (%d bytes)", len);
+            continue;
+        }
+        mqtt_publish("/stats", json, 0, 0);
+        ESP_LOGI(TAG, "CPU load %.1f %%, free heap %" PRIu32 " bytes (largest block %" PRIu32 ")", stats.cpu, stats.heap_free,
+                 stats.heap_largest);
+    }
+}
+
 /**
  * @brief Starts the power measurement for a specified duration.
  *
  * This function starts the power measurement for a specified duration in seconds.
- * It allocates memory for storing power values and initializes/resets the necessary variables.
+ * It resets the running sum and the sample count, the samples after max_duration_seconds being ignored.
  * The power measurement is performed using a timer, and the start time is recorded.
  *
- * @param max_duration_seconds The maximum duration of the power measurement in seconds.
+ * @param max_duration_seconds The maximum duration of the power measurement in seconds, at most
+ *        POWER_MEASUREMENT_MAX_SECONDS.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the duration is out of range (the measurement is not started).
  */
-void start_power_measurement(int max_duration_seconds) {
-    // Allocate memory for storing power values based on the maximum duration
-    pm.max_samples = (max_duration_seconds * 1000) / 10;
-    pm.power_values = (float *)malloc(pm.max_samples * sizeof(float));
-    if (pm.power_values == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for power measurements");
+esp_err_t start_power_measurement(int max_duration_seconds) {
+    if (max_duration_seconds <= 0 || max_duration_seconds > POWER_MEASUREMENT_MAX_SECONDS) {
+        ESP_LOGE(TAG, "Power measurement of %d s out of range (1 to %d s)", max_duration_seconds, POWER_MEASUREMENT_MAX_SECONDS);
+        return ESP_ERR_INVALID_ARG;
     }
 
-    // Reset the current sample count and set the measuring flag to true
+    // Reset the running sum and the sample count and set the measuring flag to true
+    portENTER_CRITICAL(&pm_mux);
+    pm.max_samples = (max_duration_seconds * 1000) / 10;
+    pm.power_sum = 0;
     pm.current_sample_count = 0;
     pm.measuring = true;
+    portEXIT_CRITICAL(&pm_mux);
 
     // Start the timer for power measurement
-    pm.start_time = esp_timer_get_time();    
+    pm.start_time = esp_timer_get_time();
+    return ESP_OK;
 }
 
 /**
  * @brief Stops the power measurement and calculates the average power and total energy.
  *
  * This function stops the power measurement, calculates the elapsed time, average power, and total energy
- * based on the collected power values. It logs the measurement results and frees the memory allocated for
- * the power values array.
+ * based on the running sum of the power values. It logs the measurement results. Without any sample, both are 0.
  *
  * @return A structure containing the average power in milliwatts and total energy in watt-hours.
  */
 power_measurement_result_t end_power_measurement() {
     // Stop the power measurement after the function completes
+    portENTER_CRITICAL(&pm_mux);
     pm.measuring = false;
+    double power_sum = pm.power_sum;
+    int sample_count = pm.current_sample_count;
+    portEXIT_CRITICAL(&pm_mux);
 
     // End the timer for power measurement
     pm.end_time = esp_timer_get_time();
@@ -589,170 +1178,1316 @@ power_measurement_result_t end_power_measurement() {
     // Calculate the elapsed time in seconds
     float elapsed_time_s = (pm.end_time - pm.start_time) / 1000000.0;
 
-    ESP_LOGI(TAG, "Power measurement complete. Samples: %d, Elapsed Time: %f s", pm.current_sample_count, elapsed_time_s);
+    ESP_LOGI(TAG, "Power measurement complete. Samples: %d, Elapsed Time: %f s", sample_count, elapsed_time_s);
 
     // Calculate average power and total energy
-    float total_power = 0;
-    for (int i = 0; i < pm.current_sample_count; i++) {
-        total_power += pm.power_values[i];
-    }
-    float average_power = total_power / pm.current_sample_count;
-    float total_energy_joules = (total_power / pm.current_sample_count) * elapsed_time_s;  // Energy in joules (power in mW * time in seconds)
+    float average_power = sample_count > 0 ? (float)(power_sum / sample_count) : 0;
+    float total_energy_joules = average_power * elapsed_time_s;  // Energy in joules (power in mW * time in seconds)
     float total_energy_wh = total_energy_joules / 3600.0;    // Energy in watt-hours (Wh)
 
     ESP_LOGI(TAG, "Average Power: %f mW", average_power);
     ESP_LOGI(TAG, "Total Energy: %f Wh", total_energy_wh);
 
-    // Free the memory allocated for power values
-    free(pm.power_values);
-
     // Return the average power and total energy in the result structure
     return (power_measurement_result_t){.average_power = average_power, .total_energy_wh = total_energy_wh};
 }
 
 /**
- * @brief Runs the bonus experiment to measure energy savings
- *
- * This function performs the following steps:
- * 1. Calculates the power spectrum of the input signal using FFT processing.
- * 2. Finds the peak frequency on the power spectrum above 0 dB.
- * 3. Computes the optimal sampling frequency based on the highest frequency peak.
- * 4. Runs the energy savings measurement experiment:
- *    a. Computes the average value of the signal using the optimal sampling frequency in a window of 5 seconds.
- *    b. Publishes the average value to the MQTT broker.
- *    c. Measures the average power and total energy consumption for the optimal sampling frequency.
- *    d. Computes the average value of the signal using the original sampling frequency in a window of 5 seconds.
- *    e. Publishes the average value to the MQTT broker.
- *    f. Measures the average power and total energy consumption for the original sampling frequency.
- *    g. Publishes the energy consumption data to the /energy topic.
- * Noting that the computation of the average and publish is done 5 times for each sampling frequency.
+ * @brief Benchmarks the raw window codec on the three input signals.
  *
- * @param signal_func The input signal function.
- * @param original_sampling_rate The original sampling rate of the input signal.
- * @param time_window The time window for computing the average value.
+ * For each signal, N samples are generated at the original sampling frequency with the synthetic source (synth.c),
+ * then encoded and decoded. The compression ratio against float32, the encode cycles per sample and the maximum
+ * reconstruction error are logged.
  */
-void bonus_run_experiment(signal_function_t signal_func, int original_sampling_rate, int time_window) {
-    // Store the signal data in memory (with a Hann window applied)
-    store_signal(signal_func, original_sampling_rate);
+void benchmark_raw_compression(void) {
+    float sampling_frequencies[] = {SIGNAL_ORIGINAL_SAMPLING_FREQUENCY, 500, 500};
+
+    float *decoded = (float *)malloc(N * sizeof(float));
+    uint8_t *encoded = (uint8_t *)malloc(raw_codec_max_encoded_size(N));
+    if (decoded == NULL || encoded == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for the compression benchmark");
+        free(decoded);
+        free(encoded);
+        return;
+    }
 
-    // FFT processing to find the power spectrum, as seen in the official ESP-DSP example:
-    dsps_fft2r_fc32(y_cf, N);
-    // Bit reverse
-    dsps_bit_rev_fc32(y_cf, N);
-    // Convert one complex vector to two complex vectors
-    dsps_cplx2reC_fc32(y_cf, N);
+    for (int s = 0; s < 3; s++) {
+        synth_source_t source;
+        synth_source_init(&source, &synth_signals[s], sampling_frequencies[s]);
+        synth_source_generate(&source, signal_, N);
 
-    // Calculate power spectrum
-    for (int i = 0; i < N; i++) {
-        power_spectrum[i] = 10 * log10f((y_cf[i * 2] * y_cf[i * 2] + y_cf[i * 2 + 1] * y_cf[i * 2 + 1]) / N);
-    }
+        unsigned int start_b = dsp_get_cpu_cycle_count();
+        size_t encoded_len = raw_codec_encode(signal_, N, RAW_UPLOAD_QUANTIZATION_STEP, encoded);
+        unsigned int end_b = dsp_get_cpu_cycle_count();
+        raw_codec_decode(encoded, encoded_len, decoded, N);
 
-    // Find the peak with the highest frequency on the power spectrum above 0 dB
-    float highest_frequency_peak = find_highest_frequency_peak_above_db_level(0.0, original_sampling_rate, N_SAMPLES);
-    float optimal_sampling_frequency = highest_frequency_peak * 2;
-    ESP_LOGW(TAG, "Maximum Frequency of the Signal is %f Hz. Optimal Sampling Frequency: %f Hz", highest_frequency_peak, optimal_sampling_frequency);
-    
-    // Since we are using Tumbling Window, it doesn't make sense to run the volume of data experiment, neither for the Latency since
-    // the sampling is not expected to change the timing between the publish and the receive of the message by the edge server.
+        float max_error = 0;
+        for (int i = 0; i < N; i++) {
+            max_error = fmaxf(max_error, fabsf(decoded[i] - signal_[i]));
+        }
 
-    // Run the energy savings measurement experiment:
-    // 1. Run the aggregate and publish 5 times, using the optimal sampling frequency of 10Hz in a window of 5 seconds. After the entire
-    // process is finished, send over the energy consumption data to the /energy topic.
-    if (power_measurement_active) {
+        ESP_LOGW(TAG, "Compression Signal %d at %d Hz: %d bytes -> %zu bytes (%.2fx), %.1f cycles/sample, max error %f", s + 1,
+                 (int)sampling_frequencies[s], (int)(N * sizeof(float)), encoded_len, (float)(N * sizeof(float)) / encoded_len,
+                 (float)(end_b - start_b) / N, max_error);
+    }
 
-        // Start the power measurement for the optimal sampling frequency
-        start_power_measurement(time_window*3*5);
+    free(decoded);
+    free(encoded);
+}
 
-        for (int i = 0; i < 5; i++) {
-            // Compute the aggregate function (average) using the optimal sampling frequency of 10Hz in a window of 5 seconds
-            float average = compute_aggregate(optimal_sampling_frequency, time_window, signal_func);
+/**
+ * @brief Benchmarks the synthetic source against the sin() based input signal functions.
+ *
+ * For each signal, N samples are generated at 500Hz with the signal function (double precision sin() per tone) and
+ * with the phase accumulator source, logging the cycles per sample of both and the maximum difference.
+ */
+void benchmark_signal_synthesis(void) {
+    float *reference = (float *)malloc(N * sizeof(float));
+    if (reference == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for the synthesis benchmark");
+        return;
+    }
 
-            // Publish the average value to the MQTT broker
-            publish_data(average, "/average", 0);
+    for (int s = 0; s < 3; s++) {
+        unsigned int start_b = dsp_get_cpu_cycle_count();
+        for (int i = 0; i < N; i++) {
+            reference[i] = input_signals[s](i / 500.0f);
         }
+        unsigned int cycles_sin = dsp_get_cpu_cycle_count() - start_b;
 
-        // End the power measurement and get the results
-        power_measurement_result_t result_optimal = end_power_measurement();
-
-        ESP_LOGW(TAG, "Optimal Sampling Frequency: Measured Average Power: %f mW", result_optimal.average_power);
-        ESP_LOGW(TAG, "Optimal Sampling Frequency: Measured Total Energy: %f Wh", result_optimal.total_energy_wh);
+        synth_source_t source;
+        synth_source_init(&source, &synth_signals[s], 500);
+        start_b = dsp_get_cpu_cycle_count();
+        synth_source_generate(&source, signal_, N);
+        unsigned int cycles_synth = dsp_get_cpu_cycle_count() - start_b;
 
+        float max_error = 0;
+        for (int i = 0; i < N; i++) {
+            max_error = fmaxf(max_error, fabsf(reference[i] - signal_[i]));
+        }
 
-        // 2. Run the aggregate and publish 10 times, using the original sampling frequency of 100Hz in a window of 5 seconds.
+        ESP_LOGW(TAG, "Synthesis Signal %d: sin() %.1f cycles/sample, synthetic source %.1f cycles/sample, max difference %f",
+                 s + 1, (float)cycles_sin / N, (float)cycles_synth / N, max_error);
+    }
 
-        // Start the power measurement for the original sampling frequency
-        start_power_measurement(time_window*3*5);
+    free(reference);
+}
 
-        for (int i = 0; i < 5; i++) {
-            // Compute the aggregate function (average) using the original sampling frequency of 100Hz in a window of 5 seconds
-            float average = compute_aggregate(original_sampling_rate, time_window, signal_func);
+/**
+ * @brief Compares the Q15 fixed-point FFT path against the float32 path on the three input signals.
+ *
+ * For each signal, N samples are generated at the original sampling frequency with the synthetic source and the
+ * power spectrum is computed with both paths, using heap buffers so it works with either FFT_FIXED_POINT setting.
+ * The accuracy is reported as the maximum dB difference over the bins above the 0 dB threshold and as the peak
+ * found by find_highest_frequency_peak_above_db_level() on each spectrum, next to the FFT cycles of each path.
+ * If the power measurement is active, the energy of FFT_BENCHMARK_REPETITIONS transforms of each path is measured
+ * with the INA219 and published to the /energy topic.
+ */
+#define FFT_BENCHMARK_REPETITIONS 500
+void benchmark_fixed_point_fft(void) {
+    float sampling_frequencies[] = {SIGNAL_ORIGINAL_SAMPLING_FREQUENCY, 500, 500};
+
+    float *window_f32 = (float *)heap_caps_aligned_alloc(16, N * sizeof(float), MALLOC_CAP_DEFAULT);
+    float *data_f32 = (float *)heap_caps_aligned_alloc(16, N * 2 * sizeof(float), MALLOC_CAP_DEFAULT);
+    float *spectrum_f32 = (float *)malloc(N * sizeof(float));
+    int16_t *window_q15 = (int16_t *)heap_caps_aligned_alloc(16, N * sizeof(int16_t), MALLOC_CAP_DEFAULT);
+    int16_t *data_q15 = (int16_t *)heap_caps_aligned_alloc(16, N * 2 * sizeof(int16_t), MALLOC_CAP_DEFAULT);
+    if (window_f32 == NULL || data_f32 == NULL || spectrum_f32 == NULL || window_q15 == NULL || data_q15 == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for the fixed-point FFT benchmark");
+        heap_caps_free(window_f32);
+        heap_caps_free(data_f32);
+        free(spectrum_f32);
+        heap_caps_free(window_q15);
+        heap_caps_free(data_q15);
+        return;
+    }
+    dsps_wind_hann_f32(window_f32, N);
+    fft_q15_window_hann(window_q15, N);
+
+    for (int s = 0; s < 3; s++) {
+        synth_source_t source;
+        synth_source_init(&source, &synth_signals[s], sampling_frequencies[s]);
+        synth_source_generate(&source, signal_, N);
+
+        // Float32 path
+        for (int i = 0; i < N; i++) {
+            data_f32[i * 2 + 0] = signal_[i] * window_f32[i];
+            data_f32[i * 2 + 1] = 0;
+        }
+        unsigned int start_b = dsp_get_cpu_cycle_count();
+        dsps_fft2r_fc32(data_f32, N);
+        dsps_bit_rev_fc32(data_f32, N);
+        unsigned int cycles_f32 = dsp_get_cpu_cycle_count() - start_b;
+        for (int i = 0; i < N / 2; i++) {
+            spectrum_f32[i] = 10 * log10f((data_f32[i * 2] * data_f32[i * 2] + data_f32[i * 2 + 1] * data_f32[i * 2 + 1]) / N);
+        }
 
-            // Publish the average value to the MQTT broker using the original sampling frequency
-            publish_data(average, "/average", 0);
+        // Q15 path, leaving the result in power_spectrum
+        int exponent = fft_q15_load_windowed(signal_, window_q15, data_q15, N);
+        start_b = dsp_get_cpu_cycle_count();
+        fft_q15_run(data_q15, N);
+        unsigned int cycles_q15 = dsp_get_cpu_cycle_count() - start_b;
+        fft_q15_power_spectrum_db(data_q15, N, exponent, power_spectrum);
+
+        float max_error_db = 0;
+        for (int i = 0; i < N / 2; i++) {
+            if (spectrum_f32[i] > 0.0) {
+                max_error_db = fmaxf(max_error_db, fabsf(spectrum_f32[i] - power_spectrum[i]));
+            }
         }
+        float peak_q15 = find_highest_frequency_peak_above_db_level(0.0, sampling_frequencies[s], N);
+        memcpy(power_spectrum, spectrum_f32, (N / 2) * sizeof(float));
+        float peak_f32 = find_highest_frequency_peak_above_db_level(0.0, sampling_frequencies[s], N);
 
-        // End the power measurement and get the results
-        power_measurement_result_t result_original = end_power_measurement();
+        ESP_LOGW(TAG, "FFT Signal %d: float32 %u cycles, peak %f Hz | Q15 %u cycles, peak %f Hz | max error above 0 dB: %f dB",
+                 s + 1, cycles_f32, peak_f32, cycles_q15, peak_q15, max_error_db);
+    }
 
-        ESP_LOGW(TAG, "Original Sampling Frequency: Measured Average Power: %f mW", result_original.average_power);
-        ESP_LOGW(TAG, "Original Sampling Frequency: Measured Total Energy: %f Wh", result_original.total_energy_wh);
+    // Energy of each path, measured with the INA219 over FFT_BENCHMARK_REPETITIONS transforms
+    if (power_measurement_active) {
+        start_power_measurement(60);
+        for (int r = 0; r < FFT_BENCHMARK_REPETITIONS; r++) {
+            fft_q15_load_windowed(signal_, window_q15, data_q15, N);
+            fft_q15_run(data_q15, N);
+        }
+        power_measurement_result_t result_q15 = end_power_measurement();
+
+        start_power_measurement(60);
+        for (int r = 0; r < FFT_BENCHMARK_REPETITIONS; r++) {
+            for (int i = 0; i < N; i++) {
+                data_f32[i * 2 + 0] = signal_[i] * window_f32[i];
+                data_f32[i * 2 + 1] = 0;
+            }
+            dsps_fft2r_fc32(data_f32, N);
+            dsps_bit_rev_fc32(data_f32, N);
+        }
+        power_measurement_result_t result_f32 = end_power_measurement();
 
-        // 3. Publish the energy consumption data to the /energy topic
-        // Initialize a string to store the details of the experiment
         char details[256];
+        snprintf(details, sizeof(details), "EXPERIMENT: FFT energy, Q15 (optimal) vs float32 (original), %d transforms of %d points", FFT_BENCHMARK_REPETITIONS, N);
+        publish_energy_experiment(result_q15.total_energy_wh, result_f32.total_energy_wh, details);
+    }
 
-        // On the details, include the information about the original and optimal sampling frequencies
-        snprintf(details, sizeof(details), "EXPERIMENT: Original Sampling Freq: %d Hz, Optimal Sampling Freq: %d Hz, Time Window: %d", original_sampling_rate, (int)optimal_sampling_frequency, time_window);
+    heap_caps_free(window_f32);
+    heap_caps_free(data_f32);
+    free(spectrum_f32);
+    heap_caps_free(window_q15);
+    heap_caps_free(data_q15);
+}
 
-        // Publish the energy consumption data to the /energy topic
-        publish_energy_experiment(result_optimal.total_energy_wh, result_original.total_energy_wh, details);
+/**
+ * @brief Compares the time-domain frequency pre-check against the FFT on the three input signals.
+ *
+ * For each signal, N samples are generated at 500 Hz with the synthetic source. The cost is the CPU cycles of the
+ * estimator over one pre-check window (time_window seconds) against the window, FFT and peak search over N samples,
+ * and the estimates are reported next to the FFT peak. The detection accuracy is checked on every pair of signals:
+ * the baseline is taken on the first signal, then a second window of the same signal must not be flagged (stationary)
+ * and a window of the other signal must be, using the Nyquist frequency the FFT chose for the first signal.
+ */
+#define FREQ_BENCHMARK_SAMPLING_FREQUENCY 500
+void benchmark_frequency_estimator(void) {
+    int check_samples = (int)fminf(N, FREQ_BENCHMARK_SAMPLING_FREQUENCY * runtime_config.time_window);
+    float fft_peaks[3];
+    freq_estimator_t estimator;
+
+    for (int s = 0; s < 3; s++) {
+        synth_source_t source;
+        synth_source_init(&source, &synth_signals[s], FREQ_BENCHMARK_SAMPLING_FREQUENCY);
+        synth_source_generate(&source, signal_, N);
+
+        freq_estimator_reset(&estimator);
+        unsigned int start_b = dsp_get_cpu_cycle_count();
+        freq_estimator_update(&estimator, signal_, check_samples);
+        freq_estimator_window_end(&estimator, FREQ_BENCHMARK_SAMPLING_FREQUENCY, FREQ_BENCHMARK_SAMPLING_FREQUENCY / 2);
+        unsigned int cycles_estimator = dsp_get_cpu_cycle_count() - start_b;
+
+        start_b = dsp_get_cpu_cycle_count();
+        window_stored_signal(N);
+        compute_power_spectrum(N);
+        fft_peaks[s] = find_highest_frequency_peak_above_db_level(runtime_config.db_threshold, FREQ_BENCHMARK_SAMPLING_FREQUENCY, N);
+        unsigned int cycles_fft = dsp_get_cpu_cycle_count() - start_b;
+
+        ESP_LOGW(TAG, "Pre-check Signal %d: estimator %u cycles over %d samples, zero-crossing %f Hz, autocorrelation %f Hz | FFT %u cycles over %d samples, peak %f Hz",
+                 s + 1, cycles_estimator, check_samples, estimator.last.zero_crossing_frequency, estimator.last.autocorrelation_frequency,
+                 cycles_fft, N, fft_peaks[s]);
     }
-    
-}
 
-// Main function
-void app_main(void) {
+    int detections = 0, false_alarms = 0, changes = 0;
+    for (int a = 0; a < 3; a++) {
+        for (int b = 0; b < 3; b++) {
+            synth_source_t source;
+            synth_source_init(&source, &synth_signals[a], FREQ_BENCHMARK_SAMPLING_FREQUENCY);
+            freq_estimator_reset(&estimator);
+
+            // Baseline and a later stationary window of the first signal
+            synth_source_generate(&source, signal_, check_samples);
+            freq_estimator_update(&estimator, signal_, check_samples);
+            freq_estimator_window_end(&estimator, FREQ_BENCHMARK_SAMPLING_FREQUENCY, fft_peaks[a]);
+            synth_source_generate(&source, signal_, check_samples / 3);
+            synth_source_generate(&source, signal_, check_samples);
+            freq_estimator_update(&estimator, signal_, check_samples);
+            if (freq_estimator_window_end(&estimator, FREQ_BENCHMARK_SAMPLING_FREQUENCY, fft_peaks[a])) {
+                false_alarms++;
+            }
 
-    // ********** 1. SETUP **********
-    // Initialize NVS for storing wifi credentials and mqtt config
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
+            // Window of the second signal
+            synth_source_init(&source, &synth_signals[b], FREQ_BENCHMARK_SAMPLING_FREQUENCY);
+            synth_source_generate(&source, signal_, check_samples);
+            freq_estimator_update(&estimator, signal_, check_samples);
+            bool flagged = freq_estimator_window_end(&estimator, FREQ_BENCHMARK_SAMPLING_FREQUENCY, fft_peaks[a]);
+            if (a != b) {
+                changes++;
+                detections += flagged;
+            } else if (flagged) {
+                false_alarms++;
+            }
+        }
     }
-    ESP_ERROR_CHECK(ret);
-
-    // Connect to wifi
-    wifi_connection();
-    // Delay to let it connect to wifi before starting MQTT
-    vTaskDelay(10000 / portTICK_PERIOD_MS);
-    // Start MQTT
-    mqtt_app_start();
-    // Delay to let it connect to MQTT before proceeding
-    vTaskDelay(5000 / portTICK_PERIOD_MS);
+    ESP_LOGW(TAG, "Pre-check detection: %d of %d signal changes detected, %d false alarms in %d stationary windows",
+             detections, changes, false_alarms, 3 + 3 * 3);
+}
 
-    // Initialize FFT
-    ret = dsps_fft2r_init_fc32(NULL, CONFIG_DSP_MAX_FFT_SIZE);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Not possible to initialize FFT. Error = %i", ret);
+/**
+ * @brief Publishes a value to the /average topic with QoS 1 or 2 and waits for its PUBACK, for at most 5 seconds.
+ *
+ * The measurement is matched on the message id, so acknowledgements of other topics don't complete it.
+ *
+ * @param value The value to be published.
+ * @param qos The QoS of the publish, 1 or 2.
+ * @return true if the PUBACK arrived, its latency being in last_publish_latency, false otherwise.
+ */
+bool publish_data_wait_ack(float value, int qos) {
+    latency_msg_id = -1;
+    measuring_latency = true;
+    publish_data(value, "/average", qos);
+    if (publish_msg_id < 0) {
+        ESP_LOGE(TAG, "The publish was dropped, no latency measured");
+        measuring_latency = false;
+        return false;
     }
+    latency_msg_id = publish_msg_id;
 
-    // Initialize INA219 library (Following the INA219 esp-idf-lib example: https://github.com/UncleRus/esp-idf-lib/blob/master/examples/ina219/default/main/main.c)
-    if (power_measurement_active) {
-        initialize_ina219_library();
+    for (int waited_ms = 0; measuring_latency && waited_ms < 5000; waited_ms += 10) {
+        vTaskDelay(10 / portTICK_PERIOD_MS);
     }
-    
-    // ********** 2. INPUT SIGNAL **********
+    if (measuring_latency) {
+        ESP_LOGE(TAG, "No acknowledgement received for message %d", latency_msg_id);
+        measuring_latency = false;
+        return false;
+    }
+    return true;
+}
 
-    // Store the signal data in memory (with a Hann window applied)
-    store_signal(input_signal_1, SIGNAL_ORIGINAL_SAMPLING_FREQUENCY);
-    ESP_LOGI(TAG, "Signal storage complete. Proceeding to sampling...");
+/**
+ * @brief Publishes a value to the /average topic, waiting for the PUBACK to measure the latency for QoS 1 and 2.
+ *
+ * @param value The value to be published.
+ * @param qos The QoS of the publish.
+ * @param result The experiment result where the latency statistics are accumulated.
+ */
+void publish_data_with_latency(float value, int qos, experiment_result_t *result) {
+    if (qos == 0) {
+        publish_data(value, "/average", 0);
+        return;
+    }
+    if (!publish_data_wait_ack(value, qos)) {
+        return;
+    }
 
+    result->latency_avg_us = (result->latency_avg_us * result->latency_count + last_publish_latency) / (result->latency_count + 1);
+    result->latency_count++;
+    if (last_publish_latency > result->latency_max_us) {
+        result->latency_max_us = last_publish_latency;
+    }
+}
 
-    // ********** 3. MAXIMUM SAMPLING FREQUENCY **********
+// Sampling state of the zoom-FFT input callback
+typedef struct {
+    acquisition_t *acquisition;
+    const float *frame;
+    int frame_len;
+    int position;
+    int index;
+} zoom_sampling_t;
 
-    // Measure the maximum sampling frequency of the stored signal data, simulating a sampling process that reads the data from memory
-    // and counts the number of samples iterated and the elapsed time. Since the signal data is already stored in memory, this function
+/**
+ * @brief Zoom-FFT input callback: returns the next sample of the acquisition, reading a new frame when needed.
+ *
+ * @param ctx The zoom_sampling_t state.
+ * @return The next sample.
+ */
+static float zoom_next_sample(void *ctx) {
+    zoom_sampling_t *sampling = ctx;
+    if (sampling->position >= sampling->frame_len) {
+        sampling->frame_len = acquisition_read_frame(sampling->acquisition, &sampling->frame, ACQUISITION_FRAME_SAMPLES);
+        sampling->position = 0;
+        if (sampling->frame_len == 0) {
+            return 0;
+        }
+    }
+    sampling->index++;
+    if (sampling->index % 2000 == 0) {
+        ESP_LOGI(TAG, "Zoom-FFT sample %i of %i", sampling->index, ZOOM_FFT_DECIMATION * ZOOM_FFT_SIZE);
+    }
+    return sampling->frame[sampling->position++];
+}
+
+/**
+ * @brief Refines a peak found by the coarse FFT with a zoom-FFT around it.
+ *
+ * Only ZOOM_FFT_SIZE complex values are stored (in signal_, the power spectrum goes to power_spectrum), so the finer
+ * resolution costs a longer acquisition, not more memory. The signal is sampled again for
+ * ZOOM_FFT_DECIMATION * ZOOM_FFT_SIZE samples.
+ *
+ * @param acquisition The acquisition the coarse FFT was computed from, still running at its sampling frequency.
+ * @param coarse_peak The peak found by the coarse FFT in Hz.
+ * @return The refined peak in Hz, or the coarse peak if the zoom-FFT found none.
+ */
+float zoom_frequency_peak(acquisition_t *acquisition, float coarse_peak) {
+    float sampling_frequency = acquisition->sampling_frequency;
+    zoom_sampling_t sampling = {
+        .acquisition = acquisition,
+    };
+    zoom_fft_config_t config = {
+        .sampling_frequency = sampling_frequency,
+        .center_frequency = coarse_peak,
+        .decimation = ZOOM_FFT_DECIMATION,
+        .fft_size = ZOOM_FFT_SIZE,
+        .reference_fft_size = N,
+        .db_level = runtime_config.db_threshold,
+    };
+    float zoomed_peak = zoom_fft_run(&config, zoom_next_sample, &sampling, signal_, power_spectrum);
+    if (zoomed_peak <= 0) {
+        return coarse_peak;
+    }
+    ESP_LOGW(TAG, "Zoom-FFT refined the peak from %f Hz to %f Hz (coarse resolution %f Hz, zoomed %f Hz)", coarse_peak, zoomed_peak,
+             sampling_frequency / N, sampling_frequency / (ZOOM_FFT_DECIMATION * ZOOM_FFT_SIZE));
+    return zoomed_peak;
+}
+
+/**
+ * @brief Runs the bonus experiment to measure energy savings
+ *
+ * This function performs the following steps:
+ * 1. Calculates the power spectrum of the input signal using FFT processing.
+ * 2. Finds the peak frequency on the power spectrum above 0 dB.
+ * 3. Computes the optimal sampling frequency based on the highest frequency peak.
+ * 4. Runs the energy savings measurement experiment:
+ *    a. Computes the average value of the signal using the optimal sampling frequency in a window of time_window seconds.
+ *    b. Publishes the average value to the MQTT broker.
+ *    c. Measures the average power and total energy consumption for the optimal sampling frequency.
+ *    d. Computes the average value of the signal using the original sampling frequency in a window of time_window seconds.
+ *    e. Publishes the average value to the MQTT broker.
+ *    f. Measures the average power and total energy consumption for the original sampling frequency.
+ * Noting that the computation of the average and publish is done `repetitions` times for each sampling frequency, and
+ * that the publish latency is measured when the QoS is 1 or 2.
+ *
+ * @param config The run configuration (signal, base rate, time window, repetitions, QoS and FFT size).
+ * @return The result of the run.
+ */
+experiment_result_t bonus_run_experiment(const experiment_config_t *config) {
+    experiment_result_t result = {0};
+    signal_function_t signal_func = input_signals[config->signal - 1];
+    int original_sampling_rate = config->base_rate;
+    int time_window = config->time_window;
+
+    // Use the FFT size of the run
+    int previous_n = N;
+    N = config->fft_size;
+
+    // Store the signal data in memory (with a Hann window applied)
+    store_signal(signal_func, original_sampling_rate);
+
+    // FFT processing to find the power spectrum
+    compute_power_spectrum(N);
+
+    // Find the peak with the highest frequency on the power spectrum above 0 dB
+    float highest_frequency_peak = find_highest_frequency_peak_above_db_level(runtime_config.db_threshold, original_sampling_rate, N);
+
+    // Notify the edge server if the spectrum differs from the one of the previous run
+    if (spectral_change_active) {
+        static spectral_baseline_t experiment_baseline;
+        spectral_sketch_t sketch;
+        spectral_sketch_build(power_spectrum, N, original_sampling_rate, runtime_config.db_threshold, &sketch);
+        check_spectral_change(&experiment_baseline, &sketch, highest_frequency_peak);
+    }
+    if (zoom_fft_active && highest_frequency_peak > 0) {
+        static acquisition_t zoom_acquisition;
+        acquisition_init_function(&zoom_acquisition, signal_func);
+        acquisition_start(&zoom_acquisition, original_sampling_rate);
+        highest_frequency_peak = zoom_frequency_peak(&zoom_acquisition, highest_frequency_peak);
+    }
+    float optimal_sampling_frequency = highest_frequency_peak * 2;
+    ESP_LOGW(TAG, "Maximum Frequency of the Signal is %f Hz. Optimal Sampling Frequency: %f Hz", highest_frequency_peak, optimal_sampling_frequency);
+    result.highest_frequency = highest_frequency_peak;
+    result.optimal_sampling_rate = optimal_sampling_frequency;
+
+    // Restore the configured FFT size
+    N = previous_n;
+
+    // No peak found, there is nothing to compare against
+    if (highest_frequency_peak <= 0) {
+        return result;
+    }
+
+    // Since we are using Tumbling Window, it doesn't make sense to run the volume of data experiment.
+
+    // Run the energy savings measurement experiment:
+    // 1. Run the aggregate and publish `repetitions` times using the optimal sampling frequency.
+    bool measuring = power_measurement_active && start_power_measurement(time_window * 3 * config->repetitions) == ESP_OK;
+
+    for (int i = 0; i < config->repetitions; i++) {
+        // Compute the aggregate function (average) using the optimal sampling frequency
+        float average = compute_aggregate(optimal_sampling_frequency, time_window, signal_func);
+
+        // Publish the average value to the MQTT broker
+        publish_data_with_latency(average, config->qos, &result);
+    }
+
+    if (measuring) {
+        // End the power measurement and get the results
+        power_measurement_result_t result_optimal = end_power_measurement();
+        result.energy_optimal_wh = result_optimal.total_energy_wh;
+
+        ESP_LOGW(TAG, "Optimal Sampling Frequency: Measured Average Power: %f mW", result_optimal.average_power);
+        ESP_LOGW(TAG, "Optimal Sampling Frequency: Measured Total Energy: %f Wh", result_optimal.total_energy_wh);
+    }
+
+    // 2. Run the aggregate and publish `repetitions` times using the original sampling frequency.
+    measuring = power_measurement_active && start_power_measurement(time_window * 3 * config->repetitions) == ESP_OK;
+
+    for (int i = 0; i < config->repetitions; i++) {
+        // Compute the aggregate function (average) using the original sampling frequency
+        float average = compute_aggregate(original_sampling_rate, time_window, signal_func);
+
+        // Publish the average value to the MQTT broker using the original sampling frequency
+        publish_data_with_latency(average, config->qos, &result);
+    }
+
+    if (measuring) {
+        // End the power measurement and get the results
+        power_measurement_result_t result_original = end_power_measurement();
+        result.energy_original_wh = result_original.total_energy_wh;
+
+        ESP_LOGW(TAG, "Original Sampling Frequency: Measured Average Power: %f mW", result_original.average_power);
+        ESP_LOGW(TAG, "Original Sampling Frequency: Measured Total Energy: %f Wh", result_original.total_energy_wh);
+    }
+
+    return result;
+}
+
+/**
+ * Publishes the result of one experiment run to the /experiment topic.
+ *
+ * The record contains the run configuration next to the measured frequency, energy and latency, so that the edge
+ * server can compare operating points across runs and nodes.
+ *
+ * @param run_index The index of the run in the matrix.
+ * @param config The run configuration.
+ * @param result The run result.
+ * @return The amount of bytes sent in the message.
+ */
+size_t publish_experiment_result(int run_index, const experiment_config_t *config, const experiment_result_t *result) {
+    char json[512];
+    snprintf(json, sizeof(json),
+             "{\"node_id\":\"%s\",\"run\":%d,\"signal\":%d,\"base_rate\":%d,\"time_window\":%d,\"repetitions\":%d,\"qos\":%d,"
+             "\"fft_size\":%d,\"highest_frequency\":%.3f,\"optimal_rate\":%.3f,\"energy_optimal\":%.7f,\"energy_original\":%.7f,"
+             "\"latency_count\":%d,\"latency_avg_us\":%lld,\"latency_max_us\":%lld}",
+             NODE_ID, run_index, config->signal, config->base_rate, config->time_window, config->repetitions, config->qos,
+             config->fft_size, result->highest_frequency, result->optimal_sampling_rate, result->energy_optimal_wh,
+             result->energy_original_wh, result->latency_count, (long long)result->latency_avg_us,
+             (long long)result->latency_max_us);
+
+    mqtt_publish("/experiment", json, 1, 0);
+
+    return strlen(json);
+}
+
+/**
+ * @brief Executes every run of an experiment matrix back-to-back, publishing one record per run.
+ *
+ * @param matrix The matrix to be executed.
+ */
+void run_experiment_matrix(const experiment_matrix_t *matrix) {
+    for (int i = 0; i < matrix->count; i++) {
+        const experiment_config_t *config = &matrix->runs[i];
+        ESP_LOGW(TAG, "Experiment run %d/%d: signal %d, base rate %d Hz, window %d s, %d repetitions, QoS %d, FFT size %d",
+                 i + 1, matrix->count, config->signal, config->base_rate, config->time_window, config->repetitions,
+                 config->qos, config->fft_size);
+
+        experiment_result_t result = bonus_run_experiment(config);
+        publish_experiment_result(i, config, &result);
+    }
+}
+
+/**
+ * Publishes a batch of aggregated values to the MQTT broker in one message.
+ *
+ * With the "always" reporting policy, a batch of one value is published with publish_data, in the original format,
+ * and larger batches are sent as a list:
+ *   {"node_id":"node000000","aggregation_results":["0.001","-0.002",...]}
+ * With the dead-band and predictive policies some windows are not sent, so the window index of each value and the
+ * policy are included for the edge server to fill the gaps:
+ *   {"node_id":"node000000","aggregation_results":["0.001","0.120"],"windows":[3,7],"report":"deadband"}
+ * Once the clock is synchronized with the edge server, the timestamps of each window and the time of the publish are
+ * included in the edge clock (microseconds since the epoch), always using the list format:
+ *   {...,"trace":{"sample_end":[...],"aggregate_ready":[...],"enqueue":1718000000000000}}
+ *
+ * @param values The aggregated values, oldest first.
+ * @param windows The window index of each value, or NULL to use the original format.
+ * @param traces The timestamps of each window on the node clock, or NULL.
+ * @param count The number of values.
+ * @param topic The topic to publish to.
+ * @param qos The QoS of the publish.
+ * @return The amount of bytes sent, 0 if the batch did not fit in the message and was dropped.
+ */
+size_t publish_data_batch(const float *values, const uint32_t *windows, const window_trace_t *traces, int count, char *topic, int qos) {
+    if (count <= 0) {
+        return 0;
+    }
+    portENTER_CRITICAL(&timesync_mux);
+    bool synchronized = timesync.valid;
+    portEXIT_CRITICAL(&timesync_mux);
+    if (!synchronized) {
+        traces = NULL;
+    }
+    if (count == 1 && windows == NULL && traces == NULL) {
+        return publish_data(values[0], topic, qos);
+    }
+
+    // Static like the /stats message: a full batch is too large for the stack of app_main
+    static char json[160 + RUNTIME_CONFIG_MAX_BATCH * 64];
+    int size = (int)sizeof(json);
+    int len = snprintf(json, size, "{\"node_id\":\"%s\",\"aggregation_results\":[", NODE_ID);
+    for (int i = 0; i < count && len < size; i++) {
+        // Same formatting as publish_data, with very small negative numbers set to 0
+        float value = values[i];
+        if (value < 0 && value > -0.0001) {
+            value = 0;
+        }
+        len += snprintf(json + len, size - len, "%s\"%.3f\"", i == 0 ? "" : ",", value);
+    }
+    if (len < size) {
+        len += snprintf(json + len, size - len, "]");
+    }
+    if (windows != NULL && len < size) {
+        len += snprintf(json + len, size - len, ",\"windows\":[");
+        for (int i = 0; i < count && len < size; i++) {
+            len += snprintf(json + len, size - len, "%s%" PRIu32, i == 0 ? "" : ",", windows[i]);
+        }
+        if (len < size) {
+            len += snprintf(json + len, size - len, "],\"report\":\"%s\"", report_policy_mode_name(report_policy.mode));
+        }
+    }
+    if (traces != NULL && len < size) {
+        len += snprintf(json + len, size - len, ",\"trace\":{\"sample_end\":[");
+        for (int i = 0; i < count && len < size; i++) {
+            len += snprintf(json + len, size - len, "%s%lld", i == 0 ? "" : ",", (long long)edge_time_us(traces[i].sample_end_us));
+        }
+        if (len < size) {
+            len += snprintf(json + len, size - len, "],\"aggregate_ready\":[");
+        }
+        for (int i = 0; i < count && len < size; i++) {
+            len += snprintf(json + len, size - len, "%s%lld", i == 0 ? "" : ",", (long long)edge_time_us(traces[i].aggregate_ready_us));
+        }
+        if (len < size) {
+            len += snprintf(json + len, size - len, "],\"enqueue\":%lld}", (long long)edge_time_us(esp_timer_get_time()));
+        }
+    }
+    if (len < size) {
+        len += snprintf(json + len, size - len, "}");
+    }
+    // A truncated message is not valid JSON, drop the batch rather than publish it
+    if (len >= size) {
+        ESP_LOGE(TAG, "Batch of %d windows too large for the message (%d bytes), dropped", count, len);
+        return 0;
+    }
+
+    // Record the start time before publishing for latency measurement
+    publish_start_time = esp_timer_get_time();
+
+    publish_msg_id = mqtt_publish(topic, json, qos, 0);
+
+    return strlen(json);
+}
+
+/**
+ * Publishes the statistics of the reporting policy to the /report topic.
+ *
+ * Sent at every re-tuning of the sampling loop with the number of windows published and suppressed since the
+ * previous one, next to the energy measured with the INA219 over the same period (0 if the measurement is not active),
+ * so the radio time saved by the dead-band can be compared against the message counts of the edge server. The
+ * metrics of the MQTT outbox (messages enqueued and dropped since boot, current and peak occupancy) are included.
+ *
+ * @param sent The number of windows published.
+ * @param suppressed The number of windows suppressed.
+ * @param energy_wh The energy consumed in Wh.
+ * @return The amount of bytes sent.
+ */
+size_t publish_report_stats(uint32_t sent, uint32_t suppressed, float energy_wh) {
+    mqtt_outbox_stats_t outbox;
+    mqtt_get_outbox_stats(&outbox);
+
+    char json[320];
+    snprintf(json, sizeof(json), "{\"node_id\":\"%s\",\"report\":\"%s\",\"sent\":%" PRIu32 ",\"suppressed\":%" PRIu32 ",\"energy\":%.7f,"
+             "\"outbox\":{\"enqueued\":%" PRIu32 ",\"dropped\":%" PRIu32 ",\"bytes\":%d,\"peak_bytes\":%d,\"congested\":%s}}",
+             NODE_ID, report_policy_mode_name(report_policy.mode), sent, suppressed, energy_wh,
+             outbox.enqueued, outbox.dropped, outbox.outbox_bytes, outbox.outbox_peak_bytes, outbox.congested ? "true" : "false");
+    mqtt_publish("/report", json, 0, 0);
+    return strlen(json);
+}
+
+/**
+ * @brief Swaps in the configuration received on the control topic, if any.
+ *
+ * Must only be called between windows. The FFT size takes effect immediately on N, since the FFT buffers are
+ * statically sized for N_SAMPLES, while the window buffer is allocated per window by compute_aggregate, so the
+ * new window length is picked up by the next window. The applied configuration is published to the /config topic.
+ *
+ * @return true if a new configuration was applied.
+ */
+bool apply_pending_config(void) {
+    portENTER_CRITICAL(&config_mux);
+    bool pending = config_pending;
+    if (pending) {
+        runtime_config = pending_config;
+        config_pending = false;
+    }
+    portEXIT_CRITICAL(&config_mux);
+
+    if (!pending) {
+        return false;
+    }
+
+    N = runtime_config.fft_size;
+    report_policy_init(&report_policy, runtime_config.report_mode, runtime_config.deadband_abs, runtime_config.deadband_rel,
+                       runtime_config.heartbeat_windows);
+
+    char json[384];
+    int len = snprintf(json, sizeof(json), "{\"node_id\":\"%s\",\"config\":", NODE_ID);
+    len += runtime_config_to_json(&runtime_config, json + len, sizeof(json) - len);
+    snprintf(json + len, sizeof(json) - len, "}");
+    mqtt_publish("/config", json, 1, 0);
+
+    ESP_LOGW(TAG, "Configuration applied: %s", json);
+    return true;
+}
+
+/**
+ * @brief Registers the aggregation window of the configuration and the rollup windows in the aggregator.
+ *
+ * The history of the aggregator is kept, the new windows ending on the next multiple of their length.
+ */
+void register_aggregation_windows(void) {
+    multires_clear_windows(&multires);
+    multires_add_window(&multires, runtime_config.time_window);
+    for (int i = 0; i < n_rollup_windows; i++) {
+        if (multires_add_window(&multires, rollup_windows[i]) < 0) {
+            ESP_LOGE(TAG, "Invalid rollup window of %" PRIu32 " seconds", rollup_windows[i]);
+        }
+    }
+}
+
+/**
+ * @brief Publishes the statistics of a rollup window or of a query to the /rollup topic.
+ *
+ * @param seconds The length of the window in seconds.
+ * @param stats The statistics of the window.
+ * @param query Whether the statistics answer a query (computed from the history) rather than a rollup window.
+ * @return The amount of bytes sent in the message.
+ */
+size_t publish_rollup(uint32_t seconds, const multires_stats_t *stats, bool query) {
+    char json[256];
+    snprintf(json, sizeof(json), "{\"node_id\":\"%s\",\"window\":%" PRIu32 ",\"query\":%s,\"count\":%" PRIu32 ",\"mean\":%.4f,"
+             "\"min\":%.4f,\"max\":%.4f,\"std\":%.4f}",
+             NODE_ID, seconds, query ? "true" : "false", stats->count, multires_mean(stats), stats->count > 0 ? stats->min : 0,
+             stats->count > 0 ? stats->max : 0, multires_std(stats));
+    mqtt_publish("/rollup", json, 0, 0);
+    return strlen(json);
+}
+
+/**
+ * @brief Applies the rollup request received on the control topic, if any: new rollup windows and queries.
+ *
+ * Must only be called between windows.
+ */
+void apply_rollup_request(void) {
+    multires_request_t request;
+    portENTER_CRITICAL(&rollup_mux);
+    bool pending = rollup_request_pending;
+    request = pending_rollup_request;
+    rollup_request_pending = false;
+    portEXIT_CRITICAL(&rollup_mux);
+
+    if (!pending) {
+        return;
+    }
+    if (request.n_windows >= 0) {
+        memcpy(rollup_windows, request.windows, request.n_windows * sizeof(uint32_t));
+        n_rollup_windows = request.n_windows;
+        register_aggregation_windows();
+        ESP_LOGW(TAG, "%d rollup windows registered", n_rollup_windows);
+    }
+    for (int i = 0; i < request.n_queries; i++) {
+        multires_stats_t stats;
+        uint32_t covered = multires_query(&multires, request.queries[i], &stats);
+        ESP_LOGI(TAG, "Rollup query of %" PRIu32 " seconds covered %" PRIu32 " seconds", request.queries[i], covered);
+        publish_rollup(covered, &stats, true);
+    }
+}
+
+/**
+ * @brief Finds the optimal sampling frequency of the signal with a new FFT.
+ *
+ * The signal is stored at the maximum sampling rate of the configuration and the optimal rate (twice the highest
+ * frequency peak above the configured dB threshold) is clamped to the configured bounds. If no peak is found, the
+ * maximum rate is used. With the spectral change detection active, the rate of the previous tuning is kept while the
+ * spectrum is stationary, without searching and refining the peak again.
+ *
+ * @param acquisition The acquisition, restarted at the maximum sampling rate.
+ * @return The sampling frequency to be used in Hz.
+ */
+float tune_sampling_frequency(acquisition_t *acquisition) {
+    if (acquisition_start(acquisition, runtime_config.max_sampling_rate) != ESP_OK) {
+        return runtime_config.max_sampling_rate;
+    }
+    store_signal_acquisition(acquisition, N);
+    compute_power_spectrum(N);
+    float highest_frequency_peak = find_highest_frequency_peak_above_db_level(runtime_config.db_threshold, runtime_config.max_sampling_rate, N);
+
+    // The rate of the previous tuning is only kept if the spectrum, including its highest peak, is unchanged
+    if (spectral_change_active) {
+        spectral_sketch_t sketch;
+        spectral_sketch_build(power_spectrum, N, runtime_config.max_sampling_rate, runtime_config.db_threshold, &sketch);
+        if (check_spectral_change(&spectral_baseline, &sketch, highest_frequency_peak) && spectral_baseline_rate > 0) {
+            ESP_LOGI(TAG, "Spectrum stationary for %" PRIu32 " tunings, keeping %f Hz", spectral_baseline.stationary, spectral_baseline_rate);
+            return spectral_baseline_rate;
+        }
+    }
+
+    float sampling_rate = runtime_config.max_sampling_rate;
+    if (highest_frequency_peak > 0) {
+        if (zoom_fft_active) {
+            highest_frequency_peak = zoom_frequency_peak(acquisition, highest_frequency_peak);
+        }
+        sampling_rate = fminf(fmaxf(highest_frequency_peak * 2, runtime_config.min_sampling_rate), runtime_config.max_sampling_rate);
+    }
+    spectral_baseline_rate = sampling_rate;
+    return sampling_rate;
+}
+
+/**
+ * @brief Finds the optimal sampling frequency of the signal with the edge server, from a sketch of a small FFT.
+ *
+ * The signal is stored at the maximum sampling rate of the configuration for SPECTRAL_SKETCH_FFT_SIZE samples only,
+ * and the sketch of its power spectrum is published to /spectrum. The edge server answers on the rate control topic
+ * with a rate chosen from the sketches of this node and of its neighbours. Without an answer in time, the highest peak
+ * of the sketch above the configured dB threshold is used, as tune_sampling_frequency() would with a smaller FFT.
+ * The rate is clamped to the configured bounds. With the spectral change detection active, the sketch is not sent and
+ * the rate of the previous tuning is kept while the spectrum is stationary.
+ *
+ * @param acquisition The acquisition, restarted at the maximum sampling rate.
+ * @return The sampling frequency to be used in Hz.
+ */
+float offload_sampling_frequency(acquisition_t *acquisition) {
+    float analysis_frequency = runtime_config.max_sampling_rate;
+    if (acquisition_start(acquisition, analysis_frequency) != ESP_OK) {
+        return analysis_frequency;
+    }
+
+    // Drop a recommendation answering an older sketch
+    xQueueReset(spectral_rate_queue);
+
+    store_signal_acquisition(acquisition, SPECTRAL_SKETCH_FFT_SIZE);
+    compute_power_spectrum(SPECTRAL_SKETCH_FFT_SIZE);
+
+    spectral_sketch_t sketch;
+    spectral_sketch_build(power_spectrum, SPECTRAL_SKETCH_FFT_SIZE, analysis_frequency, runtime_config.db_threshold, &sketch);
+    float highest_frequency = find_highest_frequency_peak_above_db_level(runtime_config.db_threshold, analysis_frequency, SPECTRAL_SKETCH_FFT_SIZE);
+    if (spectral_change_active && check_spectral_change(&spectral_baseline, &sketch, highest_frequency) && spectral_baseline_rate > 0) {
+        ESP_LOGI(TAG, "Spectrum stationary for %" PRIu32 " tunings, keeping %f Hz", spectral_baseline.stationary, spectral_baseline_rate);
+        return spectral_baseline_rate;
+    }
+    static char json[768];
+    int len = spectral_sketch_to_json(&sketch, NODE_ID, json, sizeof(json));
+    mqtt_publish("/spectrum", json, 1, 0);
+
+    float sampling_rate;
+    if (xQueueReceive(spectral_rate_queue, &sampling_rate, pdMS_TO_TICKS(SPECTRAL_OFFLOAD_TIMEOUT_MS)) == pdTRUE) {
+        ESP_LOGW(TAG, "Edge server recommended %f Hz from a sketch of %d peaks (%d bytes)", sampling_rate, sketch.n_peaks, len);
+    } else {
+        float highest_frequency_peak = 0;
+        for (int i = 0; i < sketch.n_peaks; i++) {
+            highest_frequency_peak = fmaxf(highest_frequency_peak, sketch.peaks[i].frequency);
+        }
+        ESP_LOGW(TAG, "No recommendation from the edge server, highest peak of the sketch at %f Hz", highest_frequency_peak);
+        sampling_rate = highest_frequency_peak > 0 ? highest_frequency_peak * 2 : runtime_config.max_sampling_rate;
+    }
+    spectral_baseline_rate = fminf(fmaxf(sampling_rate, runtime_config.min_sampling_rate), runtime_config.max_sampling_rate);
+    return spectral_baseline_rate;
+}
+
+/**
+ * @brief Compares the on-device spectral analysis of the re-tuning with the analysis offloaded to the edge server.
+ *
+ * For each of the three input signals (synthetic source, paced in real time at the maximum sampling rate of the
+ * configuration), the energy of tune_sampling_frequency() and of offload_sampling_frequency() is measured and published
+ * to the /energy topic, along with the chosen rates and the reference rate: twice the highest tone of the signal,
+ * clamped to the configured bounds.
+ */
+void compare_spectral_offload(void) {
+    // Static, like the acquisition of app_main: the ADC buffer and the frame are too large for its stack
+    static acquisition_t acquisition;
+
+    // Measure the whole analysis of both methods, without the shortcut of a stationary spectrum
+    bool change_detection = spectral_change_active;
+    spectral_change_active = false;
+
+    for (int s = 0; s < 3; s++) {
+        float highest_tone = 0;
+        for (int i = 0; i < synth_signals[s].n_tones; i++) {
+            highest_tone = fmaxf(highest_tone, synth_signals[s].tones[i].frequency);
+        }
+        float reference_rate = fminf(fmaxf(highest_tone * 2, runtime_config.min_sampling_rate), runtime_config.max_sampling_rate);
+
+        // Skip the signal if a window does not fit in a power measurement (low maximum sampling rate)
+        acquisition_init_synth(&acquisition, &synth_signals[s], true);
+        if (start_power_measurement((int)(N / runtime_config.max_sampling_rate) + 10) != ESP_OK) {
+            continue;
+        }
+        float device_rate = tune_sampling_frequency(&acquisition);
+        power_measurement_result_t device = end_power_measurement();
+
+        acquisition_init_synth(&acquisition, &synth_signals[s], true);
+        if (start_power_measurement((int)(SPECTRAL_SKETCH_FFT_SIZE / runtime_config.max_sampling_rate) + 10 + SPECTRAL_OFFLOAD_TIMEOUT_MS / 1000) != ESP_OK) {
+            continue;
+        }
+        float offload_rate = offload_sampling_frequency(&acquisition);
+        power_measurement_result_t offload = end_power_measurement();
+
+        ESP_LOGW(TAG, "Spectral offload Signal %d: on-device %f Hz with %f Wh, offloaded %f Hz with %f Wh, reference %f Hz",
+                 s + 1, device_rate, device.total_energy_wh, offload_rate, offload.total_energy_wh, reference_rate);
+
+        char details[160];
+        snprintf(details, sizeof(details), "Offloaded vs on-device analysis, Signal %d: offloaded %.2f Hz, on-device %.2f Hz, reference %.2f Hz",
+                 s + 1, offload_rate, device_rate, reference_rate);
+        publish_energy_experiment(offload.total_energy_wh, device.total_energy_wh, details);
+    }
+    spectral_change_active = change_detection;
+}
+
+/**
+ * @brief One-shot timer callback of wait_until_us(), waking up the waiting task.
+ */
+static void wait_timer_callback(void *arg) {
+    xTaskNotifyGive((TaskHandle_t)arg);
+}
+
+/**
+ * @brief Waits until a time of the esp_timer clock, blocked on a task notification given by a one-shot esp_timer.
+ *
+ * The task sleeps for the whole wait, so the CPU idles between samples instead of spinning (which would also inflate
+ * the energy measured for the window). The timer wakes it up within tens of microseconds, much finer than a tick.
+ * Must always be called from the same task, the one the timer is created for.
+ */
+static void wait_until_us(int64_t target_us) {
+    static esp_timer_handle_t wait_timer = NULL;
+    if (wait_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = wait_timer_callback,
+            .arg = xTaskGetCurrentTaskHandle(),
+            .name = "wait_until",
+        };
+        if (esp_timer_create(&timer_args, &wait_timer) != ESP_OK) {
+            wait_timer = NULL;
+        }
+    }
+
+    int64_t remaining_us = target_us - esp_timer_get_time();
+    if (remaining_us <= 0) {
+        return;
+    }
+    if (wait_timer == NULL || esp_timer_start_once(wait_timer, remaining_us) != ESP_OK) {
+        // Fall back to the tick resolution
+        vTaskDelay(pdMS_TO_TICKS(remaining_us / 1000) + 1);
+        return;
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+/**
+ * @brief Computes the aggregate function (average) over a window from randomly timed samples (compressive sampling).
+ *
+ * COMPRESSIVE_SAMPLES distinct times are drawn on a grid of COMPRESSIVE_GRID_RATE Hz covering the window and the signal
+ * is sampled at those times, in real time, the node sleeping in between. The mean and the strongest tones of the window
+ * are then recovered by orthogonal matching pursuit (compressive_recover()). The call returns at the end of the window.
+ *
+ * @param signal_func A pointer to a function that generates the signal value for a given time `t`.
+ * @param time_window The number of seconds to sample.
+ * @param indices The output grid indices of the samples, COMPRESSIVE_SAMPLES of them.
+ * @param values The output samples, COMPRESSIVE_SAMPLES of them.
+ * @param result The output model of the window.
+ * @return The average value over the window.
+ */
+float compute_aggregate_compressive(signal_function_t signal_func, float time_window, uint32_t *indices, float *values,
+                                    compressive_result_t *result) {
+    static uint32_t rng = 0;
+    if (rng == 0) {
+        rng = esp_random() | 1;
+    }
+    int n = (int)(COMPRESSIVE_GRID_RATE * time_window);
+    compressive_schedule(indices, COMPRESSIVE_SAMPLES, n, &rng);
+
+    int64_t start_us = esp_timer_get_time();
+    for (int i = 0; i < COMPRESSIVE_SAMPLES; i++) {
+        float t = (float)indices[i] / COMPRESSIVE_GRID_RATE;
+        wait_until_us(start_us + (int64_t)(t * 1e6f));
+        values[i] = signal_func(t);
+    }
+
+    if (!compressive_recover(indices, values, COMPRESSIVE_SAMPLES, n, COMPRESSIVE_GRID_RATE, COMPRESSIVE_MAX_TONES,
+                             COMPRESSIVE_TOLERANCE, result)) {
+        ESP_LOGE(TAG, "Compressive recovery failed, using the mean of the samples");
+        float sum = 0;
+        for (int i = 0; i < COMPRESSIVE_SAMPLES; i++) {
+            sum += values[i];
+        }
+        result->mean = sum / COMPRESSIVE_SAMPLES;
+    }
+    ESP_LOGI(TAG, "Compressive window: mean %f, %d tones, residual %f", result->mean, result->n_tones, result->residual);
+
+    wait_until_us(start_us + (int64_t)(time_window * 1e6f));
+    return result->mean;
+}
+
+/**
+ * @brief Publishes the samples of a compressive window and the model recovered on the node to the /compressive topic.
+ *
+ * @return The amount of bytes sent in the message.
+ */
+size_t publish_compressive_window(const uint32_t *indices, const float *values, int n, const compressive_result_t *result) {
+    size_t size = 256 + COMPRESSIVE_SAMPLES * 20;
+    char *json = (char *)malloc(size);
+    if (json == NULL) {
+        return 0;
+    }
+    int len = compressive_to_json(indices, values, COMPRESSIVE_SAMPLES, n, COMPRESSIVE_GRID_RATE, result, NODE_ID, json, size);
+    if (len < (int)size) {
+        mqtt_publish("/compressive", json, 0, 0);
+    } else {
+        ESP_LOGE(TAG, "Compressive window too large to publish");
+        len = 0;
+    }
+    free(json);
+    return len;
+}
+
+/**
+ * @brief Compares the energy of the compressive sampling with the uniform sampling at the optimal rate.
+ *
+ * For each of the three input signals, COMPRESSIVE_REPETITIONS windows of COMPRESSIVE_TIME_WINDOW seconds are
+ * aggregated and published to /average with each method, and the energy of each is measured. The optimal rate is
+ * twice the highest tone of the signal, as found by the FFT, so neither method is charged for the spectral analysis.
+ * The uniform windows are padded to the length of the window, since compute_aggregate() does not wait below one tick
+ * per sample, so both methods are compared over the same time. The energies are published to the /energy topic,
+ * and the samples of the last compressive window to /compressive.
+ */
+void compare_compressive_sampling(void) {
+    uint32_t indices[COMPRESSIVE_SAMPLES];
+    float values[COMPRESSIVE_SAMPLES];
+    compressive_result_t model;
+    int n = (int)(COMPRESSIVE_GRID_RATE * COMPRESSIVE_TIME_WINDOW);
+
+    for (int s = 0; s < 3; s++) {
+        float highest_tone = 0;
+        for (int i = 0; i < synth_signals[s].n_tones; i++) {
+            highest_tone = fmaxf(highest_tone, synth_signals[s].tones[i].frequency);
+        }
+        float optimal_rate = highest_tone * 2;
+
+        start_power_measurement(COMPRESSIVE_REPETITIONS * COMPRESSIVE_TIME_WINDOW + 10);
+        float uniform_average = 0;
+        for (int r = 0; r < COMPRESSIVE_REPETITIONS; r++) {
+            int64_t start_us = esp_timer_get_time();
+            uniform_average = compute_aggregate(optimal_rate, COMPRESSIVE_TIME_WINDOW, input_signals[s]);
+            publish_data(uniform_average, "/average", 0);
+            wait_until_us(start_us + COMPRESSIVE_TIME_WINDOW * 1000000LL);
+        }
+        power_measurement_result_t uniform = end_power_measurement();
+
+        start_power_measurement(COMPRESSIVE_REPETITIONS * COMPRESSIVE_TIME_WINDOW + 10);
+        float compressive_average = 0;
+        for (int r = 0; r < COMPRESSIVE_REPETITIONS; r++) {
+            compressive_average = compute_aggregate_compressive(input_signals[s], COMPRESSIVE_TIME_WINDOW, indices, values, &model);
+            publish_data(compressive_average, "/average", 0);
+        }
+        power_measurement_result_t compressive = end_power_measurement();
+        publish_compressive_window(indices, values, n, &model);
+
+        float average_rate = (float)COMPRESSIVE_SAMPLES / COMPRESSIVE_TIME_WINDOW;
+        ESP_LOGW(TAG, "Compressive sampling Signal %d: %f Hz on average with %f Wh (mean %f, %d tones), uniform %f Hz with %f Wh (mean %f)",
+                 s + 1, average_rate, compressive.total_energy_wh, compressive_average, model.n_tones, optimal_rate,
+                 uniform.total_energy_wh, uniform_average);
+
+        char details[160];
+        snprintf(details, sizeof(details), "Compressive vs uniform sampling, Signal %d: %d random samples (%.1f Hz average) vs %.1f Hz, %d tones recovered",
+                 s + 1, COMPRESSIVE_SAMPLES, average_rate, optimal_rate, model.n_tones);
+        publish_energy_experiment(compressive.total_energy_wh, uniform.total_energy_wh, details);
+    }
+}
+
+/**
+ * @brief Checks whether the sampling frequency must be re-tuned, with a time-domain estimate instead of the FFT.
+ *
+ * Samples one window of time_window seconds at the maximum sampling rate, frame by frame, through the frequency
+ * estimator: O(n) work on far fewer samples than the N needed by the FFT. The first check after a reset of the
+ * estimator becomes its baseline.
+ *
+ * @param acquisition The acquisition, restarted at the maximum sampling rate.
+ * @param sampling_frequency The sampling frequency currently used to aggregate the signal in Hz.
+ * @return true if the spectrum likely changed or exceeds the current Nyquist frequency, false otherwise.
+ */
+bool frequency_precheck(acquisition_t *acquisition, float sampling_frequency) {
+    float check_frequency = runtime_config.max_sampling_rate;
+    if (acquisition_start(acquisition, check_frequency) != ESP_OK) {
+        return true;
+    }
+
+    int num_samples = (int)(check_frequency * runtime_config.time_window);
+    int count = 0;
+    while (count < num_samples) {
+        const float *frame;
+        int frame_len = acquisition_read_frame(acquisition, &frame, num_samples - count);
+        if (frame_len == 0) {
+            return true;
+        }
+        freq_estimator_update(&freq_estimator, frame, frame_len);
+        count += frame_len;
+    }
+
+    bool changed = freq_estimator_window_end(&freq_estimator, check_frequency, sampling_frequency / 2);
+    ESP_LOGI(TAG, "Pre-check: zero-crossing %f Hz, autocorrelation %f Hz, variance %f (baseline %f Hz, %f Hz, %f)%s",
+             freq_estimator.last.zero_crossing_frequency, freq_estimator.last.autocorrelation_frequency, freq_estimator.last.variance,
+             freq_estimator.baseline.zero_crossing_frequency, freq_estimator.baseline.autocorrelation_frequency, freq_estimator.baseline.variance,
+             changed ? ": spectrum changed" : "");
+    return changed;
+}
+
+/**
+ * @brief Continuously samples the signal at the optimal sampling frequency, aggregating and publishing each window.
+ *
+ * The sampling rate is re-tuned every RETUNE_EVERY_N_WINDOWS windows and whenever a new configuration is applied. With
+ * the pre-check active, the periodic re-tuning only runs the FFT if frequency_precheck() detects a change. With the
+ * spectral change detection active, the interval doubles after each tuning that finds the spectrum stationary.
+ * Configuration changes and experiment matrices received on the control topics are only handled between windows,
+ * so a window in progress is never dropped: the pending batch is published with the old configuration first.
+ * The reporting policy decides which windows are published at all; its statistics and, if active, the energy
+ * measured over the same period are published at every re-tuning.
+ * The samples come from the acquisition one frame at a time, whatever its backend.
+ *
+ * @param acquisition The acquisition of the input signal.
+ */
+void adaptive_sampling_loop(acquisition_t *acquisition) {
+    float sampling_frequency = 0;
+    int windows_since_tuning = 0;
+    int retune_interval = RETUNE_EVERY_N_WINDOWS;
+    float batch[RUNTIME_CONFIG_MAX_BATCH];
+    uint32_t batch_windows[RUNTIME_CONFIG_MAX_BATCH];
+    window_trace_t batch_traces[RUNTIME_CONFIG_MAX_BATCH];
+    int batch_count = 0;
+    uint32_t sent_at_tuning = 0, suppressed_at_tuning = 0;
+    bool measuring_energy = false;
+    experiment_matrix_t matrix;
+
+    report_policy_init(&report_policy, runtime_config.report_mode, runtime_config.deadband_abs, runtime_config.deadband_rel,
+                       runtime_config.heartbeat_windows);
+    multires_reset(&multires, runtime_config.max_sampling_rate);
+    register_aggregation_windows();
+    spectral_baseline_reset(&spectral_baseline);
+    spectral_baseline_rate = 0;
+
+    while (1) {
+        // Apply a new configuration between windows, flushing the batch of the previous one
+        if (config_pending) {
+            publish_data_batch(batch, report_policy.mode == REPORT_ALWAYS ? NULL : batch_windows, batch_traces, batch_count, "/average", runtime_config.publish_qos);
+            batch_count = 0;
+            if (apply_pending_config()) {
+                sampling_frequency = 0;
+                sent_at_tuning = suppressed_at_tuning = 0;
+                register_aggregation_windows();
+                spectral_baseline_reset(&spectral_baseline);
+                spectral_baseline_rate = 0;
+                retune_interval = RETUNE_EVERY_N_WINDOWS;
+            }
+        }
+
+        // Apply the rollup windows and answer the queries received on the control topic
+        if (rollup_request_pending) {
+            apply_rollup_request();
+        }
+
+        // Run the experiment matrices received on the control topic
+        if (xQueueReceive(experiment_queue, &matrix, 0) == pdTRUE) {
+            if (measuring_energy) {
+                end_power_measurement();
+                measuring_energy = false;
+            }
+            run_experiment_matrix(&matrix);
+        }
+
+        // Re-tune the sampling frequency, reporting the statistics of the reporting policy since the last tuning
+        if (sampling_frequency <= 0 || windows_since_tuning >= retune_interval) {
+            if (windows_since_tuning > 0) {
+                float energy_wh = 0;
+                if (measuring_energy) {
+                    energy_wh = end_power_measurement().total_energy_wh;
+                    measuring_energy = false;
+                }
+                publish_report_stats(report_policy.total_sent - sent_at_tuning, report_policy.total_suppressed - suppressed_at_tuning, energy_wh);
+                sent_at_tuning = report_policy.total_sent;
+                suppressed_at_tuning = report_policy.total_suppressed;
+            }
+
+            // Refresh the clock synchronization, both clocks drift
+            request_time_sync(TIMESYNC_REQUESTS);
+
+            if (sampling_frequency <= 0 || !freq_precheck_active || frequency_precheck(acquisition, sampling_frequency)) {
+                sampling_frequency = spectral_offload_active ? offload_sampling_frequency(acquisition) : tune_sampling_frequency(acquisition);
+
+                // Space out the re-tunings while the spectrum is stationary
+                if (spectral_change_active && spectral_baseline.stationary > 0) {
+                    retune_interval = retune_interval * 2 < RETUNE_EVERY_N_WINDOWS * SPECTRAL_CHANGE_MAX_BACKOFF ? retune_interval * 2 : RETUNE_EVERY_N_WINDOWS * SPECTRAL_CHANGE_MAX_BACKOFF;
+                } else {
+                    retune_interval = RETUNE_EVERY_N_WINDOWS;
+                }
+                // The energy of the period is only summed over POWER_MEASUREMENT_MAX_SECONDS, so don't space the re-tunings
+                // out beyond it while measuring
+                if (power_measurement_active && retune_interval * runtime_config.time_window > POWER_MEASUREMENT_MAX_SECONDS) {
+                    retune_interval = POWER_MEASUREMENT_MAX_SECONDS / runtime_config.time_window > 0 ? POWER_MEASUREMENT_MAX_SECONDS / runtime_config.time_window : 1;
+                }
+
+                // Take the baseline of the pre-check for the new sampling frequency
+                if (freq_precheck_active) {
+                    freq_estimator_reset(&freq_estimator);
+                    frequency_precheck(acquisition, sampling_frequency);
+                }
+            } else {
+                ESP_LOGI(TAG, "Pre-check found no change, keeping the sampling frequency without running the FFT");
+            }
+            windows_since_tuning = 0;
+            if (acquisition_start(acquisition, sampling_frequency) != ESP_OK) {
+                ESP_LOGE(TAG, "The %s acquisition can't sample at %f Hz", acquisition_backend_name(acquisition->backend), sampling_frequency);
+                sampling_frequency = runtime_config.max_sampling_rate;
+                acquisition_start(acquisition, sampling_frequency);
+            }
+            ESP_LOGW(TAG, "Sampling at %f Hz", sampling_frequency);
+
+            // Measure the energy of the windows until the next tuning (excluding the FFT). The measurement is ended at the
+            // next tuning, so its duration is only the upper bound on the samples averaged, not tied to the tuning period.
+            if (power_measurement_active) {
+                measuring_energy = start_power_measurement(POWER_MEASUREMENT_MAX_SECONDS) == ESP_OK;
+            }
+        }
+
+        // Aggregate one window and decide whether to report it, publishing once the batch is full
+        float average = compute_aggregate_acquisition(acquisition, runtime_config.time_window);
+        int64_t aggregate_ready_us = esp_timer_get_time();
+        windows_since_tuning++;
+
+        // Publish the rollup windows completed along with this window
+        multires_stats_t rollup;
+        for (int i = MULTIRES_AGGREGATE_WINDOW + 1; i < multires.n_windows; i++) {
+            if (multires_window_ready(&multires, i, &rollup)) {
+                publish_rollup(multires.windows[i].seconds, &rollup, false);
+            }
+        }
+        uint32_t window;
+        if (report_policy_should_send(&report_policy, average, &window)) {
+            batch[batch_count] = average;
+            batch_windows[batch_count] = window;
+            batch_traces[batch_count].sample_end_us = last_sample_end_us;
+            batch_traces[batch_count].aggregate_ready_us = aggregate_ready_us;
+            batch_count++;
+        }
+        if (batch_count >= (publish_congested ? RUNTIME_CONFIG_MAX_BATCH : runtime_config.publish_batch)) {
+            publish_data_batch(batch, report_policy.mode == REPORT_ALWAYS ? NULL : batch_windows, batch_traces, batch_count, "/average", runtime_config.publish_qos);
+            batch_count = 0;
+        }
+    }
+}
+
+// Main function
+void app_main(void) {
+
+    // ********** 1. SETUP **********
+    // Queue for the experiment matrices received on the control topic
+    experiment_queue = xQueueCreate(1, sizeof(experiment_matrix_t));
+    // Queue for the sampling rates recommended by the edge server from the spectral sketches
+    spectral_rate_queue = xQueueCreate(1, sizeof(float));
+    // Clock synchronization with the edge server, requested as soon as MQTT is connected
+    timesync_init(&timesync);
+
+    // Initialize NVS for storing wifi credentials and mqtt config
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+
+    // Load the runtime configuration persisted from the control topic, or the defaults
+    if (runtime_config_load(&runtime_config, N_SAMPLES) == ESP_OK) {
+        ESP_LOGI(TAG, "Runtime configuration loaded from NVS");
+    }
+    N = runtime_config.fft_size;
+
+    // Connect to wifi, waiting until an IP is obtained before starting MQTT
+    wifi_connection();
+    wifi_wait_connected(portMAX_DELAY);
+    // Start MQTT and wait until it is connected to the broker before proceeding
+    mqtt_app_start();
+    mqtt_wait_connected(portMAX_DELAY);
+
+    // Publish the resources of the node periodically, at a lower priority than the sampling
+    if (resource_stats_active) {
+        xTaskCreate(resource_stats_task, "resource_stats", RESOURCE_STATS_TASK_STACK, NULL, 1, NULL);
+    }
+
+    // Initialize FFT
+    ret = dsps_fft2r_init_fc32(NULL, CONFIG_DSP_MAX_FFT_SIZE);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Not possible to initialize FFT. Error = %i", ret);
+    }
+    // Radix-4 tables, used by the fft4r kernels and by the real-input kernels (dsps_cplx2real_fc32)
+    ret = dsps_fft4r_init_fc32(NULL, CONFIG_DSP_MAX_FFT_SIZE);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Not possible to initialize radix-4 FFT. Error = %i", ret);
+    }
+    ret = fft_q15_init(CONFIG_DSP_MAX_FFT_SIZE);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Not possible to initialize fixed-point FFT. Error = %i", ret);
+    }
+#if !FFT_FIXED_POINT
+    // Select the fastest correct FFT kernel for each size (benchmarked at the first boot, then cached in NVS)
+    tune_fft_backends();
+#endif
+
+    // Initialize INA219 library (Following the INA219 esp-idf-lib example: https://github.com/UncleRus/esp-idf-lib/blob/master/examples/ina219/default/main/main.c)
+    if (power_measurement_active) {
+        initialize_ina219_library();
+    }
+    
+    // ********** 2. INPUT SIGNAL **********
+
+    // Store the signal data in memory (with a Hann window applied)
+    store_signal(input_signal_1, SIGNAL_ORIGINAL_SAMPLING_FREQUENCY);
+    ESP_LOGI(TAG, "Signal storage complete. Proceeding to sampling...");
+
+
+    // ********** 3. MAXIMUM SAMPLING FREQUENCY **********
+
+    // Measure the maximum sampling frequency of the stored signal data, simulating a sampling process that reads the data from memory
+    // and counts the number of samples iterated and the elapsed time. Since the signal data is already stored in memory, this function
     // simulates how fast the ESP32 can sample the signal data, i.e., how many samples it can read in a given time window from memory
     measure_max_sampling_signal();
 
@@ -760,26 +2495,15 @@ void app_main(void) {
 
     // FFT processing to find the power spectrum, as seen in the official ESP-DSP example:
     // https://github.com/espressif/esp-dsp/blob/master/examples/fft/README.md
-    unsigned int start_b = dsp_get_cpu_cycle_count();
-    dsps_fft2r_fc32(y_cf, N);
-    unsigned int end_b = dsp_get_cpu_cycle_count();
-    // Bit reverse
-    dsps_bit_rev_fc32(y_cf, N);
-    // Convert one complex vector to two complex vectors
-    dsps_cplx2reC_fc32(y_cf, N);
-
-    // Calculate power spectrum
-    for (int i = 0; i < N; i++) {
-        power_spectrum[i] = 10 * log10f((y_cf[i * 2] * y_cf[i * 2] + y_cf[i * 2 + 1] * y_cf[i * 2 + 1]) / N);
-    }
+    unsigned int fft_cycles = compute_power_spectrum(N);
 
     // Show power spectrum in 100x15 window from -100 to 20 dB from 0..N/2 samples
     ESP_LOGW(TAG, "Power Spectrum");
     dsps_view(power_spectrum, N / 2, 100, 12, -60, 60, '|');
-    ESP_LOGI(TAG, "FFT for %i complex points take %i cycles", N, end_b - start_b);
+    ESP_LOGI(TAG, "FFT for %i points take %i cycles, including the bit reversal and split", N, fft_cycles);
 
     // Find the peak with the highest frequency on the power spectrum above 0 dB
-    float highest_frequency_peak = find_highest_frequency_peak_above_db_level(0.0, SIGNAL_ORIGINAL_SAMPLING_FREQUENCY, N_SAMPLES);
+    float highest_frequency_peak = find_highest_frequency_peak_above_db_level(runtime_config.db_threshold, SIGNAL_ORIGINAL_SAMPLING_FREQUENCY, N);
     
     // After running the program once, we can see that the maximum value of the power spectrum is 41.917538, which is at index 205.
     // Since we have 4096 power spectrum components, and the sampling frequency is 100Hz, each component is 100/4096 = 0.0244Hz. 
@@ -873,33 +2597,65 @@ void app_main(void) {
     ESP_LOGW(TAG, "Latency Measurement: Running publish 10 times and measuring the latency of each publish event...");
     for (int i = 0; i < 10; i++) {
         // Publish the average value to the MQTT broker
-        measuring_latency = true;
-        publish_data(average, "/average", 1);
-        while (measuring_latency) {
-            vTaskDelay(10 / portTICK_PERIOD_MS);
-        }
+        publish_data_wait_ack(average, 1);
     }
 
     // ********** 8. BONUS **********
     ESP_LOGW(TAG, "Running Bonus Experiments...");
 
-    // Run the bonus experiment with the input signal 1
-    ESP_LOGW(TAG, "Running Bonus Experiment with Input Signal 1...");
-    bonus_run_experiment(input_signal_1, 500, 5);
+    // Benchmark the compression of raw windows on the three input signals
+    if (raw_upload_active) {
+        benchmark_raw_compression();
+    }
 
-    // Run the bonus experiment with the input signal 2
-    ESP_LOGW(TAG, "Running Bonus Experiment with Input Signal 2...");
-    bonus_run_experiment(input_signal_2, 500, 5);
+    // Compare the cost of the synthetic source against the sin() based signal functions
+    if (synthesis_benchmark_active) {
+        benchmark_signal_synthesis();
+    }
 
-    // Run the bonus experiment with the input signal 3
-    ESP_LOGW(TAG, "Running Bonus Experiment with Input Signal 3...");
-    bonus_run_experiment(input_signal_3, 500, 5);
+    // Compare the accuracy, cycles and energy of the fixed-point FFT path against the float32 path
+    if (fixed_point_benchmark_active) {
+        benchmark_fixed_point_fft();
+    }
 
+    // Compare the cost and the change detection of the frequency pre-check against the FFT
+    if (freq_precheck_benchmark_active) {
+        benchmark_frequency_estimator();
+    }
 
-    while (1) {
-        // Delay to keep the task running
-        vTaskDelay(pdMS_TO_TICKS(1000));
+    // Compare the energy and the chosen rates of the on-device and the edge-offloaded spectral analysis
+    if (power_measurement_active && spectral_offload_active) {
+        compare_spectral_offload();
+    }
+
+    // Compare the energy of the randomized sub-Nyquist sampling with the uniform sampling at the optimal rate
+    if (power_measurement_active && compressive_sampling_active) {
+        compare_compressive_sampling();
+    }
+
+    // Run the experiment matrix stored in NVS, or the bonus experiment (signals 1 to 3 at 500Hz, 5 second window)
+    // if no matrix was ever received on the control topic
+    experiment_matrix_t matrix;
+    if (experiment_matrix_load(&matrix) != ESP_OK) {
+        experiment_matrix_default(&matrix, N_SAMPLES);
+    }
+    run_experiment_matrix(&matrix);
+
+    // ********** 9. CONTINUOUS ADAPTIVE SAMPLING **********
+
+    // Keep sampling the signal at the optimal sampling frequency, applying the configuration and running the experiment
+    // matrices received on the control topics between windows
+    static acquisition_t acquisition;
+    acquisition_init_function(&acquisition, input_signal_1);
+    if (ACQUISITION_BACKEND == ACQUISITION_SYNTH) {
+        acquisition_init_synth(&acquisition, &synth_signals[0], true);
+    } else if (ACQUISITION_BACKEND == ACQUISITION_ADC) {
+        if (acquisition_init_adc(&acquisition, ADC_UNIT_1, ACQUISITION_ADC_CHANNEL) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to initialize the ADC, sampling input_signal_1 instead");
+            acquisition_init_function(&acquisition, input_signal_1);
+        }
     }
+    adaptive_sampling_loop(&acquisition);
     
     
 }
@@ -1,14 +1,34 @@
 #include "mqtt.h"
 #include "mqtt_client.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include <string.h>
 
 // MQTT Configuration
 esp_mqtt_client_handle_t client = NULL;
 static const char *MQTTTAG = "MQTT";                     // Tag used for Logging
 static bool mqtt_connected = false;                      // Boolean flag to indicate whether mqtt is connected or not
+static EventGroupHandle_t mqtt_event_group = NULL;       // Event group mirroring mqtt_connected, used to block until connected
+#define MQTT_CONNECTED_BIT BIT0
 const char *mqtt_address = "mqtts://192.168.86.94:8883"; // MQTT address
 #define NODE_ID "node000000"                             // Node ID for the device
 
+// Outbox: messages are only enqueued by the publishing task and sent by the MQTT task, so a slow broker never blocks
+// sampling and DSP. Its size is bounded, and the backpressure callback is told when the occupancy crosses the high
+// watermark (congested) and when it drops back below the low watermark. The metrics are updated by the publishing task,
+// the MQTT task and the monitor timer, under outbox_mux.
+#define MQTT_OUTBOX_LIMIT_BYTES (16 * 1024)
+#define MQTT_OUTBOX_HIGH_WATERMARK (MQTT_OUTBOX_LIMIT_BYTES * 3 / 4)
+#define MQTT_OUTBOX_LOW_WATERMARK (MQTT_OUTBOX_LIMIT_BYTES / 4)
+#define MQTT_OUTBOX_CHECK_PERIOD_MS 500
+static mqtt_outbox_stats_t outbox_stats;
+static portMUX_TYPE outbox_mux = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t outbox_timer = NULL;
+static mqtt_backpressure_cb_t backpressure_cb = NULL;
+static void *backpressure_ctx = NULL;
+
 // Certificates
 
 // Root CA Certificate
@@ -104,28 +124,231 @@ void log_error_if_nonzero(const char *message, int error_code)
     }
 }
 
+/**
+ * @brief Re-evaluates the outbox occupancy, notifying the backpressure callback when the congestion state changes.
+ *
+ * Called after every enqueue, by the MQTT event handler when a QoS 1/2 message is acknowledged or deleted, and
+ * periodically by the monitor timer. QoS 0 messages leave the outbox once sent without any event, so without the
+ * timer the congestion would only clear on the next enqueue.
+ */
+void mqtt_outbox_check(void)
+{
+    if (client == NULL)
+    {
+        return;
+    }
+    // Read outside the critical section, the client takes its own lock
+    int size = esp_mqtt_client_get_outbox_size(client);
+
+    portENTER_CRITICAL(&outbox_mux);
+    outbox_stats.outbox_bytes = size;
+    if (size > outbox_stats.outbox_peak_bytes)
+    {
+        outbox_stats.outbox_peak_bytes = size;
+    }
+    bool previous = outbox_stats.congested;
+    bool congested = previous;
+    if (!congested && size >= MQTT_OUTBOX_HIGH_WATERMARK)
+    {
+        congested = true;
+    }
+    else if (congested && size <= MQTT_OUTBOX_LOW_WATERMARK)
+    {
+        congested = false;
+    }
+    outbox_stats.congested = congested;
+    portEXIT_CRITICAL(&outbox_mux);
+
+    if (congested != previous)
+    {
+        ESP_LOGW(MQTTTAG, "Outbox %s (%d of %d bytes)", congested ? "congested" : "drained", size, MQTT_OUTBOX_LIMIT_BYTES);
+        if (backpressure_cb != NULL)
+        {
+            backpressure_cb(congested, size, backpressure_ctx);
+        }
+    }
+}
+
+/**
+ * @brief Counts an enqueued or dropped message.
+ */
+static void mqtt_outbox_count(bool enqueued)
+{
+    portENTER_CRITICAL(&outbox_mux);
+    if (enqueued)
+    {
+        outbox_stats.enqueued++;
+    }
+    else
+    {
+        outbox_stats.dropped++;
+    }
+    portEXIT_CRITICAL(&outbox_mux);
+}
+
+/**
+ * @brief Monitor timer callback, re-evaluating the congestion while nothing is enqueued or acknowledged.
+ */
+static void mqtt_outbox_timer_callback(void *arg)
+{
+    mqtt_outbox_check();
+}
+
+/**
+ * @brief Starts the periodic re-evaluation of the outbox occupancy, once the client is created.
+ */
+void mqtt_outbox_monitor_start(void)
+{
+    if (outbox_timer != NULL)
+    {
+        return;
+    }
+    const esp_timer_create_args_t timer_args = {
+        .callback = mqtt_outbox_timer_callback,
+        .name = "mqtt_outbox",
+    };
+    if (esp_timer_create(&timer_args, &outbox_timer) == ESP_OK)
+    {
+        esp_timer_start_periodic(outbox_timer, MQTT_OUTBOX_CHECK_PERIOD_MS * 1000);
+    }
+}
+
+/**
+ * @brief Enqueues a message in the outbox, to be sent by the MQTT task.
+ *
+ * Never waits for the network. The message is dropped (and counted) if it would not fit in the outbox, or if the
+ * client is disconnected and the QoS is 0; with QoS 1 and 2 it is kept and sent after reconnecting.
+ *
+ * @return The message id, or -1 if the message was dropped.
+ */
+static int mqtt_enqueue(const char *topic, const char *data, int len, int qos, int retain)
+{
+    if (client == NULL || (!mqtt_connected && qos == 0))
+    {
+        mqtt_outbox_count(false);
+        ESP_LOGE(MQTTTAG, "MQTT not connected. Cannot publish message.");
+        return -1;
+    }
+    if (esp_mqtt_client_get_outbox_size(client) + len > MQTT_OUTBOX_LIMIT_BYTES)
+    {
+        mqtt_outbox_count(false);
+        ESP_LOGE(MQTTTAG, "Outbox full, dropping message to topic %s", topic);
+        mqtt_outbox_check();
+        return -1;
+    }
+
+    int msg_id = esp_mqtt_client_enqueue(client, topic, data, len, qos, retain, true);
+    mqtt_outbox_count(msg_id >= 0);
+    if (msg_id < 0)
+    {
+        ESP_LOGE(MQTTTAG, "Failed to enqueue message to topic %s (%d)", topic, msg_id);
+    }
+    mqtt_outbox_check();
+    return msg_id;
+}
+
 /**
  * @brief Publishes a message to a specified MQTT topic.
  *
- * This function publishes a message to the specified MQTT topic if the MQTT client is connected.
- * If the client is not connected, an error message is logged.
+ * The message is enqueued in the outbox and sent by the MQTT task, see mqtt_enqueue.
  *
  * @param topic The MQTT topic to publish the message to.
  * @param data The message data to be published.
+ * @return The message id, or -1 if the message was dropped.
  */
-void mqtt_publish(char *topic, char *data, int qos, int retain)
+int mqtt_publish(char *topic, char *data, int qos, int retain)
 {
-    if (mqtt_connected)
+    // Only log the message if the QoS is 0, otherwise only show the latency
+    if (qos == 0)
     {
-        // Only log the message if the QoS is 0, otherwise only show the latency
-        if (qos == 0)
-        {
-            ESP_LOGI(MQTTTAG, "Publishing message to topic %s, with QoS %d: %s\n", topic, qos, data);
-        }
-        esp_mqtt_client_publish(client, topic, data, 0, qos, retain);
+        ESP_LOGI(MQTTTAG, "Publishing message to topic %s, with QoS %d: %s\n", topic, qos, data);
+    }
+    return mqtt_enqueue(topic, data, strlen(data), qos, retain);
+}
+
+/**
+ * @brief Publishes a binary payload to a specified MQTT topic.
+ *
+ * Same as mqtt_publish, but with an explicit length so that the payload may contain null bytes.
+ *
+ * @param topic The MQTT topic to publish the message to.
+ * @param data The payload to be published.
+ * @param len The length of the payload in bytes.
+ * @return The message id, or -1 if the message was dropped.
+ */
+int mqtt_publish_binary(const char *topic, const uint8_t *data, int len, int qos)
+{
+    return mqtt_enqueue(topic, (const char *)data, len, qos, 0);
+}
+
+/**
+ * @brief Registers the callback notified when the outbox becomes congested or drains.
+ *
+ * The callback runs in the context of the publishing task, of the MQTT task or of the esp_timer task, so it should only
+ * record the state for the producer to act upon, e.g. by coarsening its reporting.
+ *
+ * @param callback The callback, or NULL to remove it.
+ * @param ctx Context passed to the callback.
+ */
+void mqtt_set_backpressure_callback(mqtt_backpressure_cb_t callback, void *ctx)
+{
+    backpressure_ctx = ctx;
+    backpressure_cb = callback;
+}
+
+/**
+ * @brief Returns the outbox metrics: messages enqueued and dropped, current and peak occupancy.
+ *
+ * @param stats Output metrics.
+ */
+void mqtt_get_outbox_stats(mqtt_outbox_stats_t *stats)
+{
+    portENTER_CRITICAL(&outbox_mux);
+    *stats = outbox_stats;
+    portEXIT_CRITICAL(&outbox_mux);
+}
+
+/**
+ * @brief Returns the size limit of the outbox in bytes, to be set in the client configuration.
+ */
+int mqtt_outbox_limit(void)
+{
+    return MQTT_OUTBOX_LIMIT_BYTES;
+}
+
+/**
+ * @brief Updates the connection state of the MQTT client.
+ *
+ * Called from the MQTT event handler on MQTT_EVENT_CONNECTED / MQTT_EVENT_DISCONNECTED, waking up any task blocked
+ * in mqtt_wait_connected().
+ *
+ * @param connected Whether the client is connected to the broker.
+ */
+void mqtt_set_connected(bool connected)
+{
+    mqtt_connected = connected;
+    if (mqtt_event_group == NULL)
+    {
+        return;
+    }
+    if (connected)
+    {
+        xEventGroupSetBits(mqtt_event_group, MQTT_CONNECTED_BIT);
     }
     else
     {
-        ESP_LOGE(MQTTTAG, "MQTT not connected. Cannot publish message.");
+        xEventGroupClearBits(mqtt_event_group, MQTT_CONNECTED_BIT);
     }
 }
+
+/**
+ * @brief Blocks until the MQTT client is connected to the broker.
+ *
+ * @param timeout Maximum time to wait, in ticks (portMAX_DELAY to wait forever).
+ * @return true if connected, false if the timeout expired.
+ */
+bool mqtt_wait_connected(TickType_t timeout)
+{
+    EventBits_t bits = xEventGroupWaitBits(mqtt_event_group, MQTT_CONNECTED_BIT, pdFALSE, pdTRUE, timeout);
+    return (bits & MQTT_CONNECTED_BIT) != 0;
+}
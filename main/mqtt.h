@@ -1,3 +1,7 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
 // A struct used for passing the JSON message to the /aggregate topic
 typedef struct {
     char node_id[11];       // UID with space for null-terminator
@@ -10,4 +14,24 @@ typedef struct {
     char details[256];        // Details with space for null-terminator (max 256 characters)
 } EnergyMessage;
 
-void mqtt_app_start(void);
\ No newline at end of file
+// Outbox metrics of the non-blocking publish path
+typedef struct {
+    uint32_t enqueued;          // Messages enqueued since boot
+    uint32_t dropped;           // Messages dropped because the outbox was full or the client disconnected (QoS 0)
+    int outbox_bytes;           // Current occupancy of the outbox
+    int outbox_peak_bytes;      // Highest occupancy seen
+    bool congested;             // Whether the occupancy is above the high watermark (until it drops below the low one)
+} mqtt_outbox_stats_t;
+
+// Called when the outbox becomes congested (true) or drains (false), with its occupancy in bytes
+typedef void (*mqtt_backpressure_cb_t)(bool congested, int outbox_bytes, void *ctx);
+
+void mqtt_app_start(void);
+void mqtt_set_connected(bool connected);
+bool mqtt_wait_connected(TickType_t timeout);
+int mqtt_publish_binary(const char *topic, const uint8_t *data, int len, int qos);
+void mqtt_set_backpressure_callback(mqtt_backpressure_cb_t callback, void *ctx);
+void mqtt_get_outbox_stats(mqtt_outbox_stats_t *stats);
+void mqtt_outbox_check(void);
+void mqtt_outbox_monitor_start(void);
+int mqtt_outbox_limit(void);
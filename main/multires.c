@@ -0,0 +1,322 @@
+#include "multires.h"
+#include <math.h>
+#include <string.h>
+#include "cJSON.h"
+
+// Span of a bucket of each level, in base buckets
+static const uint32_t level_span[MULTIRES_LEVELS] = {1, 4, 16, 64, 256, 1024};
+
+static void stats_clear(multires_stats_t *stats)
+{
+    memset(stats, 0, sizeof(multires_stats_t));
+    stats->min = INFINITY;
+    stats->max = -INFINITY;
+}
+
+static void stats_merge(multires_stats_t *into, const multires_stats_t *from)
+{
+    into->count += from->count;
+    into->min = fminf(into->min, from->min);
+    into->max = fmaxf(into->max, from->max);
+    into->sum += from->sum;
+    into->sum_squares += from->sum_squares;
+}
+
+/**
+ * @brief Clears the history and the windows being filled, keeping the registered windows.
+ *
+ * @param multires The aggregator.
+ * @param sampling_frequency The sampling frequency of the stream in Hz.
+ */
+void multires_reset(multires_t *multires, float sampling_frequency)
+{
+    multires->sampling_frequency = sampling_frequency;
+    multires->bucket_time = 0;
+    for (int l = 0; l < MULTIRES_LEVELS; l++) {
+        stats_clear(&multires->levels[l].current);
+        multires->levels[l].completed = 0;
+    }
+    for (int w = 0; w < multires->n_windows; w++) {
+        multires->windows[w].buckets = 0;
+        multires->windows[w].ready = false;
+        stats_clear(&multires->windows[w].stats);
+    }
+}
+
+/**
+ * @brief Changes the sampling frequency of the stream, keeping the history.
+ *
+ * The stream time already elapsed in the current base bucket is kept, the remaining part being sampled at the new
+ * frequency, so the buckets keep lasting MULTIRES_BASE_SECONDS of stream time.
+ *
+ * @param multires The aggregator.
+ * @param sampling_frequency The new sampling frequency in Hz.
+ */
+void multires_set_rate(multires_t *multires, float sampling_frequency)
+{
+    multires->sampling_frequency = sampling_frequency;
+}
+
+/**
+ * @brief Unregisters all the tumbling windows.
+ */
+void multires_clear_windows(multires_t *multires)
+{
+    multires->n_windows = 0;
+}
+
+/**
+ * @brief Registers a tumbling window, its first occurrence ending at the next multiple of its length since the reset.
+ *
+ * @param multires The aggregator.
+ * @param seconds The length of the window, a multiple of MULTIRES_BASE_SECONDS.
+ * @return The index of the window, or -1 if the length is invalid or no more windows can be registered.
+ */
+int multires_add_window(multires_t *multires, uint32_t seconds)
+{
+    if (seconds == 0 || seconds % MULTIRES_BASE_SECONDS != 0 || multires->n_windows >= MULTIRES_MAX_WINDOWS) {
+        return -1;
+    }
+    multires_window_t *window = &multires->windows[multires->n_windows];
+    window->seconds = seconds;
+    window->ready = false;
+    stats_clear(&window->stats);
+    // Align with the buckets already completed, so the window ends on a multiple of its length
+    window->buckets = multires->levels[0].completed % (seconds / MULTIRES_BASE_SECONDS);
+    return multires->n_windows++;
+}
+
+/**
+ * @brief Returns the number of samples left until the current base bucket is complete (at least 1).
+ *
+ * Reading at most this many samples before calling multires_update() lets the caller stop right when a window ends.
+ */
+int multires_samples_to_boundary(const multires_t *multires)
+{
+    int samples = (int)ceilf((MULTIRES_BASE_SECONDS - multires->bucket_time) * multires->sampling_frequency - 1e-3f);
+    return samples > 0 ? samples : 1;
+}
+
+/**
+ * @brief Completes the current bucket of a level, merging it into the level above and completing that one too if it
+ * holds MULTIRES_FANOUT buckets.
+ */
+static void close_bucket(multires_t *multires, int level)
+{
+    multires_level_t *current = &multires->levels[level];
+    current->ring[current->completed % MULTIRES_RING] = current->current;
+    current->completed++;
+    if (level + 1 < MULTIRES_LEVELS) {
+        stats_merge(&multires->levels[level + 1].current, &current->current);
+        if (current->completed % MULTIRES_FANOUT == 0) {
+            close_bucket(multires, level + 1);
+        }
+    }
+    stats_clear(&current->current);
+}
+
+/**
+ * @brief Completes the current base bucket, updating the pyramid and the registered windows.
+ *
+ * O(1) amortized: a level is only updated once every MULTIRES_FANOUT buckets of the level below.
+ */
+static void close_base_bucket(multires_t *multires)
+{
+    const multires_stats_t *bucket = &multires->levels[0].current;
+    for (int w = 0; w < multires->n_windows; w++) {
+        multires_window_t *window = &multires->windows[w];
+        stats_merge(&window->stats, bucket);
+        if (++window->buckets >= window->seconds / MULTIRES_BASE_SECONDS) {
+            window->result = window->stats;
+            window->ready = true;
+            window->buckets = 0;
+            stats_clear(&window->stats);
+        }
+    }
+    close_bucket(multires, 0);
+}
+
+/**
+ * @brief Adds samples to the stream, in O(1) amortized per sample.
+ *
+ * The samples of each base bucket are summed in single precision before being merged, the sums of the buckets are
+ * kept in double precision for the long windows.
+ *
+ * @param multires The aggregator.
+ * @param samples The samples.
+ * @param len The number of samples.
+ */
+void multires_update(multires_t *multires, const float *samples, int len)
+{
+    while (len > 0) {
+        int boundary = multires_samples_to_boundary(multires);
+        int n = len < boundary ? len : boundary;
+
+        multires_stats_t *bucket = &multires->levels[0].current;
+        float sum = 0, sum_squares = 0, min_value = bucket->min, max_value = bucket->max;
+        for (int i = 0; i < n; i++) {
+            float x = samples[i];
+            sum += x;
+            sum_squares += x * x;
+            min_value = fminf(min_value, x);
+            max_value = fmaxf(max_value, x);
+        }
+        bucket->count += n;
+        bucket->sum += sum;
+        bucket->sum_squares += sum_squares;
+        bucket->min = min_value;
+        bucket->max = max_value;
+
+        // The part of the last sample period past the boundary is carried over, so a bucket holds
+        // sampling_frequency * MULTIRES_BASE_SECONDS samples on average even at a non-integer frequency
+        multires->bucket_time += n / multires->sampling_frequency;
+        if (n == boundary) {
+            close_base_bucket(multires);
+            multires->bucket_time = fmaxf(multires->bucket_time - MULTIRES_BASE_SECONDS, 0);
+        }
+        samples += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief Returns the statistics of a registered window if one completed since the last call.
+ *
+ * @param multires The aggregator.
+ * @param index The index returned by multires_add_window().
+ * @param stats Output statistics of the window.
+ * @return true if a window completed, false otherwise.
+ */
+bool multires_window_ready(multires_t *multires, int index, multires_stats_t *stats)
+{
+    if (index < 0 || index >= multires->n_windows || !multires->windows[index].ready) {
+        return false;
+    }
+    *stats = multires->windows[index].result;
+    multires->windows[index].ready = false;
+    return true;
+}
+
+/**
+ * @brief Computes the statistics of the last seconds of the stream from the pyramid, without any acquisition.
+ *
+ * The range ends at the last complete base bucket. Its start is rounded down to the finest level still holding the
+ * bucket that contains it, so older ranges have a coarser resolution, and clamped to the oldest history kept.
+ * The range is then covered from its end with the coarsest aligned buckets, at most 2 * (MULTIRES_FANOUT - 1) per
+ * level.
+ *
+ * @param multires The aggregator.
+ * @param seconds The requested length in seconds.
+ * @param stats Output statistics of the range.
+ * @return The length actually covered in seconds, 0 if there is no history.
+ */
+uint32_t multires_query(const multires_t *multires, uint32_t seconds, multires_stats_t *stats)
+{
+    stats_clear(stats);
+    uint32_t end = multires->levels[0].completed;
+    uint32_t requested = seconds / MULTIRES_BASE_SECONDS;
+    uint32_t start = requested < end ? end - requested : 0;
+
+    // Round the start to the finest level holding it
+    int level = 0;
+    while (level < MULTIRES_LEVELS) {
+        const multires_level_t *bucket_level = &multires->levels[level];
+        uint32_t oldest = bucket_level->completed > MULTIRES_RING ? bucket_level->completed - MULTIRES_RING : 0;
+        if (start / level_span[level] >= oldest) {
+            start = start / level_span[level] * level_span[level];
+            break;
+        }
+        level++;
+    }
+    if (level == MULTIRES_LEVELS) {
+        // Older than the history: start at the oldest bucket of the top level
+        const multires_level_t *top = &multires->levels[MULTIRES_LEVELS - 1];
+        start = (top->completed > MULTIRES_RING ? top->completed - MULTIRES_RING : 0) * level_span[MULTIRES_LEVELS - 1];
+    }
+
+    uint32_t position = end;
+    level = 0;
+    while (position > start) {
+        while (level + 1 < MULTIRES_LEVELS && position % level_span[level + 1] == 0 && position - start >= level_span[level + 1]) {
+            level++;
+        }
+        while (position - start < level_span[level]) {
+            level--;
+        }
+        uint32_t k = position / level_span[level] - 1;
+        stats_merge(stats, &multires->levels[level].ring[k % MULTIRES_RING]);
+        position -= level_span[level];
+    }
+    return (end - start) * MULTIRES_BASE_SECONDS;
+}
+
+/**
+ * @brief Returns the mean of the statistics, 0 if empty.
+ */
+float multires_mean(const multires_stats_t *stats)
+{
+    return stats->count > 0 ? (float)(stats->sum / stats->count) : 0;
+}
+
+/**
+ * @brief Returns the standard deviation of the statistics, 0 if empty.
+ */
+float multires_std(const multires_stats_t *stats)
+{
+    if (stats->count == 0) {
+        return 0;
+    }
+    double mean = stats->sum / stats->count;
+    double variance = stats->sum_squares / stats->count - mean * mean;
+    return variance > 0 ? (float)sqrt(variance) : 0;
+}
+
+/**
+ * @brief Parses a request of a consumer: {"windows": [60, 300], "query": [120]}, both fields being optional.
+ *
+ * "windows" replaces the rollup windows registered besides the aggregation window, "query" asks for the statistics
+ * of the last seconds from the history.
+ *
+ * @param json The JSON message.
+ * @param len The length of the message.
+ * @param request Output request.
+ * @return true if the message is valid, false otherwise.
+ */
+bool multires_parse_request(const char *json, int len, multires_request_t *request)
+{
+    cJSON *root = cJSON_ParseWithLength(json, len);
+    if (root == NULL) {
+        return false;
+    }
+    request->n_windows = -1;
+    request->n_queries = 0;
+    bool valid = true;
+
+    const cJSON *windows = cJSON_GetObjectItemCaseSensitive(root, "windows");
+    if (windows != NULL) {
+        valid = cJSON_IsArray(windows) && cJSON_GetArraySize(windows) < MULTIRES_MAX_WINDOWS;
+        request->n_windows = 0;
+        const cJSON *item;
+        cJSON_ArrayForEach(item, windows) {
+            if (!valid || !cJSON_IsNumber(item) || item->valueint <= 0 || item->valueint % MULTIRES_BASE_SECONDS != 0) {
+                valid = false;
+                break;
+            }
+            request->windows[request->n_windows++] = item->valueint;
+        }
+    }
+    const cJSON *queries = cJSON_GetObjectItemCaseSensitive(root, "query");
+    if (valid && queries != NULL) {
+        valid = cJSON_IsArray(queries) && cJSON_GetArraySize(queries) <= MULTIRES_MAX_WINDOWS;
+        const cJSON *item;
+        cJSON_ArrayForEach(item, queries) {
+            if (!valid || !cJSON_IsNumber(item) || item->valueint <= 0) {
+                valid = false;
+                break;
+            }
+            request->queries[request->n_queries++] = item->valueint;
+        }
+    }
+    cJSON_Delete(root);
+    return valid;
+}
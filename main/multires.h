@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Pyramid of buckets: the base buckets last MULTIRES_BASE_SECONDS of stream time, and each level groups MULTIRES_FANOUT
+// buckets of the level below (1, 4, 16, 64, 256 and 1024 s). The last MULTIRES_RING complete buckets of every level
+// are kept, so the resolution of the history degrades with its age: 16 s at 1 s, 64 s at 4 s... up to about 4.5 h.
+#define MULTIRES_BASE_SECONDS 1
+#define MULTIRES_FANOUT 4
+#define MULTIRES_LEVELS 6
+#define MULTIRES_RING 16
+
+// Maximum number of registered tumbling windows
+#define MULTIRES_MAX_WINDOWS 4
+
+// Statistics of a set of samples, mergeable
+typedef struct {
+    uint32_t count;
+    float min;
+    float max;
+    double sum;
+    double sum_squares;
+} multires_stats_t;
+
+typedef struct {
+    multires_stats_t ring[MULTIRES_RING];   // Last complete buckets, bucket k in ring[k % MULTIRES_RING]
+    multires_stats_t current;               // Bucket being filled
+    uint32_t completed;                     // Number of complete buckets
+} multires_level_t;
+
+// Tumbling window of a whole number of base buckets, aligned with the start of the stream
+typedef struct {
+    uint32_t seconds;
+    uint32_t buckets;           // Base buckets merged into stats so far
+    multires_stats_t stats;     // Statistics of the window being filled
+    bool ready;
+    multires_stats_t result;    // Statistics of the last complete window, valid while ready
+} multires_window_t;
+
+typedef struct {
+    float sampling_frequency;
+    float bucket_time;          // Stream time elapsed in the current base bucket, in seconds
+    multires_level_t levels[MULTIRES_LEVELS];
+    int n_windows;
+    multires_window_t windows[MULTIRES_MAX_WINDOWS];
+} multires_t;
+
+// Runtime request of a consumer, see multires_parse_request()
+typedef struct {
+    int n_windows;              // -1 to keep the registered windows
+    uint32_t windows[MULTIRES_MAX_WINDOWS];
+    int n_queries;
+    uint32_t queries[MULTIRES_MAX_WINDOWS];
+} multires_request_t;
+
+void multires_reset(multires_t *multires, float sampling_frequency);
+void multires_set_rate(multires_t *multires, float sampling_frequency);
+void multires_clear_windows(multires_t *multires);
+int multires_add_window(multires_t *multires, uint32_t seconds);
+int multires_samples_to_boundary(const multires_t *multires);
+void multires_update(multires_t *multires, const float *samples, int len);
+bool multires_window_ready(multires_t *multires, int index, multires_stats_t *stats);
+uint32_t multires_query(const multires_t *multires, uint32_t seconds, multires_stats_t *stats);
+float multires_mean(const multires_stats_t *stats);
+float multires_std(const multires_stats_t *stats);
+bool multires_parse_request(const char *json, int len, multires_request_t *request);
@@ -0,0 +1,98 @@
+#include "report_policy.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * @brief Initializes the reporting policy, forgetting any previously sent value.
+ *
+ * @param policy The policy to be initialized.
+ * @param mode The reporting mode.
+ * @param deadband_abs The absolute dead-band.
+ * @param deadband_rel The dead-band relative to the reference value.
+ * @param heartbeat_windows The maximum number of windows without publishing (0 to disable).
+ */
+void report_policy_init(report_policy_t *policy, report_mode_t mode, float deadband_abs, float deadband_rel, int heartbeat_windows)
+{
+    memset(policy, 0, sizeof(report_policy_t));
+    policy->mode = mode;
+    policy->deadband_abs = deadband_abs;
+    policy->deadband_rel = deadband_rel;
+    policy->heartbeat_windows = heartbeat_windows;
+}
+
+/**
+ * @brief Returns the value the edge server expects for a window, from the values sent so far.
+ *
+ * In dead-band mode it is the last value sent (zero-order hold). In predictive mode it is the linear extrapolation
+ * of the last two values sent, which is exactly what the edge server computes for the windows it doesn't receive.
+ *
+ * @param policy The policy.
+ * @param window The window index.
+ * @return The predicted value.
+ */
+float report_policy_predict(const report_policy_t *policy, uint32_t window)
+{
+    if (policy->sent_count == 0) {
+        return 0;
+    }
+    if (policy->mode != REPORT_PREDICTIVE || policy->sent_count < 2) {
+        return policy->last_value[0];
+    }
+    float slope = (policy->last_value[0] - policy->last_value[1]) / (float)(policy->last_window[0] - policy->last_window[1]);
+    return policy->last_value[0] + slope * (float)(window - policy->last_window[0]);
+}
+
+/**
+ * @brief Decides whether the aggregated value of the next window has to be published.
+ *
+ * The value is sent when it differs from the edge's prediction by more than max(deadband_abs, deadband_rel * |prediction|),
+ * when nothing was sent yet, or when heartbeat_windows windows went by in silence. The window counter always advances.
+ *
+ * @param policy The policy.
+ * @param value The aggregated value of the window.
+ * @param window Output: the index of the window, to be sent along with the value.
+ * @return true if the value has to be published.
+ */
+bool report_policy_should_send(report_policy_t *policy, float value, uint32_t *window)
+{
+    *window = policy->window++;
+
+    bool send = true;
+    if (policy->mode != REPORT_ALWAYS && policy->sent_count > 0) {
+        float prediction = report_policy_predict(policy, *window);
+        float bound = fmaxf(policy->deadband_abs, policy->deadband_rel * fabsf(prediction));
+        bool heartbeat_due = policy->heartbeat_windows > 0 && *window - policy->last_window[0] >= (uint32_t)policy->heartbeat_windows;
+        send = fabsf(value - prediction) > bound || heartbeat_due;
+    }
+
+    if (!send) {
+        policy->total_suppressed++;
+        return false;
+    }
+
+    policy->last_window[1] = policy->last_window[0];
+    policy->last_value[1] = policy->last_value[0];
+    policy->last_window[0] = *window;
+    // Keep the value as published (3 decimals), so that the prediction matches the edge server's one
+    policy->last_value[0] = roundf(value * 1000) / 1000;
+    if (policy->sent_count < 2) {
+        policy->sent_count++;
+    }
+    policy->total_sent++;
+    return true;
+}
+
+/**
+ * @brief Returns the name of a reporting mode, as used in the published messages.
+ */
+const char *report_policy_mode_name(report_mode_t mode)
+{
+    switch (mode) {
+    case REPORT_DEADBAND:
+        return "deadband";
+    case REPORT_PREDICTIVE:
+        return "predictive";
+    default:
+        return "always";
+    }
+}
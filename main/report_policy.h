@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Reporting modes for the aggregated values
+typedef enum {
+    REPORT_ALWAYS = 0,      // Publish every window (original behavior)
+    REPORT_DEADBAND = 1,    // Publish when the value moved more than the dead-band from the last value sent
+    REPORT_PREDICTIVE = 2,  // Publish when the value deviates more than the dead-band from the edge's linear extrapolation
+} report_mode_t;
+
+// Reporting policy state, mirroring what the edge server knows about the node
+typedef struct {
+    report_mode_t mode;
+    float deadband_abs;         // Absolute dead-band
+    float deadband_rel;         // Dead-band relative to the reference value (0.1 = 10%)
+    int heartbeat_windows;      // Maximum number of windows without publishing, 0 to disable the heartbeat
+
+    uint32_t window;            // Index of the next window
+    int sent_count;             // Number of values sent so far (0, 1 or 2 are meaningful for the extrapolation)
+    uint32_t last_window[2];    // Windows of the last two values sent, most recent first
+    float last_value[2];        // Last two values sent, most recent first
+
+    uint32_t total_sent;        // Statistics since the policy was configured
+    uint32_t total_suppressed;
+} report_policy_t;
+
+void report_policy_init(report_policy_t *policy, report_mode_t mode, float deadband_abs, float deadband_rel, int heartbeat_windows);
+bool report_policy_should_send(report_policy_t *policy, float value, uint32_t *window);
+float report_policy_predict(const report_policy_t *policy, uint32_t window);
+const char *report_policy_mode_name(report_mode_t mode);
@@ -0,0 +1,118 @@
+#include "resource_stats.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "mqtt.h"
+
+/**
+ * @brief Clears the counters, the first snapshot then reporting the loads since boot.
+ */
+void resource_stats_init(resource_stats_state_t *state)
+{
+    memset(state, 0, sizeof(resource_stats_state_t));
+}
+
+/**
+ * @brief Takes a snapshot of the resources of the node: CPU load and stack high-water mark of each task, free heap
+ * against its largest free block, and occupancy of the MQTT outbox.
+ *
+ * The loads need the FreeRTOS run-time stats (CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS) and the list of tasks needs the
+ * trace facility (CONFIG_FREERTOS_USE_TRACE_FACILITY). Without them the loads are -1 and the list is empty, while the
+ * heap and the outbox are still reported. The loads are shares of all the cores, so they add up to 100 % with the idle
+ * tasks, over the period since the previous snapshot (or since boot for the first one, and for a task created since).
+ *
+ * @param state The counters of the previous snapshot, updated.
+ * @param stats The output snapshot.
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the list of tasks could not be allocated (the heap and the outbox are
+ *         still reported).
+ */
+esp_err_t resource_stats_collect(resource_stats_state_t *state, resource_stats_t *stats)
+{
+    memset(stats, 0, sizeof(resource_stats_t));
+    stats->uptime_us = esp_timer_get_time();
+    stats->cpu = -1;
+    stats->heap_free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    stats->heap_largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    stats->heap_min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+
+    mqtt_outbox_stats_t outbox;
+    mqtt_get_outbox_stats(&outbox);
+    stats->outbox_bytes = outbox.outbox_bytes;
+    stats->outbox_peak_bytes = outbox.outbox_peak_bytes;
+    stats->outbox_dropped = outbox.dropped;
+
+#if configUSE_TRACE_FACILITY
+    // A few more entries than tasks, in case some are created meanwhile
+    UBaseType_t capacity = uxTaskGetNumberOfTasks() + 4;
+    TaskStatus_t *status = (TaskStatus_t *)malloc(capacity * sizeof(TaskStatus_t));
+    if (status == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    configRUN_TIME_COUNTER_TYPE total_runtime = 0;
+    UBaseType_t count = uxTaskGetSystemState(status, capacity, &total_runtime);
+
+#if configGENERATE_RUN_TIME_STATS
+    // Unsigned differences stay correct when the counters wrap around
+    float elapsed = (float)(configRUN_TIME_COUNTER_TYPE)(total_runtime - state->total_runtime) * portNUM_PROCESSORS;
+    float idle = 0;
+#endif
+    resource_stats_state_t next = {.total_runtime = total_runtime};
+    for (UBaseType_t i = 0; i < count && stats->n_tasks < RESOURCE_STATS_MAX_TASKS; i++) {
+        resource_task_stats_t *task = &stats->tasks[stats->n_tasks++];
+        strncpy(task->name, status[i].pcTaskName, sizeof(task->name) - 1);
+        task->stack_free = status[i].usStackHighWaterMark * sizeof(StackType_t);
+        task->cpu = -1;
+#if configGENERATE_RUN_TIME_STATS
+        configRUN_TIME_COUNTER_TYPE previous = 0;
+        for (int j = 0; j < state->n_tasks; j++) {
+            if (state->task_number[j] == status[i].xTaskNumber) {
+                previous = state->runtime[j];
+                break;
+            }
+        }
+        if (elapsed > 0) {
+            task->cpu = 100.0f * (float)(configRUN_TIME_COUNTER_TYPE)(status[i].ulRunTimeCounter - previous) / elapsed;
+            if (strncmp(task->name, "IDLE", 4) == 0) {
+                idle += task->cpu;
+            }
+        }
+        next.task_number[next.n_tasks] = status[i].xTaskNumber;
+        next.runtime[next.n_tasks++] = status[i].ulRunTimeCounter;
+#endif
+    }
+#if configGENERATE_RUN_TIME_STATS
+    if (elapsed > 0) {
+        stats->cpu = 100 - idle;
+    }
+#endif
+    *state = next;
+    free(status);
+#endif
+    return ESP_OK;
+}
+
+/**
+ * @brief Formats a snapshot as the JSON message of the /stats topic, each task as [name, cpu %, free stack bytes]:
+ *   {"node_id":"node000000","uptime":120.0,"cpu":23.4,"heap":{"free":182000,"largest":110592,"min_free":150000},
+ *    "outbox":{"bytes":0,"peak_bytes":1200,"dropped":0},"tasks":[["main",21.3,1840],["IDLE0",76.6,1012],...]}
+ *
+ * @return The length of the message, at least size if it was truncated.
+ */
+int resource_stats_to_json(const resource_stats_t *stats, const char *node_id, char *buffer, size_t size)
+{
+    int len = snprintf(buffer, size, "{\"node_id\":\"%s\",\"uptime\":%.1f,\"cpu\":%.1f,\"heap\":{\"free\":%" PRIu32 ",\"largest\":%" PRIu32
+                       ",\"min_free\":%" PRIu32 "},\"outbox\":{\"bytes\":%d,\"peak_bytes\":%d,\"dropped\":%" PRIu32 "},\"tasks\":[",
+                       node_id, stats->uptime_us / 1e6, stats->cpu, stats->heap_free, stats->heap_largest, stats->heap_min_free,
+                       stats->outbox_bytes, stats->outbox_peak_bytes, stats->outbox_dropped);
+    for (int i = 0; i < stats->n_tasks && len < (int)size; i++) {
+        len += snprintf(buffer + len, size - len, "%s[\"%s\",%.1f,%" PRIu32 "]", i == 0 ? "" : ",", stats->tasks[i].name,
+                        stats->tasks[i].cpu, stats->tasks[i].stack_free);
+    }
+    if (len < (int)size) {
+        len += snprintf(buffer + len, size - len, "]}");
+    }
+    return len;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+
+// Number of tasks reported, the others are left out (the system has about 15 tasks with WiFi and MQTT)
+#define RESOURCE_STATS_MAX_TASKS 24
+
+// Resources of one task
+typedef struct {
+    char name[configMAX_TASK_NAME_LEN];
+    float cpu;              // Share of all the cores in % since the previous snapshot, -1 without run-time stats
+    uint32_t stack_free;    // Stack never used since the task started (high-water mark), in bytes
+} resource_task_stats_t;
+
+// Snapshot of the resources of the node
+typedef struct {
+    int64_t uptime_us;
+    float cpu;              // Load of all the cores in % (100 minus the idle tasks) since the previous snapshot, -1 without run-time stats
+    uint32_t heap_free;     // Free 8-bit capable heap
+    uint32_t heap_largest;  // Largest block that can be allocated, well below heap_free when the heap is fragmented
+    uint32_t heap_min_free; // Lowest free heap since boot
+    int outbox_bytes;
+    int outbox_peak_bytes;
+    uint32_t outbox_dropped;
+    int n_tasks;
+    resource_task_stats_t tasks[RESOURCE_STATS_MAX_TASKS];
+} resource_stats_t;
+
+// Run-time counters of the previous snapshot, to turn them into loads over the period between snapshots
+typedef struct {
+    configRUN_TIME_COUNTER_TYPE total_runtime;
+    int n_tasks;
+    UBaseType_t task_number[RESOURCE_STATS_MAX_TASKS];
+    configRUN_TIME_COUNTER_TYPE runtime[RESOURCE_STATS_MAX_TASKS];
+} resource_stats_state_t;
+
+void resource_stats_init(resource_stats_state_t *state);
+esp_err_t resource_stats_collect(resource_stats_state_t *state, resource_stats_t *stats);
+int resource_stats_to_json(const resource_stats_t *stats, const char *node_id, char *buffer, size_t size);
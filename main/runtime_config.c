@@ -0,0 +1,246 @@
+#include "runtime_config.h"
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "cJSON.h"
+
+static const char *CFGTAG = "CONFIG";
+
+// NVS location of the runtime configuration
+#define RUNTIME_CONFIG_NVS_NAMESPACE "runtime"
+#define RUNTIME_CONFIG_NVS_KEY "config"
+
+// Highest sampling rate the node can achieve, as measured by measure_max_sampling_signal() (1 tick = 1 ms)
+#define RUNTIME_CONFIG_MAX_SAMPLING_RATE 1000
+
+/**
+ * @brief Fills the configuration with the values the firmware was originally built with.
+ *
+ * @param config The configuration to be filled.
+ * @param max_fft_size The largest FFT size supported by the node.
+ */
+void runtime_config_default(runtime_config_t *config, int max_fft_size)
+{
+    *config = (runtime_config_t){
+        .min_sampling_rate = 1,
+        .max_sampling_rate = 100,
+        .time_window = 5,
+        .fft_size = max_fft_size,
+        .db_threshold = 0.0,
+        .publish_batch = 1,
+        .publish_qos = 0,
+        .report_mode = 0,
+        .deadband_abs = 0.05,
+        .deadband_rel = 0,
+        .heartbeat_windows = 12,
+    };
+}
+
+/**
+ * @brief Checks that every parameter of the configuration is within its bounds.
+ *
+ * @return true if the configuration can be applied.
+ */
+static bool runtime_config_is_valid(const runtime_config_t *config, int max_fft_size)
+{
+    bool fft_size_valid = config->fft_size >= 64 && config->fft_size <= max_fft_size &&
+                          (config->fft_size & (config->fft_size - 1)) == 0;
+    return config->min_sampling_rate >= 1 && config->max_sampling_rate <= RUNTIME_CONFIG_MAX_SAMPLING_RATE &&
+           config->min_sampling_rate <= config->max_sampling_rate && config->time_window >= 1 &&
+           config->time_window <= 600 && fft_size_valid && config->db_threshold >= -100 &&
+           config->db_threshold <= 100 && config->publish_batch >= 1 &&
+           config->publish_batch <= RUNTIME_CONFIG_MAX_BATCH && config->publish_qos <= 2 && config->report_mode <= 2 &&
+           config->deadband_abs >= 0 && config->deadband_rel >= 0 && config->deadband_rel <= 10 &&
+           config->heartbeat_windows <= 1000;
+}
+
+/**
+ * @brief Reads an integer field, checking its raw value before it is narrowed to the type of the field, so that an out
+ * of range value is rejected instead of wrapping into a valid one (e.g. a time_window of 65537 into 1).
+ *
+ * @return true if the value is an integer between min and max, false otherwise (including a missing item).
+ */
+bool json_get_int_in_range(const cJSON *item, int min, int max, int *value)
+{
+    if (!cJSON_IsNumber(item)) {
+        return false;
+    }
+    double raw = item->valuedouble;
+    if (raw != floor(raw) || raw < min || raw > max) {
+        return false;
+    }
+    *value = (int)raw;
+    return true;
+}
+
+/**
+ * @brief Reads a float field, checking that its raw value fits in a float.
+ *
+ * @return true if the value is finite as a float.
+ */
+static bool json_get_float(const cJSON *item, float *value)
+{
+    if (!cJSON_IsNumber(item) || !isfinite(item->valuedouble) || fabs(item->valuedouble) > FLT_MAX) {
+        return false;
+    }
+    *value = (float)item->valuedouble;
+    return true;
+}
+
+/**
+ * @brief Applies a partial update received on the control topic.
+ *
+ * Only the fields present in the JSON object are changed, e.g. {"db_threshold": -3.0, "publish_batch": 4}.
+ * Each raw value is range-checked before being narrowed to the type of its field, then the update is validated as a
+ * whole on a copy, so an invalid message leaves the configuration untouched.
+ *
+ * @param config The configuration to be updated.
+ * @param json The JSON payload (not necessarily null-terminated).
+ * @param len The length of the payload.
+ * @param max_fft_size The largest FFT size supported by the node.
+ * @return The number of fields changed, or -1 if the payload is invalid.
+ */
+int runtime_config_update_from_json(runtime_config_t *config, const char *json, int len, int max_fft_size)
+{
+    cJSON *root = cJSON_ParseWithLength(json, len);
+    if (!cJSON_IsObject(root)) {
+        ESP_LOGE(CFGTAG, "Invalid configuration: expected a JSON object");
+        cJSON_Delete(root);
+        return -1;
+    }
+
+    runtime_config_t updated = *config;
+    int changed = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, root) {
+        if (!cJSON_IsNumber(item)) {
+            ESP_LOGE(CFGTAG, "Invalid configuration: %s is not a number", item->string);
+            cJSON_Delete(root);
+            return -1;
+        }
+        int value = 0;
+        bool in_range;
+        if (strcmp(item->string, "min_sampling_rate") == 0) {
+            in_range = json_get_float(item, &updated.min_sampling_rate);
+        } else if (strcmp(item->string, "max_sampling_rate") == 0) {
+            in_range = json_get_float(item, &updated.max_sampling_rate);
+        } else if (strcmp(item->string, "time_window") == 0) {
+            in_range = json_get_int_in_range(item, 1, 600, &value);
+            updated.time_window = value;
+        } else if (strcmp(item->string, "fft_size") == 0) {
+            in_range = json_get_int_in_range(item, 64, max_fft_size, &value);
+            updated.fft_size = value;
+        } else if (strcmp(item->string, "db_threshold") == 0) {
+            in_range = json_get_float(item, &updated.db_threshold);
+        } else if (strcmp(item->string, "publish_batch") == 0) {
+            in_range = json_get_int_in_range(item, 1, RUNTIME_CONFIG_MAX_BATCH, &value);
+            updated.publish_batch = value;
+        } else if (strcmp(item->string, "publish_qos") == 0) {
+            in_range = json_get_int_in_range(item, 0, 2, &value);
+            updated.publish_qos = value;
+        } else if (strcmp(item->string, "report_mode") == 0) {
+            in_range = json_get_int_in_range(item, 0, 2, &value);
+            updated.report_mode = value;
+        } else if (strcmp(item->string, "deadband_abs") == 0) {
+            in_range = json_get_float(item, &updated.deadband_abs);
+        } else if (strcmp(item->string, "deadband_rel") == 0) {
+            in_range = json_get_float(item, &updated.deadband_rel);
+        } else if (strcmp(item->string, "heartbeat_windows") == 0) {
+            in_range = json_get_int_in_range(item, 0, 1000, &value);
+            updated.heartbeat_windows = value;
+        } else {
+            ESP_LOGE(CFGTAG, "Invalid configuration: unknown parameter %s", item->string);
+            cJSON_Delete(root);
+            return -1;
+        }
+        if (!in_range) {
+            ESP_LOGE(CFGTAG, "Invalid configuration: %s out of range", item->string);
+            cJSON_Delete(root);
+            return -1;
+        }
+        changed++;
+    }
+    cJSON_Delete(root);
+
+    if (!runtime_config_is_valid(&updated, max_fft_size)) {
+        ESP_LOGE(CFGTAG, "Invalid configuration: parameter out of range");
+        return -1;
+    }
+
+    *config = updated;
+    return changed;
+}
+
+/**
+ * @brief Loads the configuration stored in NVS, falling back to the defaults if there is none or it is invalid.
+ *
+ * @param config The loaded configuration.
+ * @param max_fft_size The largest FFT size supported by the node.
+ * @return ESP_OK if a stored configuration was loaded, otherwise the error and the defaults are used.
+ */
+esp_err_t runtime_config_load(runtime_config_t *config, int max_fft_size)
+{
+    runtime_config_default(config, max_fft_size);
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(RUNTIME_CONFIG_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    runtime_config_t stored;
+    size_t size = sizeof(stored);
+    err = nvs_get_blob(handle, RUNTIME_CONFIG_NVS_KEY, &stored, &size);
+    nvs_close(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (size != sizeof(stored) || !runtime_config_is_valid(&stored, max_fft_size)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    *config = stored;
+    return ESP_OK;
+}
+
+/**
+ * @brief Stores the configuration in NVS so that it survives a reboot.
+ *
+ * @param config The configuration to be stored.
+ * @return ESP_OK on success, otherwise the NVS error.
+ */
+esp_err_t runtime_config_store(const runtime_config_t *config)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(RUNTIME_CONFIG_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(handle, RUNTIME_CONFIG_NVS_KEY, config, sizeof(runtime_config_t));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+/**
+ * @brief Formats the configuration as a JSON object, in the same format accepted on the control topic.
+ *
+ * @param config The configuration.
+ * @param json Output buffer.
+ * @param len The size of the output buffer.
+ * @return The length of the JSON string.
+ */
+int runtime_config_to_json(const runtime_config_t *config, char *json, int len)
+{
+    return snprintf(json, len,
+                    "{\"min_sampling_rate\":%.3f,\"max_sampling_rate\":%.3f,\"time_window\":%d,\"fft_size\":%d,"
+                    "\"db_threshold\":%.3f,\"publish_batch\":%d,\"publish_qos\":%d,\"report_mode\":%d,"
+                    "\"deadband_abs\":%.4f,\"deadband_rel\":%.4f,\"heartbeat_windows\":%d}",
+                    config->min_sampling_rate, config->max_sampling_rate, config->time_window, config->fft_size,
+                    config->db_threshold, config->publish_batch, config->publish_qos, config->report_mode,
+                    config->deadband_abs, config->deadband_rel, config->heartbeat_windows);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "cJSON.h"
+
+// Maximum number of windows that can be batched in one publish
+#define RUNTIME_CONFIG_MAX_BATCH 16
+
+// Tuning parameters that can be changed at runtime over the control topic
+typedef struct {
+    float min_sampling_rate;    // Lower bound of the adaptive sampling rate in Hz
+    float max_sampling_rate;    // Upper bound of the adaptive sampling rate in Hz, also the rate used for the FFT
+    uint16_t time_window;       // Tumbling window in seconds
+    uint16_t fft_size;          // Number of samples of the FFT (power of two, at most N_SAMPLES)
+    float db_threshold;         // Threshold passed to find_highest_frequency_peak_above_db_level()
+    uint8_t publish_batch;      // Number of windows aggregated before publishing them in one message
+    uint8_t publish_qos;        // QoS of the /average publishes
+    uint8_t report_mode;        // Reporting policy (report_mode_t): 0 always, 1 dead-band, 2 predictive
+    float deadband_abs;         // Absolute dead-band of the reporting policy
+    float deadband_rel;         // Relative dead-band of the reporting policy (0.1 = 10%)
+    uint16_t heartbeat_windows; // Maximum number of windows without publishing, 0 to disable
+} runtime_config_t;
+
+void runtime_config_default(runtime_config_t *config, int max_fft_size);
+int runtime_config_update_from_json(runtime_config_t *config, const char *json, int len, int max_fft_size);
+esp_err_t runtime_config_load(runtime_config_t *config, int max_fft_size);
+esp_err_t runtime_config_store(const runtime_config_t *config);
+int runtime_config_to_json(const runtime_config_t *config, char *json, int len);
+bool json_get_int_in_range(const cJSON *item, int min, int max, int *value);
@@ -0,0 +1,163 @@
+#include "spectral_change.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * @brief Clears the baseline, the next spectrum becoming the new baseline.
+ */
+void spectral_baseline_reset(spectral_baseline_t *baseline)
+{
+    memset(baseline, 0, sizeof(spectral_baseline_t));
+}
+
+/**
+ * @brief Returns whether a sketch can be compared with the baseline: same sampling frequency, FFT size and threshold.
+ */
+bool spectral_baseline_comparable(const spectral_baseline_t *baseline, const spectral_sketch_t *sketch)
+{
+    return baseline->valid && baseline->sampling_frequency == sketch->sampling_frequency &&
+           baseline->fft_size == sketch->fft_size && baseline->db_level == sketch->db_level;
+}
+
+/**
+ * @brief Returns the largest difference in dB between the peaks of a list and those of the other list: the change of
+ * level of a peak matched within the tolerance, or the height above the threshold of a peak without a match.
+ */
+static float peak_distance_db(const spectral_peak_t *peaks, int n_peaks, const spectral_peak_t *others, int n_others,
+                              float tolerance, float db_level)
+{
+    float distance = 0;
+    for (int i = 0; i < n_peaks && i < SPECTRAL_CHANGE_PEAKS; i++) {
+        float difference = peaks[i].db - db_level;
+        float nearest = tolerance;
+        for (int j = 0; j < n_others && j < SPECTRAL_CHANGE_PEAKS; j++) {
+            float offset = fabsf(peaks[i].frequency - others[j].frequency);
+            if (offset <= nearest) {
+                nearest = offset;
+                difference = fabsf(peaks[i].db - others[j].db);
+            }
+        }
+        distance = fmaxf(distance, difference);
+    }
+    return distance;
+}
+
+/**
+ * @brief Computes the distance in dB between a new spectrum and the baseline, in O(bands + peaks^2).
+ *
+ * The distance is the largest of:
+ * - the RMS difference of the band envelopes, each band clamped to SPECTRAL_CHANGE_FLOOR_DB below the threshold so
+ *   that the fluctuations of the noise floor don't count,
+ * - the change of level of the strongest peaks, or the height above the threshold of a peak that appeared or vanished,
+ *   i.e., that has no peak of the other spectrum within two bins.
+ * A new tone, or a tone changing level, is then detected even if the envelope of the other bands is unchanged.
+ *
+ * @param baseline The baseline, comparable with the sketch (spectral_baseline_comparable()).
+ * @param sketch The sketch of the new spectrum.
+ * @return The distance in dB.
+ */
+float spectral_change_distance(const spectral_baseline_t *baseline, const spectral_sketch_t *sketch)
+{
+    float floor_db = sketch->db_level - SPECTRAL_CHANGE_FLOOR_DB;
+    float sum_squares = 0;
+    for (int b = 0; b < SPECTRAL_SKETCH_BANDS; b++) {
+        float difference = fmaxf(sketch->bands[b], floor_db) - fmaxf(baseline->bands[b], floor_db);
+        sum_squares += difference * difference;
+    }
+    float distance = sqrtf(sum_squares / SPECTRAL_SKETCH_BANDS);
+
+    float tolerance = 2 * sketch->sampling_frequency / sketch->fft_size;
+    distance = fmaxf(distance, peak_distance_db(sketch->peaks, sketch->n_peaks, baseline->peaks, baseline->n_peaks, tolerance, sketch->db_level));
+    distance = fmaxf(distance, peak_distance_db(baseline->peaks, baseline->n_peaks, sketch->peaks, sketch->n_peaks, tolerance, sketch->db_level));
+    return distance;
+}
+
+/**
+ * @brief Returns whether the highest peak above the threshold moved by more than two bins since the baseline, or
+ * appeared or vanished.
+ *
+ * The strongest peaks compared by spectral_change_distance() can miss a weak tone above the others, which is the one
+ * that sets the sampling rate, so the highest frequency of the full spectrum is compared on its own.
+ *
+ * @param baseline The baseline, comparable with the sketch (spectral_baseline_comparable()).
+ * @param sketch The sketch of the new spectrum.
+ * @param highest_frequency The highest peak above the threshold in the new spectrum in Hz, -1 for none.
+ * @return true if the highest frequency changed.
+ */
+bool spectral_highest_frequency_moved(const spectral_baseline_t *baseline, const spectral_sketch_t *sketch, float highest_frequency)
+{
+    if ((highest_frequency > 0) != (baseline->highest_frequency > 0)) {
+        return true;
+    }
+    float tolerance = 2 * sketch->sampling_frequency / sketch->fft_size;
+    return highest_frequency > 0 && fabsf(highest_frequency - baseline->highest_frequency) > tolerance;
+}
+
+/**
+ * @brief Updates the baseline with a new spectrum.
+ *
+ * After a change, or if the baseline is not comparable, the new spectrum becomes the baseline. Otherwise the envelope
+ * is averaged with an exponential decay, so slow drifts don't accumulate into a change, and the peaks are replaced.
+ * The highest frequency is only taken with a new baseline, so that it stays the one the sampling rate was chosen for.
+ *
+ * @param baseline The baseline.
+ * @param sketch The sketch of the new spectrum.
+ * @param highest_frequency The highest peak above the threshold in the new spectrum in Hz, -1 for none.
+ * @param changed Whether the spectrum changed.
+ * @param decay The weight of the new envelope, between 0 and 1.
+ */
+void spectral_baseline_update(spectral_baseline_t *baseline, const spectral_sketch_t *sketch, float highest_frequency, bool changed,
+                              float decay)
+{
+    if (changed || !spectral_baseline_comparable(baseline, sketch)) {
+        baseline->valid = true;
+        baseline->sampling_frequency = sketch->sampling_frequency;
+        baseline->fft_size = sketch->fft_size;
+        baseline->db_level = sketch->db_level;
+        memcpy(baseline->bands, sketch->bands, sizeof(baseline->bands));
+        baseline->highest_frequency = highest_frequency;
+        baseline->stationary = 0;
+    } else {
+        for (int b = 0; b < SPECTRAL_SKETCH_BANDS; b++) {
+            baseline->bands[b] += decay * (sketch->bands[b] - baseline->bands[b]);
+        }
+        baseline->stationary++;
+    }
+    baseline->n_peaks = sketch->n_peaks < SPECTRAL_CHANGE_PEAKS ? sketch->n_peaks : SPECTRAL_CHANGE_PEAKS;
+    memcpy(baseline->peaks, sketch->peaks, baseline->n_peaks * sizeof(spectral_peak_t));
+}
+
+/**
+ * @brief Formats a spectral change as the JSON message of the /spectral_change topic, with the peaks of the new
+ * spectrum and of the baseline it differs from (none for a first baseline, with a distance of -1):
+ *   {"node_id":"node000000","fs":100.0,"n":4096,"distance":23.5,"peaks":[[20.01,33.2],...],"previous":[[5.00,35.1],...]}
+ *
+ * @param baseline The baseline before the update.
+ * @param sketch The sketch of the new spectrum.
+ * @param distance The distance in dB, -1 if the baseline was not comparable.
+ * @param node_id The node id.
+ * @param buffer The output buffer.
+ * @param size The size of the output buffer.
+ * @return The length of the message.
+ */
+int spectral_change_to_json(const spectral_baseline_t *baseline, const spectral_sketch_t *sketch, float distance,
+                            const char *node_id, char *buffer, size_t size)
+{
+    int len = snprintf(buffer, size, "{\"node_id\":\"%s\",\"fs\":%.3f,\"n\":%d,\"distance\":%.2f,\"peaks\":[",
+                       node_id, sketch->sampling_frequency, sketch->fft_size, distance);
+    for (int i = 0; i < sketch->n_peaks && i < SPECTRAL_CHANGE_PEAKS && len < (int)size; i++) {
+        len += snprintf(buffer + len, size - len, "%s[%.4f,%.2f]", i == 0 ? "" : ",", sketch->peaks[i].frequency, sketch->peaks[i].db);
+    }
+    if (len < (int)size) {
+        len += snprintf(buffer + len, size - len, "],\"previous\":[");
+    }
+    int n_previous = distance >= 0 ? baseline->n_peaks : 0;
+    for (int i = 0; i < n_previous && len < (int)size; i++) {
+        len += snprintf(buffer + len, size - len, "%s[%.4f,%.2f]", i == 0 ? "" : ",", baseline->peaks[i].frequency, baseline->peaks[i].db);
+    }
+    if (len < (int)size) {
+        len += snprintf(buffer + len, size - len, "]}");
+    }
+    return len;
+}
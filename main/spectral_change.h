@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "spectral_sketch.h"
+
+// Number of strongest peaks kept in the baseline fingerprint
+#define SPECTRAL_CHANGE_PEAKS 4
+
+// Bands more than this many dB below the peak threshold are considered noise floor and compared at that level
+#define SPECTRAL_CHANGE_FLOOR_DB 30.0f
+
+// Baseline fingerprint of a stationary spectrum: band envelope averaged with decay and the strongest peaks
+typedef struct {
+    bool valid;
+    float sampling_frequency;
+    int fft_size;
+    float db_level;
+    float bands[SPECTRAL_SKETCH_BANDS];
+    int n_peaks;
+    spectral_peak_t peaks[SPECTRAL_CHANGE_PEAKS];   // Strongest first
+    float highest_frequency;                        // Highest peak above db_level in the full spectrum when the baseline was taken, in Hz (-1 for none)
+    uint32_t stationary;                            // Consecutive spectra within the threshold since the last change
+} spectral_baseline_t;
+
+void spectral_baseline_reset(spectral_baseline_t *baseline);
+bool spectral_baseline_comparable(const spectral_baseline_t *baseline, const spectral_sketch_t *sketch);
+float spectral_change_distance(const spectral_baseline_t *baseline, const spectral_sketch_t *sketch);
+bool spectral_highest_frequency_moved(const spectral_baseline_t *baseline, const spectral_sketch_t *sketch, float highest_frequency);
+void spectral_baseline_update(spectral_baseline_t *baseline, const spectral_sketch_t *sketch, float highest_frequency, bool changed,
+                              float decay);
+int spectral_change_to_json(const spectral_baseline_t *baseline, const spectral_sketch_t *sketch, float distance,
+                            const char *node_id, char *buffer, size_t size);
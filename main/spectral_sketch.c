@@ -0,0 +1,115 @@
+#include "spectral_sketch.h"
+#include <stdio.h>
+#include <string.h>
+#include "cJSON.h"
+
+/**
+ * @brief Builds the sketch of a power spectrum: its strongest peaks and its envelope.
+ *
+ * The peaks are the local maxima above the dB level, their frequency refined by fitting a parabola through the bin
+ * and its two neighbours, which recovers part of the resolution lost by using a small FFT.
+ *
+ * @param power_spectrum The power spectrum in dB, fft_size / 2 bins are used.
+ * @param fft_size The number of points of the FFT.
+ * @param sampling_frequency The sampling frequency in Hz.
+ * @param db_level The dB level above which local maxima are peaks.
+ * @param sketch The output sketch.
+ */
+void spectral_sketch_build(const float *power_spectrum, int fft_size, float sampling_frequency, float db_level, spectral_sketch_t *sketch)
+{
+    int n_bins = fft_size / 2;
+    memset(sketch, 0, sizeof(spectral_sketch_t));
+    sketch->sampling_frequency = sampling_frequency;
+    sketch->fft_size = fft_size;
+    sketch->db_level = db_level;
+
+    for (int i = 1; i < n_bins - 1; i++) {
+        float value = power_spectrum[i];
+        if (value <= db_level || value < power_spectrum[i - 1] || value <= power_spectrum[i + 1]) {
+            continue;
+        }
+
+        // Insert in the list, strongest first, dropping the weakest if it is full
+        int position = sketch->n_peaks;
+        while (position > 0 && sketch->peaks[position - 1].db < value) {
+            position--;
+        }
+        if (position >= SPECTRAL_SKETCH_PEAKS) {
+            continue;
+        }
+        int last = sketch->n_peaks < SPECTRAL_SKETCH_PEAKS ? sketch->n_peaks : SPECTRAL_SKETCH_PEAKS - 1;
+        memmove(&sketch->peaks[position + 1], &sketch->peaks[position], (last - position) * sizeof(spectral_peak_t));
+        if (sketch->n_peaks < SPECTRAL_SKETCH_PEAKS) {
+            sketch->n_peaks++;
+        }
+
+        float left = power_spectrum[i - 1], right = power_spectrum[i + 1];
+        float curvature = left - 2 * value + right;
+        float offset = curvature < 0 ? 0.5f * (left - right) / curvature : 0;
+        sketch->peaks[position].frequency = (i + offset) * sampling_frequency / fft_size;
+        sketch->peaks[position].db = value;
+    }
+
+    int bins_per_band = n_bins / SPECTRAL_SKETCH_BANDS;
+    for (int b = 0; b < SPECTRAL_SKETCH_BANDS; b++) {
+        float max_value = -100.0;
+        for (int i = b * bins_per_band; i < (b + 1) * bins_per_band; i++) {
+            if (power_spectrum[i] > max_value) {
+                max_value = power_spectrum[i];
+            }
+        }
+        sketch->bands[b] = max_value;
+    }
+}
+
+/**
+ * @brief Formats a sketch as the JSON message of the /spectrum topic:
+ *   {"node_id":"node000000","fs":100.0,"n":512,"db_level":0.0,"peaks":[[5.01,33.2],...],"bands":[12.1,...]}
+ *
+ * @param sketch The sketch.
+ * @param node_id The node id.
+ * @param buffer The output buffer.
+ * @param size The size of the output buffer.
+ * @return The length of the message, at least size if it was truncated.
+ */
+int spectral_sketch_to_json(const spectral_sketch_t *sketch, const char *node_id, char *buffer, size_t size)
+{
+    int len = snprintf(buffer, size, "{\"node_id\":\"%s\",\"fs\":%.3f,\"n\":%d,\"db_level\":%.2f,\"peaks\":[",
+                       node_id, sketch->sampling_frequency, sketch->fft_size, sketch->db_level);
+    for (int i = 0; i < sketch->n_peaks && len < (int)size; i++) {
+        len += snprintf(buffer + len, size - len, "%s[%.4f,%.2f]", i == 0 ? "" : ",", sketch->peaks[i].frequency, sketch->peaks[i].db);
+    }
+    if (len < (int)size) {
+        len += snprintf(buffer + len, size - len, "],\"bands\":[");
+    }
+    for (int b = 0; b < SPECTRAL_SKETCH_BANDS && len < (int)size; b++) {
+        len += snprintf(buffer + len, size - len, "%s%.1f", b == 0 ? "" : ",", sketch->bands[b]);
+    }
+    if (len < (int)size) {
+        len += snprintf(buffer + len, size - len, "]}");
+    }
+    return len;
+}
+
+/**
+ * @brief Parses the sampling rate recommended by the edge server: {"sampling_rate":10.2,"highest_frequency":5.1}
+ *
+ * @param json The JSON message.
+ * @param len The length of the message.
+ * @param sampling_rate Output recommended sampling rate in Hz.
+ * @return true if the message holds a positive sampling rate, false otherwise.
+ */
+bool spectral_rate_parse(const char *json, int len, float *sampling_rate)
+{
+    cJSON *root = cJSON_ParseWithLength(json, len);
+    if (root == NULL) {
+        return false;
+    }
+    cJSON *rate = cJSON_GetObjectItemCaseSensitive(root, "sampling_rate");
+    bool valid = cJSON_IsNumber(rate) && rate->valuedouble > 0;
+    if (valid) {
+        *sampling_rate = (float)rate->valuedouble;
+    }
+    cJSON_Delete(root);
+    return valid;
+}
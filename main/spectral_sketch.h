@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Number of strongest peaks and of bands of the spectral envelope sent in a sketch
+#define SPECTRAL_SKETCH_PEAKS 8
+#define SPECTRAL_SKETCH_BANDS 32
+
+typedef struct {
+    float frequency;    // Hz, interpolated between bins
+    float db;           // Power in dB
+} spectral_peak_t;
+
+// Compact summary of a power spectrum, uploaded to the edge server instead of running the analysis on the node
+typedef struct {
+    float sampling_frequency;
+    int fft_size;
+    float db_level;                             // Threshold the edge server should apply to the peaks
+    int n_peaks;
+    spectral_peak_t peaks[SPECTRAL_SKETCH_PEAKS];  // Local maxima above db_level, strongest first
+    float bands[SPECTRAL_SKETCH_BANDS];         // Maximum dB over each of SPECTRAL_SKETCH_BANDS equal bands up to Nyquist
+} spectral_sketch_t;
+
+void spectral_sketch_build(const float *power_spectrum, int fft_size, float sampling_frequency, float db_level, spectral_sketch_t *sketch);
+int spectral_sketch_to_json(const spectral_sketch_t *sketch, const char *node_id, char *buffer, size_t size);
+bool spectral_rate_parse(const char *json, int len, float *sampling_rate);
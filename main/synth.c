@@ -0,0 +1,133 @@
+#include "synth.h"
+#include <math.h>
+
+// Input signals of the assignment, equivalent to input_signal_1/2/3 in main.c
+const synth_signal_t synth_signals[3] = {
+    // Input Signal 1: 2*sin(2*pi*3*t)+4*sin(2*pi*5*t)
+    {.n_tones = 2, .tones = {{2, 3, 0}, {4, 5, 0}}, .noise_std = 0, .seed = 1},
+    // Input Signal 2: 1*sin(2*pi*2*t) + 2*sin(2*pi*20*t) + 3*sin(2*pi*100*t)
+    {.n_tones = 3, .tones = {{1, 2, 0}, {2, 20, 0}, {3, 100, 0}}, .noise_std = 0, .seed = 1},
+    // Input Signal 3: 3sin(2*pi*150*t)
+    {.n_tones = 1, .tones = {{3, 150, 0}}, .noise_std = 0, .seed = 1},
+};
+
+// Quarter wave of sin() in Q15, 257 entries for a 1024 entry full wave with the end point included for interpolation
+static const int16_t quarter_sine[257] = {
+    0, 201, 402, 603, 804, 1005, 1206, 1407, 1608, 1809, 2009, 2210,
+    2410, 2611, 2811, 3012, 3212, 3412, 3612, 3811, 4011, 4210, 4410, 4609,
+    4808, 5007, 5205, 5404, 5602, 5800, 5998, 6195, 6393, 6590, 6786, 6983,
+    7179, 7375, 7571, 7767, 7962, 8157, 8351, 8545, 8739, 8933, 9126, 9319,
+    9512, 9704, 9896, 10087, 10278, 10469, 10659, 10849, 11039, 11228, 11417, 11605,
+    11793, 11980, 12167, 12353, 12539, 12725, 12910, 13094, 13279, 13462, 13645, 13828,
+    14010, 14191, 14372, 14553, 14732, 14912, 15090, 15269, 15446, 15623, 15800, 15976,
+    16151, 16325, 16499, 16673, 16846, 17018, 17189, 17360, 17530, 17700, 17869, 18037,
+    18204, 18371, 18537, 18703, 18868, 19032, 19195, 19357, 19519, 19680, 19841, 20000,
+    20159, 20317, 20475, 20631, 20787, 20942, 21096, 21250, 21403, 21554, 21705, 21856,
+    22005, 22154, 22301, 22448, 22594, 22739, 22884, 23027, 23170, 23311, 23452, 23592,
+    23731, 23870, 24007, 24143, 24279, 24413, 24547, 24680, 24811, 24942, 25072, 25201,
+    25329, 25456, 25582, 25708, 25832, 25955, 26077, 26198, 26319, 26438, 26556, 26674,
+    26790, 26905, 27019, 27133, 27245, 27356, 27466, 27575, 27683, 27790, 27896, 28001,
+    28105, 28208, 28310, 28411, 28510, 28609, 28706, 28803, 28898, 28992, 29085, 29177,
+    29268, 29358, 29447, 29534, 29621, 29706, 29791, 29874, 29956, 30037, 30117, 30195,
+    30273, 30349, 30424, 30498, 30571, 30643, 30714, 30783, 30852, 30919, 30985, 31050,
+    31113, 31176, 31237, 31297, 31356, 31414, 31470, 31526, 31580, 31633, 31685, 31736,
+    31785, 31833, 31880, 31926, 31971, 32014, 32057, 32098, 32137, 32176, 32213, 32250,
+    32285, 32318, 32351, 32382, 32412, 32441, 32469, 32495, 32521, 32545, 32567, 32589,
+    32609, 32628, 32646, 32663, 32678, 32692, 32705, 32717, 32728, 32737, 32745, 32752,
+    32757, 32761, 32765, 32766, 32767,
+};
+
+// Standard deviation of the sum of four uniform int16 values, relative to the Q15 full scale (2 * 65536 / sqrt(12) / 32768)
+#define SYNTH_NOISE_SUM_STD (2.0 * 65536.0 / 3.4641016151377544 / 32768.0)
+
+// Value of the 1024 entry sine table at the given index, using the quarter wave symmetry
+static inline int32_t sine_table(uint32_t index)
+{
+    uint32_t i = index & 255;
+    switch ((index >> 8) & 3) {
+    case 0:
+        return quarter_sine[i];
+    case 1:
+        return quarter_sine[256 - i];
+    case 2:
+        return -quarter_sine[i];
+    default:
+        return -quarter_sine[256 - i];
+    }
+}
+
+// Sine of a 32-bit phase in Q15, linearly interpolated between table entries
+static inline int32_t sine_q15(uint32_t phase)
+{
+    uint32_t index = phase >> 22;
+    int32_t frac = (phase >> 6) & 0xFFFF;
+    int32_t a = sine_table(index);
+    int32_t b = sine_table(index + 1);
+    return a + (((b - a) * frac) >> 16);
+}
+
+static inline uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/**
+ * @brief Prepares the generator of a signal at a sampling frequency, starting at t = 0.
+ *
+ * Frequencies, phases and amplitudes are converted once to integer phase steps and Q16.16 amplitudes, so that the
+ * generation itself only uses integer arithmetic and produces bit-identical output on the ESP32 and on a host.
+ *
+ * @param source The generator state to be initialized.
+ * @param signal The description of the signal.
+ * @param sampling_frequency The sampling frequency in Hz.
+ */
+void synth_source_init(synth_source_t *source, const synth_signal_t *signal, float sampling_frequency)
+{
+    source->n_tones = signal->n_tones < SYNTH_MAX_TONES ? signal->n_tones : SYNTH_MAX_TONES;
+    for (int i = 0; i < source->n_tones; i++) {
+        const synth_tone_t *tone = &signal->tones[i];
+        double turns = fmod((double)tone->phase / (2 * M_PI), 1.0);
+        source->phase[i] = (uint32_t)(int64_t)llround((turns < 0 ? turns + 1 : turns) * 4294967296.0);
+        source->phase_step[i] = (uint32_t)(int64_t)llround(fmod((double)tone->frequency / sampling_frequency, 1.0) * 4294967296.0);
+        source->amplitude[i] = (int32_t)lround((double)tone->amplitude * 65536.0);
+    }
+    source->noise_scale = (int32_t)lround((double)signal->noise_std / SYNTH_NOISE_SUM_STD * 65536.0);
+    source->rng = signal->seed != 0 ? signal->seed : 1;
+}
+
+/**
+ * @brief Generates the next block of samples.
+ *
+ * Each tone is a phase accumulator indexing an interpolated sine table, so the cost per sample is a few integer
+ * operations per tone instead of a double precision sin(). The noise is the sum of four uniform values from a
+ * xorshift generator (Irwin-Hall), close to gaussian. Consecutive calls continue the signal without discontinuity.
+ *
+ * @param source The generator state.
+ * @param output Output array for the samples.
+ * @param len The number of samples to generate.
+ */
+void synth_source_generate(synth_source_t *source, float *output, int len)
+{
+    for (int n = 0; n < len; n++) {
+        // Sum of Q16.16 amplitudes times Q15 sines, in Q31
+        int64_t acc = 0;
+        for (int i = 0; i < source->n_tones; i++) {
+            acc += (int64_t)source->amplitude[i] * sine_q15(source->phase[i]);
+            source->phase[i] += source->phase_step[i];
+        }
+
+        if (source->noise_scale != 0) {
+            uint32_t a = xorshift32(&source->rng);
+            uint32_t b = xorshift32(&source->rng);
+            int32_t sum = (int16_t)a + (int16_t)(a >> 16) + (int16_t)b + (int16_t)(b >> 16);
+            acc += (int64_t)source->noise_scale * sum;
+        }
+
+        output[n] = (float)acc * (1.0f / 2147483648.0f);
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+// Maximum number of tones in a synthetic signal
+#define SYNTH_MAX_TONES 8
+
+// One sinusoidal component: amplitude * sin(2*pi*frequency*t + phase)
+typedef struct {
+    float amplitude;
+    float frequency;    // Hz
+    float phase;        // radians
+} synth_tone_t;
+
+// Declarative description of a synthetic signal: a sum of tones plus zero-mean noise
+typedef struct {
+    int n_tones;
+    synth_tone_t tones[SYNTH_MAX_TONES];
+    float noise_std;    // Standard deviation of the (approximately gaussian) noise, 0 for none
+    uint32_t seed;      // Seed of the noise generator, non-zero
+} synth_signal_t;
+
+// Generator state for one signal at one sampling frequency
+typedef struct {
+    int n_tones;
+    uint32_t phase[SYNTH_MAX_TONES];        // Phase accumulators, 2^32 = one full turn
+    uint32_t phase_step[SYNTH_MAX_TONES];   // Phase increment per sample
+    int32_t amplitude[SYNTH_MAX_TONES];     // Amplitudes in Q16.16
+    int32_t noise_scale;                    // Noise scale in Q16.16
+    uint32_t rng;                           // xorshift32 state of the noise generator
+} synth_source_t;
+
+// The three input signals of the assignment
+extern const synth_signal_t synth_signals[3];
+
+void synth_source_init(synth_source_t *source, const synth_signal_t *signal, float sampling_frequency);
+void synth_source_generate(synth_source_t *source, float *output, int len);
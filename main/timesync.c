@@ -0,0 +1,112 @@
+#include "timesync.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "cJSON.h"
+#include "esp_log.h"
+
+static const char *SYNCTAG = "TIMESYNC";
+
+/**
+ * @brief Initializes the clock synchronization, with no offset known yet.
+ *
+ * @param sync The synchronization state.
+ */
+void timesync_init(timesync_t *sync)
+{
+    memset(sync, 0, sizeof(timesync_t));
+}
+
+/**
+ * @brief Builds a synchronization request, to be published to the /timesync topic.
+ *
+ * The request carries the node clock at the time it is sent (t1), which the edge server echoes back along with its
+ * own clock when it received the request (t2) and when it sent the response (t3):
+ *   {"node_id":"node000000","seq":3,"t1":123456789}
+ *
+ * @param seq The sequence number of the request.
+ * @param node_id The node id, so the edge server knows where to respond.
+ * @param now_us The node clock in microseconds.
+ * @param buffer The output buffer.
+ * @param size The size of the output buffer.
+ * @return The length of the request.
+ */
+int timesync_build_request(uint32_t seq, const char *node_id, int64_t now_us, char *buffer, size_t size)
+{
+    return snprintf(buffer, size, "{\"node_id\":\"%s\",\"seq\":%" PRIu32 ",\"t1\":%lld}", node_id, seq, (long long)now_us);
+}
+
+/**
+ * @brief Handles a synchronization response, updating the clock offset.
+ *
+ * As in NTP, the offset of one exchange is ((t2 - t1) + (t3 - t4)) / 2, which is exact if the network delay is the
+ * same in both directions, with an error of at most half the round trip (t4 - t1) - (t3 - t2) otherwise. Out of the
+ * last TIMESYNC_SAMPLES exchanges, the one with the smallest round trip, the least delayed by queuing, is used.
+ *
+ * @param sync The synchronization state.
+ * @param data The JSON response: {"seq":3,"t1":123456789,"t2":1718000000000000,"t3":1718000000000100}
+ * @param len The length of the response.
+ * @param now_us The node clock when the response was received (t4) in microseconds.
+ * @return true if the response was valid, false otherwise.
+ */
+bool timesync_handle_response(timesync_t *sync, const char *data, int len, int64_t now_us)
+{
+    cJSON *root = cJSON_ParseWithLength(data, len);
+    if (root == NULL) {
+        ESP_LOGE(SYNCTAG, "Invalid synchronization response");
+        return false;
+    }
+    cJSON *t1 = cJSON_GetObjectItemCaseSensitive(root, "t1");
+    cJSON *t2 = cJSON_GetObjectItemCaseSensitive(root, "t2");
+    cJSON *t3 = cJSON_GetObjectItemCaseSensitive(root, "t3");
+    if (!cJSON_IsNumber(t1) || !cJSON_IsNumber(t2) || !cJSON_IsNumber(t3)) {
+        ESP_LOGE(SYNCTAG, "Synchronization response without timestamps");
+        cJSON_Delete(root);
+        return false;
+    }
+    // Microsecond epoch timestamps fit in the 53-bit mantissa of the doubles parsed by cJSON
+    int64_t request_sent = (int64_t)t1->valuedouble;
+    int64_t request_received = (int64_t)t2->valuedouble;
+    int64_t response_sent = (int64_t)t3->valuedouble;
+    cJSON_Delete(root);
+
+    timesync_sample_t sample = {
+        .offset_us = ((request_received - request_sent) + (response_sent - now_us)) / 2,
+        .rtt_us = (now_us - request_sent) - (response_sent - request_received),
+    };
+    if (sample.rtt_us < 0) {
+        ESP_LOGE(SYNCTAG, "Synchronization response with a negative round trip, ignoring it");
+        return false;
+    }
+
+    sync->samples[sync->next] = sample;
+    sync->next = (sync->next + 1) % TIMESYNC_SAMPLES;
+    if (sync->count < TIMESYNC_SAMPLES) {
+        sync->count++;
+    }
+
+    const timesync_sample_t *best = &sync->samples[0];
+    for (int i = 1; i < sync->count; i++) {
+        if (sync->samples[i].rtt_us < best->rtt_us) {
+            best = &sync->samples[i];
+        }
+    }
+    sync->offset_us = best->offset_us;
+    sync->rtt_us = best->rtt_us;
+    sync->valid = true;
+    ESP_LOGI(SYNCTAG, "Clock offset %lld us (round trip %lld us, this exchange %lld us)", (long long)sync->offset_us,
+             (long long)sync->rtt_us, (long long)sample.rtt_us);
+    return true;
+}
+
+/**
+ * @brief Converts a time of the node clock to the edge server clock.
+ *
+ * @param sync The synchronization state.
+ * @param local_us The time on the node clock (esp_timer) in microseconds.
+ * @return The time on the edge server clock in microseconds since the epoch.
+ */
+int64_t timesync_to_edge_us(const timesync_t *sync, int64_t local_us)
+{
+    return local_us + sync->offset_us;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of most recent exchanges kept, the offset of the one with the smallest round trip is used
+#define TIMESYNC_SAMPLES 8
+
+// One request/response exchange: t1 request sent and t4 response received on the node clock,
+// t2 request received and t3 response sent on the edge clock, all in microseconds
+typedef struct {
+    int64_t offset_us;  // Edge clock minus node clock
+    int64_t rtt_us;     // Round trip excluding the time spent on the edge
+} timesync_sample_t;
+
+// Clock synchronization state, estimating the offset between the node clock (esp_timer) and the edge server clock
+typedef struct {
+    uint32_t seq;               // Sequence number of the next request
+    timesync_sample_t samples[TIMESYNC_SAMPLES];
+    int count;
+    int next;
+    int64_t offset_us;
+    int64_t rtt_us;
+    bool valid;
+} timesync_t;
+
+void timesync_init(timesync_t *sync);
+int timesync_build_request(uint32_t seq, const char *node_id, int64_t now_us, char *buffer, size_t size);
+bool timesync_handle_response(timesync_t *sync, const char *data, int len, int64_t now_us);
+int64_t timesync_to_edge_us(const timesync_t *sync, int64_t local_us);
@@ -0,0 +1,108 @@
+#include "zoom_fft.h"
+#include <math.h>
+#include <stdint.h>
+#include "esp_dsp.h"
+#include "esp_log.h"
+
+static const char *ZOOMTAG = "ZOOM";
+
+// Q factors of the two biquads of a 4th order Butterworth low-pass filter
+static const float butterworth_q[2] = {0.54119610f, 1.3065630f};
+
+// Largest decimation factor supported, bounding the block buffers on the stack
+#define ZOOM_FFT_MAX_DECIMATION 128
+
+/**
+ * @brief Analyzes a narrow band around a center frequency with a fine resolution (zoom-FFT).
+ *
+ * The input is streamed D samples at a time: each block is mixed down by the center frequency (complex NCO), low-pass
+ * filtered by a 4th order Butterworth on the I and Q channels (cut-off at 0.8 times the new Nyquist) and decimated by
+ * keeping its last sample. After M decimated samples, a Hann windowed M-point complex FFT gives a resolution of
+ * fs / (D * M), i.e. D * M / N times finer than an N-point FFT over the whole band, while only M complex values are
+ * stored: the work buffer can be the coarse FFT buffer itself.
+ *
+ * @param config The zoom configuration.
+ * @param next_sample Callback returning the next input sample (D * M are read).
+ * @param ctx Context passed to the callback.
+ * @param work Complex work array (re, im interleaved) of 2 * M floats, aligned to 16 bytes.
+ * @param spectrum Output power spectrum in dB of M floats, in natural frequency order (lowest frequency first), on the
+ *        scale of a reference_fft_size-point coarse spectrum.
+ * @return The frequency of the strongest peak above the dB level in Hz, or -1 if there is none.
+ */
+float zoom_fft_run(const zoom_fft_config_t *config, zoom_fft_sample_fn_t next_sample, void *ctx, float *work, float *spectrum)
+{
+    int d = config->decimation;
+    int m = config->fft_size;
+    if (d < 1 || d > ZOOM_FFT_MAX_DECIMATION) {
+        ESP_LOGE(ZOOMTAG, "Unsupported decimation factor %d", d);
+        return -1;
+    }
+
+    // Low-pass filter, one pair of biquads per channel
+    float coeffs[2][5];
+    float state_i[2][2] = {{0}}, state_q[2][2] = {{0}};
+    for (int s = 0; s < 2; s++) {
+        dsps_biquad_gen_lpf_f32(coeffs[s], 0.8f * 0.5f / d, butterworth_q[s]);
+    }
+
+    // NCO: 32-bit phase accumulator running at -center_frequency
+    uint32_t phase = 0;
+    uint32_t phase_step = (uint32_t)(int64_t)llround(-(double)config->center_frequency / config->sampling_frequency * 4294967296.0);
+
+    float block_i[ZOOM_FFT_MAX_DECIMATION];
+    float block_q[ZOOM_FFT_MAX_DECIMATION];
+    for (int k = 0; k < m; k++) {
+        // Mix down one block of D samples
+        for (int n = 0; n < d; n++) {
+            float x = next_sample(ctx);
+            float angle = (float)phase * (float)(2 * M_PI / 4294967296.0);
+            block_i[n] = x * cosf(angle);
+            block_q[n] = x * sinf(angle);
+            phase += phase_step;
+        }
+
+        // Filter in place and keep the last sample of the block
+        for (int s = 0; s < 2; s++) {
+            dsps_biquad_f32(block_i, block_i, d, coeffs[s], state_i[s]);
+            dsps_biquad_f32(block_q, block_q, d, coeffs[s], state_q[s]);
+        }
+        work[k * 2 + 0] = block_i[d - 1];
+        work[k * 2 + 1] = block_q[d - 1];
+    }
+
+    // Windowed complex FFT of the decimated band
+    for (int k = 0; k < m; k++) {
+        float w = 0.5f - 0.5f * cosf(2 * (float)M_PI * k / m);
+        work[k * 2 + 0] *= w;
+        work[k * 2 + 1] *= w;
+    }
+    dsps_fft2r_fc32(work, m);
+    dsps_bit_rev_fc32(work, m);
+
+    // Power spectrum, rotating the bins so that the negative offsets come first. The mixing halves the amplitude of
+    // a real tone like the real FFT does, and the low-pass filter has a unit gain in its pass band, so the decimation
+    // leaves the amplitude of the tone unchanged. Its level in |X|^2 / M then only differs from the coarse spectrum
+    // (|X|^2 / N) by the FFT lengths, 10 * log10(N / M) dB, which the scale compensates so db_level means the same.
+    float scale = (float)config->reference_fft_size / ((float)m * m);
+    float bin_width = config->sampling_frequency / d / m;
+    float max_value = -100.0;
+    int max_index = -1;
+    for (int k = 0; k < m; k++) {
+        int bin = (k + m / 2) % m;
+        float re = work[bin * 2 + 0];
+        float im = work[bin * 2 + 1];
+        spectrum[k] = 10 * log10f((re * re + im * im) * scale);
+        if (spectrum[k] > config->db_level && spectrum[k] > max_value) {
+            max_value = spectrum[k];
+            max_index = k;
+        }
+    }
+
+    if (max_index == -1) {
+        ESP_LOGW(ZOOMTAG, "No peak above %f dB found around %f Hz.", config->db_level, config->center_frequency);
+        return -1.0;
+    }
+    float frequency = config->center_frequency + (max_index - m / 2) * bin_width;
+    ESP_LOGI(ZOOMTAG, "Zoomed peak: %f Hz with value %f dB (resolution %f Hz)", frequency, max_value, bin_width);
+    return frequency;
+}
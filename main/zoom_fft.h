@@ -0,0 +1,16 @@
+#pragma once
+
+// Callback returning the next sample of the signal being analyzed
+typedef float (*zoom_fft_sample_fn_t)(void *ctx);
+
+// Configuration of one zoom-FFT analysis
+typedef struct {
+    float sampling_frequency;   // Sampling frequency of the input in Hz
+    float center_frequency;     // Center of the band to zoom into in Hz (e.g. the coarse FFT peak)
+    int decimation;             // Decimation factor D: the analyzed band is sampling_frequency / D wide
+    int fft_size;               // Number of points M of the zoomed FFT (power of two)
+    int reference_fft_size;     // Number of points N of the coarse FFT, whose dB scale the zoom spectrum is normalized to
+    float db_level;             // Threshold of the peak search, on the dB scale of the coarse power spectrum
+} zoom_fft_config_t;
+
+float zoom_fft_run(const zoom_fft_config_t *config, zoom_fft_sample_fn_t next_sample, void *ctx, float *work, float *spectrum);